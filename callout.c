@@ -12,18 +12,48 @@
 
 #include "defs.h"
 
-/* the code below implements a callout queue */
-static int id = 0;
-static struct timeout_q  *Q = 0; /* pointer to the beginning of timeout queue */
+/*
+ * The code below implements a callout queue as a hierarchical timing
+ * wheel.  Level 0 has one slot per millisecond, and each of the upper levels
+ * has slots CALLOUT_SLOTS times coarser than the level below.  A timer is
+ * placed on the lowest level which covers its expiry time, and is moved
+ * down a level (cascaded) when the wheel below it wraps around.  Setting,
+ * cancelling and expiring a timer are all O(1); timers are found by id
+ * through a hash.
+ *
+ * The wheel runs on CLOCK_MONOTONIC, so stepping the wall clock does not
+ * make the timers fire early or late.  The longest delay is about 12 days.
+ */
+#define CALLOUT_BITS		6
+#define CALLOUT_SLOTS		(1 << CALLOUT_BITS)
+#define CALLOUT_MASK		(CALLOUT_SLOTS - 1)
+#define CALLOUT_LEVELS		5
+#define CALLOUT_MAX_DELAY	((1 << (CALLOUT_BITS * CALLOUT_LEVELS)) - 1)
 
 struct timeout_q {
-    struct timeout_q *next;		/* next event */
+    struct timeout_q *next;		/* next event in the same slot */
+    struct timeout_q *prev;		/* prev event in the same slot */
+    struct callout_slot *slot;		/* the slot we are linked in */
     int        	     id;  
     cfunc_t          func;    	        /* function to call */
     void	     *data;		/* func's data */
-    int              time;		/* time offset to next event*/
+    u_int32          time;		/* absolute expiry time */
+    hash_entry_t     hash;		/* link in callout_ids */
 };
 
+struct callout_slot {
+    struct timeout_q *head;
+    struct timeout_q *tail;
+};
+
+static int id = 0;
+static u_int32 now = 0;			/* current time of the wheel, in msec */
+static u_int32 last_clock;		/* monotonic clock at the last aging */
+static u_int32 pending = 0;		/* number of timers in the wheel */
+static struct callout_slot wheel[CALLOUT_LEVELS][CALLOUT_SLOTS];
+static hash_table_t callout_ids;	/* index of the timers, by id */
+static pool_t callout_pool;
+
 #if 0
 #define CALLOUT_DEBUG 1
 #define CALLOUT_DEBUG2 1
@@ -34,97 +64,264 @@ static void print_Q((void);
 #define	print_Q()	
 #endif
 
+static void callout_link		(struct callout_slot *, struct timeout_q *);
+static void callout_unlink		(struct timeout_q *);
+static void callout_insert		(struct timeout_q *);
+static void callout_cascade		(int);
+
 void
 callout_init()
 {
-    Q = (struct timeout_q *) 0;
+    memset(wheel, 0, sizeof(wheel));
+    now = 0;
+    pending = 0;
+    last_clock = callout_clock();
+    hash_free(&callout_ids);
+    hash_init(&callout_ids, "Callout", HASH_DEFAULT_SIZE);
+    if (!callout_pool.size)
+	pool_init(&callout_pool, "callout", sizeof(struct timeout_q));
 }
 
 void
 free_all_callouts()
 {
     struct timeout_q *p;
+    int level, i;
     
-    while (Q) {
-	p = Q;
-	Q = Q->next;
-	free(p);
+    for (level = 0; level < CALLOUT_LEVELS; level++) {
+	for (i = 0; i < CALLOUT_SLOTS; i++) {
+	    while ((p = wheel[level][i].head)) {
+		callout_unlink(p);
+		hash_remove(&callout_ids, &p->hash);
+		pool_free(&callout_pool, p);
+	    }
+	}
     }
+    pending = 0;
+}
+
+
+/*
+ * The monotonic clock in milliseconds.  It wraps around every 49 days,
+ * but only differences of it are ever used.
+ */
+u_int32
+callout_clock()
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+	logit(LOG_ERR, errno, "clock_gettime(CLOCK_MONOTONIC)");
+
+    return (u_int32)ts.tv_sec * 1000 + (u_int32)(ts.tv_nsec / 1000000);
 }
 
+/*
+ * Append to the tail of the slot, so timers expiring at the same time are
+ * called in the order they were set.
+ */
+static void
+callout_link(slot, node)
+    struct callout_slot *slot;
+    struct timeout_q *node;
+{
+    node->slot = slot;
+    node->next = NULL;
+    node->prev = slot->tail;
+    if (slot->tail)
+	slot->tail->next = node;
+    else
+	slot->head = node;
+    slot->tail = node;
+}
+
+static void
+callout_unlink(node)
+    struct timeout_q *node;
+{
+    struct callout_slot *slot = node->slot;
+
+    if (node->prev)
+	node->prev->next = node->next;
+    else
+	slot->head = node->next;
+    if (node->next)
+	node->next->prev = node->prev;
+    else
+	slot->tail = node->prev;
+    node->slot = NULL;
+}
 
 /*
- * elapsed_time seconds have passed; perform all the events that should
- * happen.
+ * Put the timer on the lowest level which covers its expiry time.
+ */
+static void
+callout_insert(node)
+    struct timeout_q *node;
+{
+    u_int32 delta = node->time - now;
+    int level;
+
+    for (level = 0; level < CALLOUT_LEVELS - 1; level++) {
+	if (delta < (u_int32)1 << (CALLOUT_BITS * (level + 1)))
+	    break;
+    }
+
+    callout_link(&wheel[level][(node->time >> (CALLOUT_BITS * level)) & CALLOUT_MASK], node);
+}
+
+/*
+ * The wheel below `level' has wrapped around, move the timers of the
+ * current slot of `level' down to the lower levels.
+ */
+static void
+callout_cascade(level)
+    int level;
+{
+    struct callout_slot *slot;
+    struct timeout_q *node;
+
+    slot = &wheel[level][(now >> (CALLOUT_BITS * level)) & CALLOUT_MASK];
+    while ((node = slot->head)) {
+	callout_unlink(node);
+	callout_insert(node);
+    }
+}
+
+
+/*
+ * Catch up with the monotonic clock and perform all the events that
+ * should have happened since the last call.
  */
 void
-age_callout_queue(elapsed_time)
-    int elapsed_time;
+age_callout_queue()
 {
-    struct timeout_q *ptr, *expQ;
+    struct callout_slot expQ = { NULL, NULL };
+    struct callout_slot *slot;
+    struct timeout_q *ptr;
+    u_int32 clock, elapsed_time;
+    int level;
+
+    clock = callout_clock();
+    elapsed_time = clock - last_clock;
+    last_clock = clock;
     
 #ifdef CALLOUT_DEBUG
     IF_DEBUG(DEBUG_TIMEOUT)
-	logit(LOG_DEBUG, 0, "aging queue (elapsed time %d):", elapsed_time);
+	logit(LOG_DEBUG, 0, "aging queue (elapsed time %u msec):", elapsed_time);
     print_Q();
 #endif
-    
-    expQ = Q;
-    ptr = NULL;
-    
-    while (Q) {
-	if (Q->time > elapsed_time) {
-	    Q->time -= elapsed_time;
-	    if (ptr) {
-		ptr->next = NULL;
+
+    /*
+     * Collect all expired timers first, the handlers may set new ones.
+     * Those will not run until the next call, even with a zero delay.
+     */
+    while (1) {
+	slot = &wheel[0][now & CALLOUT_MASK];
+	while ((ptr = slot->head)) {
+	    callout_unlink(ptr);
+	    hash_remove(&callout_ids, &ptr->hash);
+	    pending--;
+	    callout_link(&expQ, ptr);
+	}
+
+	if (!elapsed_time)
+	    break;
+
+	/* Nothing left to wait for, just keep the time */
+	if (!pending) {
+	    now += elapsed_time;
+	    break;
+	}
+
+	elapsed_time--;
+	now++;
+	for (level = 1; level < CALLOUT_LEVELS; level++) {
+	    if ((now >> (CALLOUT_BITS * (level - 1))) & CALLOUT_MASK)
 		break;
-	    }
-	    return;
-	} else {
-	    elapsed_time -= Q->time;
-	    ptr = Q;
-	    Q = Q->next;
 	}
+	/* Cascade from the highest level which has wrapped around */
+	while (--level > 0)
+	    callout_cascade(level);
     }
-    
+
     /* handle queue of expired timers */
-    while (expQ) {
-	ptr = expQ;
+    while ((ptr = expQ.head)) {
+	expQ.head = ptr->next;
 	if (ptr->func)
 	    ptr->func(ptr->data);
-	expQ = expQ->next;
-	free(ptr);
+	pool_free(&callout_pool, ptr);
     }
 }
 
 /*
- * Return in how many seconds age_callout_queue() would like to be called.
- * Return -1 if there are no events pending.
+ * Return in how many milliseconds age_callout_queue() would like to be
+ * called.  Return -1 if there are no events pending.  If the next timer
+ * is still on an upper level, this is the time it needs to be cascaded.
+ * A slot of level 1 may cascade before the first busy slot of level 0
+ * comes around, hence all levels are checked.
  */
 int
 timer_nextTimer()
 {
-    if (Q) {
-	if (Q->time < 0) {
-	    logit(LOG_WARNING, 0, "timer_nextTimer top of queue says %d", 
-		Q->time);
-	    return 0;
+    u_int32 next = ~0;
+    u_int32 base, when, lag;
+    int level, i;
+
+    if (!pending)
+	return -1;
+
+    /* Time spent since the wheel was last brought up to date */
+    lag = callout_clock() - last_clock;
+
+    for (i = 0; i < CALLOUT_SLOTS; i++) {
+	if (wheel[0][(now + i) & CALLOUT_MASK].head) {
+	    next = i;
+	    break;
+	}
+    }
+
+    for (level = 1; level < CALLOUT_LEVELS; level++) {
+	base = now >> (CALLOUT_BITS * level);
+	for (i = 1; i <= CALLOUT_SLOTS; i++) {
+	    if (!wheel[level][(base + i) & CALLOUT_MASK].head)
+		continue;
+
+	    when = ((base + i) << (CALLOUT_BITS * level)) - now;
+	    if (when < next)
+		next = when;
+	    break;
 	}
-	return Q->time;
     }
-    return -1;
+
+    return next > lag ? (int)(next - lag) : 0;
 }
 
 /* 
- * sets the timer
+ * sets the timer, delay is in seconds
  */
 int
 timer_setTimer(delay, action, data)
-    int 	delay;  	/* number of units for timeout */
+    int 	delay;  	/* number of seconds for timeout */
     cfunc_t	action; 	/* function to be called on timeout */
     void  	*data;  	/* what to call the timeout function with */
 {
-    struct     timeout_q  *ptr, *node, *prev;
+    if (delay > CALLOUT_MAX_DELAY / 1000)
+	delay = CALLOUT_MAX_DELAY / 1000;
+
+    return timer_setTimer_ms(delay * 1000, action, data);
+}
+
+/*
+ * sets the timer, delay is in milliseconds
+ */
+int
+timer_setTimer_ms(delay, action, data)
+    int 	delay;  	/* number of msec for timeout */
+    cfunc_t	action; 	/* function to be called on timeout */
+    void  	*data;  	/* what to call the timeout function with */
+{
+    struct     timeout_q  *node;
     
 #ifdef CALLOUT_DEBUG
     IF_DEBUG(DEBUG_TIMEOUT)
@@ -133,70 +330,111 @@ timer_setTimer(delay, action, data)
 #endif
     
     /* create a node */	
-    node = (struct timeout_q *)calloc(1, sizeof(struct timeout_q));
+    node = (struct timeout_q *)pool_alloc(&callout_pool);
     if (!node) {
 	logit(LOG_ERR, 0, "Failed calloc() in timer_settimer\n");
 	return -1;
     }
+    if (delay < 0)
+	delay = 0;
+    if (delay > CALLOUT_MAX_DELAY)
+	delay = CALLOUT_MAX_DELAY;
     node->func = action; 
     node->data = data;
-    node->time = delay; 
-    node->next = 0;	
-    node->id   = ++id;
-    
-    prev = ptr = Q;
-    
-    /* insert node in the queue */
-    
-    /* if the queue is empty, insert the node and return */
-    if (!Q)
-	Q = node;
-    else {
-	/* chase the pointer looking for the right place */
-	while (ptr) {
-	    
-	    if (delay < ptr->time) {
-		/* right place */
-		
-		node->next = ptr;
-		if (ptr == Q)
-		    Q = node;
-		else
-		    prev->next = node;
-		ptr->time -= node->time;
-		print_Q();
-		return node->id;
-	    } else  {
-		/* keep moving */
-		
-		delay -= ptr->time; node->time = delay;
-		prev = ptr;
-		ptr = ptr->next;
-	    }
-	}
-	prev->next = node;
-    }
+    /* The wheel may lag behind the clock while we process packets */
+    node->time = now + (callout_clock() - last_clock) + delay;
+    if (++id <= 0)
+	id = 1;
+    node->id   = id;
+
+    callout_insert(node);
+    hash_insert(&callout_ids, &node->hash, node->id, 0, node);
+    pending++;
+
     print_Q();
     return node->id;
 }
 
-/* returns the time until the timer is scheduled */
+/*
+ * Move a pending timer to expire `delay' seconds from now, keeping its
+ * id, function and data.  Returns FALSE if the timer is not pending
+ * any more, the caller has to set a new one then.
+ */
+int
+timer_rescheduleTimer(timer_id, delay)
+    int		timer_id;
+    int		delay;		/* number of seconds for timeout */
+{
+    if (delay > CALLOUT_MAX_DELAY / 1000)
+	delay = CALLOUT_MAX_DELAY / 1000;
+
+    return timer_rescheduleTimer_ms(timer_id, delay * 1000);
+}
+
+/*
+ * Same as above, delay is in milliseconds
+ */
+int
+timer_rescheduleTimer_ms(timer_id, delay)
+    int		timer_id;
+    int		delay;		/* number of msec for timeout */
+{
+    struct timeout_q *ptr;
+
+    if (!timer_id)
+	return FALSE;
+
+    ptr = (struct timeout_q *)hash_find(&callout_ids, timer_id, 0);
+    if (!ptr)
+	return FALSE;
+
+    if (delay < 0)
+	delay = 0;
+    if (delay > CALLOUT_MAX_DELAY)
+	delay = CALLOUT_MAX_DELAY;
+
+    callout_unlink(ptr);
+    ptr->time = now + (callout_clock() - last_clock) + delay;
+    callout_insert(ptr);
+
+    print_Q();
+    return TRUE;
+}
+
+/* returns the time in seconds, rounded up, until the timer is scheduled */
 int
 timer_leftTimer(timer_id)
     int timer_id;
+{
+    int left;
+
+    left = timer_leftTimer_ms(timer_id);
+    if (left < 0)
+	return -1;
+
+    return (left + 999) / 1000;
+}
+
+/* returns the time in milliseconds until the timer is scheduled */
+int
+timer_leftTimer_ms(timer_id)
+    int timer_id;
 {
     struct timeout_q *ptr;
-    int left = 0;
+    u_int32 left, lag;
 	
     if (!timer_id)
 	return -1;
     
-    for (ptr = Q; ptr; ptr = ptr->next) {
-	left += ptr->time;
-	if (ptr->id == timer_id)
-	    return left;
-    }
-    return -1;
+    ptr = (struct timeout_q *)hash_find(&callout_ids, timer_id, 0);
+    if (!ptr)
+	return -1;
+
+    /* Account for the time spent since the wheel was last aged */
+    left = ptr->time - now;
+    lag = callout_clock() - last_clock;
+
+    return left > lag ? (int)(left - lag) : 0;
 }
 
 /* clears the associated timer */
@@ -204,42 +442,22 @@ void
 timer_clearTimer(timer_id)
     int  timer_id;
 {
-    struct timeout_q  *ptr, *prev;
+    struct timeout_q  *ptr;
     
     if (!timer_id)
 	return;
     
-    prev = ptr = Q;
-    
-    /*
-     * find the right node, delete it. the subsequent node's time
-     * gets bumped up
-     */
-    
-    print_Q();
-    while (ptr) {
-	if (ptr->id == timer_id) {
-	    /* got the right node */
-	    
-	    /* unlink it from the queue */
-	    if (ptr == Q)
-		Q = Q->next;
-	    else
-		prev->next = ptr->next;
-	    
-	    /* increment next node if any */
-	    if (ptr->next != 0)
-		(ptr->next)->time += ptr->time;
+    ptr = (struct timeout_q *)hash_find(&callout_ids, timer_id, 0);
+    if (!ptr)
+	return;
+
+    callout_unlink(ptr);
+    hash_remove(&callout_ids, &ptr->hash);
+    pending--;
 	    
-	    if (ptr->data)
-		free(ptr->data);
-	    free(ptr);
-	    print_Q();
-	    return;
-	}
-	prev = ptr;
-	ptr = ptr->next;
-    }
+    if (ptr->data)
+	free(ptr->data);
+    pool_free(&callout_pool, ptr);
     print_Q();
 }
 
@@ -251,10 +469,13 @@ static void
 print_Q()
 {
     struct timeout_q  *ptr;
+    int level, i;
     
     IF_DEBUG(DEBUG_TIMEOUT)
-	for (ptr = Q; ptr; ptr = ptr->next)
-	    logit(LOG_DEBUG, 0, "(%d,%d) ", ptr->id, ptr->time);
+	for (level = 0; level < CALLOUT_LEVELS; level++)
+	    for (i = 0; i < CALLOUT_SLOTS; i++)
+		for (ptr = wheel[level][i].head; ptr; ptr = ptr->next)
+		    logit(LOG_DEBUG, 0, "(%d,%d) ", ptr->id, (int)(ptr->time - now));
 }
 #endif /* CALLOUT_DEBUG2 */
 
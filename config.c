@@ -302,6 +302,7 @@ void config_vifs_from_kernel(void)
 #define CONF_ALTNET				10
 #define CONF_MASKLEN				11
 #define CONF_SCOPED				12
+#define CONF_UPCALL_SOURCE_RATE			13
 
 
 /*
@@ -339,6 +340,8 @@ static int wordToOption(char *word)
         return CONF_MASKLEN;
     if  (EQUAL(word, "scoped"))
         return CONF_SCOPED;
+    if (EQUAL(word, "upcall_source_rate"))
+        return CONF_UPCALL_SOURCE_RATE;
 
     return CONF_UNKNOWN;
 }
@@ -350,6 +353,8 @@ static int wordToOption(char *word)
  * Syntax:
  * phyint <local-addr | ifname> [disable|enable]
  *                              [threshold <t>] [preference <p>] [metric <m>]
+ *                              [jp_rate <messages/s>] [jp_byte_rate <bytes/s>]
+ *                              [upcall_rate <upcalls/s>]
  *                              [altnet <net-addr> masklen <masklen>]
  *                              [scoped <net-addr> masklen <masklen>]
  *
@@ -538,6 +543,48 @@ static int parse_phyint(char *s)
                 v->uv_local_metric = n;
                 continue;
             }
+            if (EQUAL(w, "jp_rate")) {
+                if (EQUAL((w = next_word(&s)), "")) {
+                    logit(LOG_WARNING, 0, "Missing jp_rate for phyint %s in %s",
+                          inet_fmt(local, s1, sizeof(s1)), configfilename);
+                    continue;
+                }
+                if (sscanf(w, "%u%c", &n, &c) != 1 || n > JP_MAX_RATE) {
+                    logit(LOG_WARNING, 0, "Invalid jp_rate '%s' for phyint %s in %s",
+                          w, inet_fmt(local, s1, sizeof(s1)), configfilename);
+                    continue;
+                }
+                v->uv_jp_rate = n;
+                continue;
+            }		/* jp_rate	*/
+            if (EQUAL(w, "jp_byte_rate")) {
+                if (EQUAL((w = next_word(&s)), "")) {
+                    logit(LOG_WARNING, 0, "Missing jp_byte_rate for phyint %s in %s",
+                          inet_fmt(local, s1, sizeof(s1)), configfilename);
+                    continue;
+                }
+                if (sscanf(w, "%u%c", &n, &c) != 1 || n > JP_MAX_BYTE_RATE) {
+                    logit(LOG_WARNING, 0, "Invalid jp_byte_rate '%s' for phyint %s in %s",
+                          w, inet_fmt(local, s1, sizeof(s1)), configfilename);
+                    continue;
+                }
+                v->uv_jp_byte_rate = n;
+                continue;
+            }		/* jp_byte_rate	*/
+            if (EQUAL(w, "upcall_rate")) {
+                if (EQUAL((w = next_word(&s)), "")) {
+                    logit(LOG_WARNING, 0, "Missing upcall_rate for phyint %s in %s",
+                          inet_fmt(local, s1, sizeof(s1)), configfilename);
+                    continue;
+                }
+                if (sscanf(w, "%u%c", &n, &c) != 1 || n > UPCALL_MAX_RATE) {
+                    logit(LOG_WARNING, 0, "Invalid upcall_rate '%s' for phyint %s in %s",
+                          w, inet_fmt(local, s1, sizeof(s1)), configfilename);
+                    continue;
+                }
+                v->uv_upcall_rate = n;
+                continue;
+            }		/* upcall_rate	*/
         }		/* if not empty */
         break;
     }
@@ -1083,6 +1130,34 @@ int parse_default_source_preference(char *s)
 }
 
 
+/*
+ * function name: parse_upcall_source_rate
+ * input: char *s
+ * output: int
+ * operation: reads and assigns the max. number of kernel upcalls per
+ *            second processed for any single source, see upcall_admit().
+ *            General form:
+ *		'upcall_source_rate <number>'.
+ */
+int parse_upcall_source_rate(char *s)
+{
+    char *w;
+    u_int value;
+
+    value = 0;
+    if (EQUAL((w = next_word(&s)), "")) {
+        logit(LOG_WARNING, 0, "Missing upcall source rate; set to default 0 (no limit)");
+    } else if (sscanf(w, "%u", &value) != 1 || value > UPCALL_MAX_RATE) {
+        logit(LOG_WARNING, 0, "Invalid upcall source rate; set to default 0 (no limit)");
+        value = 0;
+    }
+    upcall_source_rate = value;
+    logit(LOG_INFO, 0, "upcall_source_rate is %u", value);
+
+    return TRUE;
+}
+
+
 void config_vifs_from_file(void)
 {
     FILE *f;
@@ -1169,6 +1244,9 @@ void config_vifs_from_file(void)
             case CONF_DEFAULT_SOURCE_PREFERENCE:
                 parse_default_source_preference(s);
                 break;
+            case CONF_UPCALL_SOURCE_RATE:
+                parse_upcall_source_rate(s);
+                break;
             default:
                 logit(LOG_WARNING, 0, "unknown command '%s' in %s:%d",
                       w, configfilename, line_num);
@@ -39,6 +39,12 @@ DEFS       = -D__BSD_SOURCE -D_GNU_SOURCE -DPIM
 #   daemon and will flush the routing table.
 #DEFS += -DSAVE_MEMORY
 #
+# -DVIFBITMAP_BITS=<bits> : width of the vif bitmaps (oifs, leaves, etc.)
+#   of every routing entry, e.g. 256 or 1024.  Defaults to MAXVIFS, and
+#   cannot be smaller than that.  The number of vifs is still limited by
+#   the kernel's MAXVIFS.
+#DEFS += -DVIFBITMAP_BITS=256
+#
 # -DSCOPED_ACL :
 #   Scoped access control list support in pimd.conf, by Marian Stagarescu <marian@cidera.com>
 #   If you want to install NUL OIF for the "scoped groups", use the following syntax:
@@ -46,6 +52,40 @@ DEFS       = -D__BSD_SOURCE -D_GNU_SOURCE -DPIM
 #      phyint fxp0 scoped "addr" masklen "len"
 #DEFS += -DSCOPED_ACL
 #
+# -DHAVE_EPOLL : Linux only, run the main loop on epoll, with a timerfd
+#   for the callout queue and a signalfd for the signals, instead of
+#   select() and signal handlers.  Enabled by default on Linux below.
+#
+# -DHAVE_RECVMMSG : read up to RECV_BATCH_SIZE packets per system call
+#   from the IGMP and PIM sockets.  Enabled by default on Linux below.
+#
+# -DRECV_BATCH_SIZE=<packets> : size of the receive batches, default 16.
+#   Every packet of a batch takes 64 kB of memory.
+#DEFS += -DRECV_BATCH_SIZE=32
+#
+# -DUPCALL_BUDGET=<packets> : kernel upcalls (cache misses, wrong vif) are
+#   dispatched before the IGMP packets sharing their socket, up to this
+#   many per main loop iteration, default 64.
+#
+# -DIGMP_BUDGET=<packets> : IGMP packets processed per main loop
+#   iteration, default 32.  The rest are deferred to the next iterations.
+#
+# -DHAVE_IP_PKTINFO : select the outgoing interface of IGMP and PIM
+#   multicasts per message with IP_PKTINFO, instead of changing the
+#   IP_MULTICAST_IF and IP_MULTICAST_LOOP socket options for every sent
+#   packet.  Enabled by default on Linux below.
+#
+# -DHAVE_SENDMMSG : queue the multicast PIM messages of each timer tick,
+#   Join/Prunes and bootstraps, and send them with sendmmsg().  Hellos
+#   are sent one by one from their own timers.
+#   Needs HAVE_IP_PKTINFO.  Enabled by default on Linux below.
+#
+# -DHAVE_NETLINK_MFC : Linux only, program the kernel multicast forwarding
+#   cache with batches of rtnetlink RTM_NEWROUTE/RTM_DELROUTE messages,
+#   many per system call, instead of one MRT_ADD_MFC/MRT_DEL_MFC
+#   setsockopt() per entry.  Falls back to setsockopt() on kernels
+#   without RTNL_FAMILY_IPMR route support.  Enabled by default on Linux.
+#
 
 ##
 # Compilation flags for different platforms.
@@ -123,5 +163,7 @@ DEFS       = -D__BSD_SOURCE -D_GNU_SOURCE -DPIM
 # For uClibc based Linux systems, add -DHAVE_STRLCPY to DEFS
 INCLUDES      = -Iinclude
 DEFS         += -DRAW_INPUT_IS_RAW -DRAW_OUTPUT_IS_RAW -DIOCTL_OK_ON_RAW_SOCKET
+DEFS         += -DHAVE_EPOLL -DHAVE_RECVMMSG -DHAVE_SENDMMSG -DHAVE_IP_PKTINFO
+DEFS         += -DHAVE_NETLINK_MFC
 EXTRA_OBJS    = strlcpy.o pidfile.o
 
@@ -262,6 +262,15 @@ void fdump(int i __attribute__((unused)))
     fp = fopen(dumpfilename, "w");
     if (fp != NULL) {
         dump_vifs(fp);
+        dump_recv_batches(fp);
+        dump_igmp_dispatch(fp);
+        dump_upcall_limit(fp);
+        dump_neg_mfc(fp);
+        dump_mfc_shadow(fp);
+#ifdef HAVE_NETLINK_MFC
+        dump_nl_mfc(fp);
+#endif /* HAVE_NETLINK_MFC */
+        dump_pim_txq(fp);
         dump_pim_mrt(fp);
         (void) fclose(fp);
     }
@@ -292,8 +301,8 @@ void dump_vifs(FILE *fp)
     int width;
     int i;
 
-    fprintf(fp, "\nVirtual Interface Table\n %-3s  %-15s  %-20s %-8s %-14s %s",
-            "Vif", "Local-Address", "Subnet", "Thresh", "Flags",
+    fprintf(fp, "\nVirtual Interface Table\n %-3s  %-15s  %-20s %-8s %-5s %-14s %s",
+            "Vif", "Local-Address", "Subnet", "Thresh", "Nbrs", "Flags",
             "Neighbors\n");
 
     for (vifi = 0, v = uvifs; vifi < numvifs; ++vifi, ++v) {
@@ -303,6 +312,7 @@ void dump_vifs(FILE *fp)
         else
             fprintf(fp,"%-20.20s ", netname(v->uv_subnet, v->uv_subnetmask));
         fprintf(fp, "%-5u   ", v->uv_threshold);
+        fprintf(fp, "%-5u ", v->uv_pim_nbr_count);
         /* TODO: XXX: Print VIFF_TUNNEL? */
         width = 0;
         if (v->uv_flags & VIFF_DISABLED)
@@ -332,13 +342,28 @@ void dump_vifs(FILE *fp)
                 fprintf(fp, " ");
             fprintf(fp, "%-15s\n", inet_fmt(n->address, s1, sizeof(s1)));
             for (n = n->next; n != NULL; n = n->next)
-                fprintf(fp, "%64s %-15s\n", "", inet_fmt(n->address, s1, sizeof(s1)));
+                fprintf(fp, "%70s %-15s\n", "", inet_fmt(n->address, s1, sizeof(s1)));
 
         }
         else
             fprintf(fp, "\n");
     }
     fprintf(fp, "\n");
+
+    fprintf(fp, "Join/Prune Transmit Statistics\n");
+    fprintf(fp, " %-3s  %6s %8s %10s %8s %8s %5s %5s %5s %5s\n",
+            "Vif", "Rate", "Bytes/s", "Sent", "Delayed", "Dropped",
+            "Queue", "Peak", "Burst", "Peak");
+    for (vifi = 0, v = uvifs; vifi < numvifs; ++vifi, ++v) {
+        if (v->uv_flags & VIFF_REGISTER)
+            continue;
+        fprintf(fp, " %3u  %6u %8u %10lu %8lu %8lu %5u %5u %5u %5u\n", vifi,
+                v->uv_jp_rate, v->uv_jp_byte_rate, v->uv_jp_stats.sent,
+                v->uv_jp_stats.delayed, v->uv_jp_stats.dropped,
+                v->uv_jp_stats.queued, v->uv_jp_stats.queued_max,
+                v->uv_jp_stats.burst_last, v->uv_jp_stats.burst_max);
+    }
+    fprintf(fp, "\n");
 }
 
 
@@ -485,10 +510,11 @@ void dump_pim_mrt(FILE *fp)
             fprintf(fp, "\nTIMERS:  Entry   JP   RS Assert VIFS:");
             for (vifi = 0; vifi < numvifs; vifi++)
                 fprintf(fp, "  %d", vifi);
-            fprintf(fp, "\n           %d     %d    %d    %d        ",
-                    r->timer, r->jp_timer, r->rs_timer, r->assert_timer);
+            fprintf(fp, "\n           %u     %u    %u    %u        ",
+                    MRT_TIMER_LEFT(r->timer), MRT_TIMER_LEFT(r->jp_timer),
+                    MRT_TIMER_LEFT(r->rs_timer), MRT_TIMER_LEFT(r->assert_timer));
             for (vifi = 0; vifi < numvifs; vifi++)
-                fprintf(fp, "  %d", r->vif_timers[vifi]);
+                fprintf(fp, "  %u", MRT_TIMER_LEFT(r->vif_timers[vifi]));
             fprintf(fp, "\n");
         }
 
@@ -549,10 +575,11 @@ void dump_pim_mrt(FILE *fp)
             fprintf(fp, "\nTIMERS:  Entry   JP   RS Assert VIFS:");
             for (vifi = 0; vifi < numvifs; vifi++)
                 fprintf(fp, "  %d", vifi);
-            fprintf(fp, "\n           %d    %d    %d    %d        ",
-                    r->timer, r->jp_timer, r->rs_timer, r->assert_timer);
+            fprintf(fp, "\n           %u    %u    %u    %u        ",
+                    MRT_TIMER_LEFT(r->timer), MRT_TIMER_LEFT(r->jp_timer),
+                    MRT_TIMER_LEFT(r->rs_timer), MRT_TIMER_LEFT(r->assert_timer));
             for (vifi = 0; vifi < numvifs; vifi++)
-                fprintf(fp, " %d", r->vif_timers[vifi]);
+                fprintf(fp, " %u", MRT_TIMER_LEFT(r->vif_timers[vifi]));
             fprintf(fp, "\n");
         }
     }/* for all groups */
@@ -617,16 +644,24 @@ void dump_pim_mrt(FILE *fp)
             fprintf(fp, "\nTIMERS:  Entry   JP   RS Assert VIFS:");
             for (vifi = 0; vifi < numvifs; vifi++)
                 fprintf(fp, "  %d", vifi);
-            fprintf(fp, "\n           %d    %d    %d    %d        ",
-                    r->timer, r->jp_timer, r->rs_timer, r->assert_timer);
+            fprintf(fp, "\n           %u    %u    %u    %u        ",
+                    MRT_TIMER_LEFT(r->timer), MRT_TIMER_LEFT(r->jp_timer),
+                    MRT_TIMER_LEFT(r->rs_timer), MRT_TIMER_LEFT(r->assert_timer));
             for (vifi = 0; vifi < numvifs; vifi++)
-                fprintf(fp, " %d", r->vif_timers[vifi]);
+                fprintf(fp, " %u", MRT_TIMER_LEFT(r->vif_timers[vifi]));
             fprintf(fp, "\n");
         }
     } /* For all (*,*,RP) */
 
     fprintf(fp, "Number of Groups: %u\n", number_of_groups);
-    fprintf(fp, "Number of Cache MIRRORs: %u\n\n", number_of_cache_mirrors);
+    fprintf(fp, "Number of Cache MIRRORs: %u\n", number_of_cache_mirrors);
+    dump_hash(fp, &srchash);
+    dump_hash(fp, &grphash);
+    dump_hash(fp, &sghash);
+    dump_hash(fp, &kchash);
+    dump_hash(fp, &rphash);
+    dump_pools(fp);
+    fprintf(fp, "\n");
 }
 
 
@@ -663,6 +698,9 @@ int dump_rp_set(FILE *fp)
             }
         }
     }
+    fprintf(fp, "Group prefix trie: %u nodes\n", grp_mask_trie_nodes);
+    fprintf(fp, "Group-to-RP cache: generation %u, %lu hits, %lu misses\n",
+            rp_set_generation, rp_match_cache_hits, rp_match_cache_misses);
 
     return TRUE;
 }
@@ -135,9 +135,11 @@ typedef void (*ihfunc_t) (int, fd_set *);
 
 #include "dvmrp.h"     /* Added for further compatibility and convenience */
 #include "pimd.h"
+#include "hash.h"
+#include "pool.h"
+#include "vif.h"		/* Before mrt.h, for vifbitmap_t */
 #include "mrt.h"
 #include "igmpv2.h"
-#include "vif.h"
 #include "debug.h"
 #include "pathnames.h"
 #ifdef RSRR
@@ -264,6 +266,64 @@ typedef void (*ihfunc_t) (int, fd_set *);
 #define                 SO_SEND_BUF_SIZE_MIN (48*1024)
 #define                 SO_RECV_BUF_SIZE_MAX (256*1024)
 #define                 SO_RECV_BUF_SIZE_MIN (48*1024)
+#ifndef RECV_BATCH_SIZE
+#define                 RECV_BATCH_SIZE 16        /* Max. packets per
+						   * k_recv() call */
+#endif
+#define                 RECV_SLOT_SIZE  (IP_MAXPACKET + 1)
+#ifndef UPCALL_BUDGET
+#define                 UPCALL_BUDGET   64        /* Kernel upcalls read per
+						   * main loop iteration */
+#endif
+#ifndef IGMP_BUDGET
+#define                 IGMP_BUDGET     32        /* IGMP packets processed
+						   * per main loop iteration */
+#endif
+#define                 IGMP_BACKLOG_MAX 1024     /* IGMP packets deferred
+						   * to later iterations */
+#define                 NEG_MFC_MISSES  3         /* Cache misses before an
+						   * (S,G) is blocked */
+#define                 NEG_MFC_WINDOW  60        /* ...counted over this
+						   * many seconds */
+#define                 NEG_MFC_MIN_LIFE 10       /* Lifetime of a negative
+						   * MFC entry, doubled */
+#define                 NEG_MFC_MAX_LIFE 320      /* ...while it still drops
+						   * traffic, up to this */
+#define                 NEG_MFC_MAX     4096      /* Max. (S,G) tracked */
+#define                 UPCALL_SRC_MAX  1024      /* Max. sources with an
+						   * upcall token bucket */
+
+/*
+ * With IP_PKTINFO the outgoing interface of a multicast is selected per
+ * message, see k_send().  The sendmmsg() transmit queue depends on it.
+ */
+#ifdef HAVE_IP_PKTINFO
+#define                 K_PKTINFO_SPACE CMSG_SPACE(sizeof(struct in_pktinfo))
+#else
+#undef                  HAVE_SENDMMSG
+#endif /* HAVE_IP_PKTINFO */
+
+/*
+ * A batch of received packets, see k_recv().  Every packet has its own
+ * buffer, big enough for any IP datagram.
+ */
+typedef struct recv_batch {
+    struct recv_batch *next;	/* link in the list of all batches   */
+    const char	*name;		/* used in the dump		     */
+    int		 size;		/* max. packets per k_recv()	     */
+    char	**buf;		/* the packets received by k_recv()  */
+    ssize_t	*len;		/* ... and their length		     */
+    char	*slots;		/* size * RECV_SLOT_SIZE bytes	     */
+#ifdef HAVE_RECVMMSG
+    struct mmsghdr *msgs;
+    struct iovec   *iovs;
+#endif /* HAVE_RECVMMSG */
+    u_long	 calls;		/* k_recv() calls which got packets  */
+    u_long	 packets;	/* packets received		     */
+    u_long	 full;		/* batches filled up, more pending   */
+    u_long	 truncated;	/* packets larger than a slot	     */
+    u_int	 largest;	/* largest batch		     */
+} recv_batch_t;
 
 /* TODO: describe the variables and clean up */
 extern char		*igmp_recv_buf;
@@ -304,6 +364,10 @@ extern u_int32		pim_data_rate_check_interval;
 
 extern cand_rp_t        *cand_rp_list;
 extern grp_mask_t       *grp_mask_list;
+extern u_int32          grp_mask_trie_nodes;
+extern u_int32          rp_set_generation;
+extern u_long           rp_match_cache_hits;
+extern u_long           rp_match_cache_misses;
 extern cand_rp_t        *segmented_cand_rp_list;
 extern grp_mask_t       *segmented_grp_mask_list;
 
@@ -328,9 +392,15 @@ extern u_int16          pim_cand_rp_adv_timer;
 
 extern u_int32		default_source_metric;
 extern u_int32		default_source_preference;
+extern u_int		upcall_source_rate;
 
 extern srcentry_t 	*srclist;
+extern hash_table_t	srchash;
 extern grpentry_t 	*grplist;
+extern hash_table_t	grphash;
+extern hash_table_t	sghash;
+extern hash_table_t	kchash;
+extern hash_table_t	rphash;
 extern rpentry_t        *rplist;
 
 extern struct uvif	uvifs[MAXVIFS];
@@ -424,11 +494,16 @@ extern int		errno;
 /* callout.c */
 extern void	callout_init		(void);
 extern void	free_all_callouts	(void);
-extern void	age_callout_queue	(int);
+extern u_int32	callout_clock		(void);
+extern void	age_callout_queue	(void);
 extern int	timer_nextTimer		(void);
 extern int	timer_setTimer		(int, cfunc_t, void *);
+extern int	timer_setTimer_ms	(int, cfunc_t, void *);
+extern int	timer_rescheduleTimer	(int, int);
+extern int	timer_rescheduleTimer_ms (int, int);
 extern void	timer_clearTimer	(int);
 extern int	timer_leftTimer		(int);
+extern int	timer_leftTimer_ms	(int);
 
 /* config.c */
 extern void	config_vifs_from_kernel	(void);
@@ -457,9 +532,20 @@ extern void	dvmrp_accept_prune	(u_int32 src, u_int32 dst, u_char *p, int datalen
 extern void	dvmrp_accept_graft	(u_int32 src, u_int32 dst, u_char *p, int datalen);
 extern void	dvmrp_accept_g_ack	(u_int32 src, u_int32 dst, u_char *p, int datalen);
 
+/* hash.c */
+extern void	hash_init		(hash_table_t *tbl, const char *name, u_int32 size);
+extern void	hash_free		(hash_table_t *tbl);
+extern void	*hash_find		(hash_table_t *tbl, u_int32 key1, u_int32 key2);
+extern void	hash_insert		(hash_table_t *tbl, hash_entry_t *entry, u_int32 key1, u_int32 key2, void *data);
+extern void	hash_remove		(hash_table_t *tbl, hash_entry_t *entry);
+extern void	dump_hash		(FILE *fp, hash_table_t *tbl);
+
 /* igmp.c */
 extern void	init_igmp		(void);
 extern void	send_igmp		(char *buf, u_int32 src, u_int32 dst, int type, int code, u_int32 group, int datalen);
+extern void	igmp_run_backlog	(void);
+extern int	igmp_backlog_pending	(void);
+extern void	dump_igmp_dispatch	(FILE *fp);
 
 /* igmp_proto.c */
 extern void	query_groups		(struct uvif *v);
@@ -483,10 +569,17 @@ extern void	k_hdr_include		(int socket, int bool);
 extern void	k_set_ttl		(int socket, int t);
 extern void	k_set_loop		(int socket, int l);
 extern void	k_set_if		(int socket, u_int32 ifa);
+extern void	k_init_send		(int socket);
+#ifdef HAVE_IP_PKTINFO
+extern socklen_t k_set_pktinfo		(void *ctl, u_int32 src);
+#endif /* HAVE_IP_PKTINFO */
+extern int	k_send			(int socket, char *buf, int len, u_int32 src, u_int32 dst, int loop);
 extern void	k_join			(int socket, u_int32 grp, struct uvif *v);
 extern void	k_leave			(int socket, u_int32 grp, struct uvif *v);
 extern void	k_init_pim		(int socket);
 extern void	k_stop_pim		(int socket);
+extern void	k_flush_mfc		(void);
+extern void	k_forget_mfc		(u_int32 source, u_int32 group);
 extern int	k_del_mfc		(int socket, u_int32 source, u_int32 group);
 extern int	k_chg_mfc		(int socket, u_int32 source, u_int32 group, vifi_t iif, vifbitmap_t oifs,
                                          u_int32 rp_addr);
@@ -494,6 +587,10 @@ extern void	k_add_vif		(int socket, vifi_t vifi, struct uvif *v);
 extern void	k_del_vif		(int socket, vifi_t vifi, struct uvif *v);
 extern int	k_get_vif_count		(vifi_t vifi, struct vif_count *retval);
 extern int	k_get_sg_cnt		(int socket, u_int32 source, u_int32 group, struct sg_count *retval);
+extern void	k_recv_init		(recv_batch_t *rb, const char *name, int size);
+extern int	k_recv			(int socket, recv_batch_t *rb);
+extern void	dump_recv_batches	(FILE *fp);
+extern void	dump_mfc_shadow		(FILE *fp);
 
 /* main.c */
 extern int	register_input_handler	(int fd, ihfunc_t func);
@@ -510,14 +607,20 @@ extern void	delete_mrtentry_all_kernel_cache (mrtentry_t *mrtentry_ptr);
 extern void	delete_single_kernel_cache (mrtentry_t *mrtentry_ptr, kernel_cache_t *kernel_cache_ptr);
 extern void	delete_single_kernel_cache_addr (mrtentry_t *mrtentry_ptr, u_int32 source, u_int32 group);
 extern void	add_kernel_cache	(mrtentry_t *mrtentry_ptr, u_int32 source, u_int32 group, u_int16 flags);
+extern void	free_mrtentry		(mrtentry_t *mrtentry_ptr);
 /* pim.c */
 extern void	init_pim		(void);
 extern void	send_pim		(char *buf, u_int32 src, u_int32 dst, int type, int datalen);
 extern void	send_pim_unicast	(char *buf, u_int32 src, u_int32 dst, int type, int datalen);
+extern void	pim_txq_start		(void);
+extern void	pim_txq_flush		(void);
+extern void	dump_pim_txq		(FILE *fp);
 
 /* pim_proto.c */
 extern int	receive_pim_hello	(u_int32 src, u_int32 dst, char *pim_message, size_t datalen);
 extern int	send_pim_hello		(struct uvif *v, u_int16 holdtime);
+extern void	set_pim_hello_timer	(struct uvif *v, u_int32 msec);
+extern pim_nbr_entry_t *find_vif_pim_nbr (vifi_t vifi, u_int32 address);
 extern void	delete_pim_nbr		(pim_nbr_entry_t *nbr_delete);
 extern int	receive_pim_register	(u_int32 src, u_int32 dst, char *pim_message, size_t datalen);
 extern int	send_pim_null_register	(mrtentry_t *r);
@@ -531,11 +634,19 @@ extern int	send_periodic_pim_join_prune (vifi_t vifi, pim_nbr_entry_t *pim_nbr,
 extern int	add_jp_entry		(pim_nbr_entry_t *pim_nbr, u_int16 holdtime, u_int32 group, u_int8 grp_msklen,
                                          u_int32 source, u_int8 src_msklen,  u_int16 addr_flags, u_int8 join_prune);
 extern void	pack_and_send_jp_message (pim_nbr_entry_t *pim_nbr);
+extern void	init_jp_txq		(void);
+extern void	flush_jp_txq		(vifi_t vifi);
 extern int	receive_pim_cand_rp_adv	(u_int32 src, u_int32 dst, char *pim_message, int datalen);
 extern int	receive_pim_bootstrap	(u_int32 src, u_int32 dst, char *pim_message, int datalen);
 extern int	send_pim_cand_rp_adv	(void);
 extern void	send_pim_bootstrap	(void);
 
+/* pool.c */
+extern void	pool_init		(pool_t *pool, const char *name, size_t size);
+extern void	*pool_alloc		(pool_t *pool);
+extern void	pool_free		(pool_t *pool, void *obj);
+extern void	dump_pools		(FILE *fp);
+
 /* route.c */
 extern int	set_incoming		(srcentry_t *srcentry_ptr, int srctype);
 extern vifi_t	get_iif			(u_int32 source);
@@ -550,6 +661,11 @@ extern void	calc_oifs		(mrtentry_t *mrtentry_ptr, vifbitmap_t *oifs_ptr);
 extern void	process_kernel_call	(void);
 extern int	delete_vif_from_mrt	(vifi_t vifi);
 extern mrtentry_t *switch_shortest_path	(u_int32 source, u_int32 group);
+extern void	init_neg_mfc		(void);
+extern void	neg_mfc_clear		(u_int32 source, u_int32 group);
+extern void	neg_mfc_clear_prefix	(u_int32 group, u_int32 mask);
+extern void	dump_neg_mfc		(FILE *fp);
+extern void	dump_upcall_limit	(FILE *fp);
 
 /* routesock.c */
 extern int	k_req_incoming		(u_int32 source, struct rpfctl *rpfp);
@@ -557,6 +673,15 @@ extern int	k_req_incoming		(u_int32 source, struct rpfctl *rpfp);
 extern int	init_routesock		(void);
 extern int	routing_socket;
 #endif /* HAVE_ROUTING_SOCKETS */
+#ifdef HAVE_NETLINK_MFC
+extern int	nl_mfc_init		(void);
+extern void	nl_mfc_stop		(void);
+extern int	nl_mfc_add		(u_int32 source, u_int32 group, vifi_t iif, vifbitmap_t oifs);
+extern int	nl_mfc_del		(u_int32 source, u_int32 group);
+extern void	nl_mfc_flush		(void);
+extern int	nl_dump_sg_cnt		(u_int32 gen);
+extern void	dump_nl_mfc		(FILE *fp);
+#endif /* HAVE_NETLINK_MFC */
 
 /* rp.c */
 extern void	init_rp_and_bsr		(void);
@@ -600,7 +725,14 @@ extern void	rsrr_cache_bring_up	(struct gtable *);
 #endif /* RSRR */
 
 /* timer.c */
+extern u_int32	route_clock;
 extern void	init_timers		(void);
+extern void	set_mrt_timer		(mrtentry_t *mrtentry_ptr, u_int32 *timer, u_int32 value);
+extern void	set_mrt_timer_ms	(mrtentry_t *mrtentry_ptr, u_int32 *timer, u_int32 msec);
+extern u_int32	mrt_timer_left_ms	(mrtentry_t *mrtentry_ptr, u_int32 *timer);
+extern void	unlink_mrt_ms		(mrtentry_t *mrtentry_ptr);
+extern void	schedule_mrtentry	(mrtentry_t *mrtentry_ptr, u_int32 deadline);
+extern void	unschedule_mrtentry	(mrtentry_t *mrtentry_ptr);
 extern void	age_vifs		(void);
 extern void	age_routes		(void);
 extern void	age_misc		(void);
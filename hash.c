@@ -0,0 +1,186 @@
+/*
+ * Address keyed hash tables used to index the multicast routing table.
+ * See hash.h for details.
+ *
+ * The license for this file is the same as for the rest of pimd, see the
+ * file LICENSE in the top directory.
+ */
+
+#include "defs.h"
+
+static u_int32	hash_value	(u_int32 key1, u_int32 key2);
+static void	hash_resize	(hash_table_t *tbl, u_int32 size);
+
+/*
+ * Mix both keys so that every input bit affects the bucket index.  The
+ * addresses are in network order, and groups or sources often differ
+ * only in their last octet, hence the full avalanche (MurmurHash3 fmix).
+ */
+static u_int32 hash_value(u_int32 key1, u_int32 key2)
+{
+    u_int32 h;
+
+    h  = key1 ^ (key2 * 0x9e3779b1);
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+
+    return h;
+}
+
+#define HASH_INDEX(tbl, key1, key2)  (hash_value((key1), (key2)) & ((tbl)->size - 1))
+
+void hash_init(hash_table_t *tbl, const char *name, u_int32 size)
+{
+    u_int32 n;
+
+    /* Round up to the nearest power of 2 */
+    for (n = 1; n < size; n <<= 1)
+	;
+
+    tbl->buckets  = (hash_entry_t **)calloc(n, sizeof(hash_entry_t *));
+    if (!tbl->buckets)
+	logit(LOG_ERR, 0, "Ran out of memory in hash_init(%s)", name);
+    tbl->size     = n;
+    tbl->min_size = n;
+    tbl->count    = 0;
+    tbl->resizes  = 0;
+    tbl->name     = name;
+}
+
+/*
+ * Only releases the bucket array, the entries belong to their owners.
+ */
+void hash_free(hash_table_t *tbl)
+{
+    if (tbl->buckets)
+	free(tbl->buckets);
+    tbl->buckets = NULL;
+    tbl->size    = 0;
+    tbl->count   = 0;
+}
+
+/*
+ * Rehash all entries into a new bucket array of `size' buckets.  If we
+ * are short of memory we simply keep the old array, the table is still
+ * correct, only a bit slower.
+ */
+static void hash_resize(hash_table_t *tbl, u_int32 size)
+{
+    hash_entry_t **buckets;
+    hash_entry_t *entry;
+    hash_entry_t *next;
+    u_int32 i, idx;
+    u_int32 old_size = tbl->size;
+
+    buckets = (hash_entry_t **)calloc(size, sizeof(hash_entry_t *));
+    if (!buckets) {
+	logit(LOG_WARNING, 0, "Cannot resize %s hash to %u buckets",
+	      tbl->name, size);
+	return;
+    }
+
+    tbl->size = size;
+    for (i = 0; i < old_size; i++) {
+	for (entry = tbl->buckets[i]; entry; entry = next) {
+	    next = entry->hnext;
+	    idx  = HASH_INDEX(tbl, entry->key1, entry->key2);
+	    entry->hnext = buckets[idx];
+	    buckets[idx] = entry;
+	}
+    }
+
+    free(tbl->buckets);
+    tbl->buckets = buckets;
+    tbl->resizes++;
+
+    IF_DEBUG(DEBUG_MFC) {
+	logit(LOG_DEBUG, 0, "%s hash resized from %u to %u buckets (%u entries)",
+	      tbl->name, old_size, size, tbl->count);
+    }
+}
+
+void *hash_find(hash_table_t *tbl, u_int32 key1, u_int32 key2)
+{
+    hash_entry_t *entry;
+
+    for (entry = tbl->buckets[HASH_INDEX(tbl, key1, key2)]; entry; entry = entry->hnext) {
+	if (entry->key1 == key1 && entry->key2 == key2)
+	    return entry->data;
+    }
+
+    return NULL;
+}
+
+/*
+ * The caller must make sure the (key1, key2) pair is not already in the
+ * table, i.e., call hash_find() first.
+ */
+void hash_insert(hash_table_t *tbl, hash_entry_t *entry, u_int32 key1, u_int32 key2, void *data)
+{
+    u_int32 idx;
+
+    /* Keep the load factor at most 1 */
+    if (tbl->count >= tbl->size)
+	hash_resize(tbl, tbl->size << 1);
+
+    idx           = HASH_INDEX(tbl, key1, key2);
+    entry->key1   = key1;
+    entry->key2   = key2;
+    entry->data   = data;
+    entry->hnext  = tbl->buckets[idx];
+    tbl->buckets[idx] = entry;
+    tbl->count++;
+}
+
+void hash_remove(hash_table_t *tbl, hash_entry_t *entry)
+{
+    hash_entry_t **pp;
+
+    for (pp = &tbl->buckets[HASH_INDEX(tbl, entry->key1, entry->key2)]; *pp; pp = &(*pp)->hnext) {
+	if (*pp != entry)
+	    continue;
+
+	*pp = entry->hnext;
+	entry->hnext = NULL;
+	tbl->count--;
+
+	/* Give back memory after a large table has been flushed */
+	if (tbl->size > tbl->min_size && tbl->count < (tbl->size >> 2))
+	    hash_resize(tbl, tbl->size >> 1);
+	return;
+    }
+
+    logit(LOG_WARNING, 0, "%s hash: entry for %s, %s not found",
+	  tbl->name, inet_fmt(entry->key1, s1, sizeof(s1)),
+	  inet_fmt(entry->key2, s2, sizeof(s2)));
+}
+
+void dump_hash(FILE *fp, hash_table_t *tbl)
+{
+    hash_entry_t *entry;
+    u_int32 i, len, used = 0, longest = 0;
+
+    for (i = 0; i < tbl->size; i++) {
+	for (len = 0, entry = tbl->buckets[i]; entry; entry = entry->hnext)
+	    len++;
+	if (len)
+	    used++;
+	if (len > longest)
+	    longest = len;
+    }
+
+    fprintf(fp, "%-12s hash: %u entries, %u/%u buckets used, longest chain %u, %u resizes\n",
+	    tbl->name, tbl->count, used, tbl->size, longest, tbl->resizes);
+}
+
+/**
+ * Local Variables:
+ *  version-control: t
+ *  indent-tabs-mode: t
+ *  c-file-style: "ellemtel"
+ *  c-basic-offset: 4
+ * End:
+ */
@@ -0,0 +1,45 @@
+/*
+ * Address keyed hash tables used to index the multicast routing table.
+ *
+ * The link (hash_entry_t) is embedded in the indexed structure, hence
+ * inserting and removing entries never allocates memory.  Each entry is
+ * keyed by up to two 32-bit values in network order, e.g., a group
+ * address, or a (source, group) pair.  The number of buckets is always a
+ * power of two and follows the number of entries, so the average lookup
+ * cost stays O(1) regardless of the table size.
+ *
+ * The license for this file is the same as for the rest of pimd, see the
+ * file LICENSE in the top directory.
+ */
+
+#ifndef __PIMD_HASH_H__
+#define __PIMD_HASH_H__
+
+typedef struct hash_entry {
+    struct hash_entry *hnext;	/* next entry in the same bucket	    */
+    u_int32	       key1;	/* first key, e.g. group address	    */
+    u_int32	       key2;	/* second key, or INADDR_ANY_N if unused    */
+    void	      *data;	/* the structure this link is embedded in   */
+} hash_entry_t;
+
+typedef struct hash_table {
+    hash_entry_t     **buckets;	/* the bucket array, size is a power of 2   */
+    u_int32	       size;	/* current number of buckets		    */
+    u_int32	       min_size;/* never shrink below this many buckets     */
+    u_int32	       count;	/* number of entries in the table	    */
+    u_int32	       resizes;	/* number of rehashes, for the dump	    */
+    const char	      *name;	/* used for logging and in the dump	    */
+} hash_table_t;
+
+#define HASH_DEFAULT_SIZE	256	/* initial number of buckets	    */
+
+#endif /* __PIMD_HASH_H__ */
+
+/**
+ * Local Variables:
+ *  version-control: t
+ *  indent-tabs-mode: t
+ *  c-file-style: "ellemtel"
+ *  c-basic-offset: 4
+ * End:
+ */
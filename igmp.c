@@ -51,6 +51,38 @@ int     igmp_socket;	      	/* socket for all network I/O        */
 u_int32 allhosts_group;	      	/* allhosts  addr in net order       */
 u_int32 allrouters_group;	/* All-Routers addr in net order     */
 
+static recv_batch_t igmp_recv_batch;	/* input packet buffers      */
+
+/*
+ * The kernel upcalls (ip_p == 0) share the IGMP socket with the group
+ * reports.  To get new flows forwarding promptly during a report storm,
+ * igmp_read() dispatches the upcalls of every batch first, and keeps
+ * reading up to UPCALL_BUDGET of them per main loop iteration.  At most
+ * IGMP_BUDGET other packets are processed per iteration, the rest wait
+ * in a backlog for igmp_run_backlog().  Reading stops early when the
+ * backlog is full, the excess then stays queued in the kernel.
+ */
+struct igmp_deferred {
+    struct igmp_deferred *next;
+    ssize_t	len;
+    char	data[1];
+};
+
+static struct {
+    struct igmp_deferred *head;	/* the backlog, oldest first	     */
+    struct igmp_deferred *tail;
+    u_int32	len;		/* packets in the backlog	     */
+    u_int32	upcalls_run;	/* dispatched this loop iteration    */
+    u_int32	control_run;
+    /* Statistics */
+    u_long	upcalls;	/* kernel upcalls dispatched	     */
+    u_long	control;	/* IGMP packets dispatched	     */
+    u_long	deferred;	/* IGMP packets put in the backlog   */
+    u_long	dropped;	/* ... or dropped, backlog full	     */
+    u_long	exhausted;	/* upcall budget used up	     */
+    u_int32	peak;		/* longest backlog		     */
+} igmp_dispatch;
+
 #ifdef RAW_OUTPUT_IS_RAW
 extern int curttl;
 #endif /* RAW_OUTPUT_IS_RAW */
@@ -59,6 +91,7 @@ extern int curttl;
  * Local functions definitions.
  */
 static void igmp_read        (int i, fd_set *rfd);
+static void igmp_defer       (char *buf, ssize_t len);
 static void accept_igmp      (ssize_t recvlen);
 
 
@@ -70,9 +103,11 @@ void init_igmp(void)
 {
     struct ip *ip;
     
-    igmp_recv_buf = calloc(1, RECV_BUF_SIZE);
+    if (!igmp_recv_batch.size)
+	k_recv_init(&igmp_recv_batch, "IGMP", RECV_BATCH_SIZE);
+    igmp_recv_buf = igmp_recv_batch.buf[0];
     igmp_send_buf = calloc(1, SEND_BUF_SIZE);
-    if (!igmp_recv_buf || !igmp_send_buf)
+    if (!igmp_send_buf)
 	logit(LOG_ERR, 0, "Ran out of memory in init_igmp()");
 
     if ((igmp_socket = socket(AF_INET, SOCK_RAW, IPPROTO_IGMP)) < 0) 
@@ -84,7 +119,7 @@ void init_igmp(void)
     k_set_rcvbuf(igmp_socket, SO_RECV_BUF_SIZE_MAX,
 		 SO_RECV_BUF_SIZE_MIN); /* lots of input buffering        */
     k_set_ttl(igmp_socket, MINTTL);	/* restrict multicasts to one hop */
-    k_set_loop(igmp_socket, FALSE);	/* disable multicast loopback     */
+    k_init_send(igmp_socket);		/* multicast loopback for k_send() */
     
     ip         = (struct ip *)igmp_send_buf;
     memset(ip, 0, sizeof(*ip));
@@ -110,21 +145,141 @@ void init_igmp(void)
 }
 
 
-/* Read an IGMP message */
-static void igmp_read(int i __attribute__((unused)), fd_set *rfd __attribute__((unused)))
+/* Read a batch of IGMP messages */
+static void igmp_read(int fd __attribute__((unused)), fd_set *rfd __attribute__((unused)))
 {
-    ssize_t len;
-    socklen_t dummy = 0;
-    
-    while ((len = recvfrom(igmp_socket, igmp_recv_buf, RECV_BUF_SIZE, 0, NULL, &dummy)) < 0) {
-	if (errno == EINTR)
-	    continue;		/* Received signal, retry syscall. */
+    struct ip *ip;
+    int n, i, upcalls;
+
+    do {
+	if ((n = k_recv(igmp_socket, &igmp_recv_batch)) < 0) {
+	    logit(LOG_ERR, errno, "Failed k_recv() in igmp_read()");
+	    return;
+	}
+
+	/* accept_igmp() and the kernel upcalls work on igmp_recv_buf */
+	upcalls = 0;
+	for (i = 0; i < n; i++) {
+	    ip = (struct ip *)igmp_recv_batch.buf[i];
+	    if (igmp_recv_batch.len[i] < (ssize_t)sizeof(struct ip) || ip->ip_p != 0)
+		continue;
+
+	    upcalls++;
+	    igmp_dispatch.upcalls++;
+	    igmp_dispatch.upcalls_run++;
+	    igmp_recv_buf = igmp_recv_batch.buf[i];
+	    accept_igmp(igmp_recv_batch.len[i]);
+	}
+
+	/* The rest in order of arrival, behind the backlog */
+	for (i = 0; i < n; i++) {
+	    ip = (struct ip *)igmp_recv_batch.buf[i];
+	    if (igmp_recv_batch.len[i] >= (ssize_t)sizeof(struct ip) && ip->ip_p == 0)
+		continue;
 
-	logit(LOG_ERR, errno, "Failed recvfrom() in igmp_read()");
+	    if (igmp_dispatch.head || igmp_dispatch.control_run >= IGMP_BUDGET) {
+		igmp_defer(igmp_recv_batch.buf[i], igmp_recv_batch.len[i]);
+		continue;
+	    }
+
+	    igmp_dispatch.control++;
+	    igmp_dispatch.control_run++;
+	    igmp_recv_buf = igmp_recv_batch.buf[i];
+	    accept_igmp(igmp_recv_batch.len[i]);
+	}
+#ifdef HAVE_RECVMMSG
+	/*
+	 * A full batch means more is pending, go on for more upcalls.  Not
+	 * if this batch had none or the backlog is full, a report flood is
+	 * better left queued in the kernel than dropped by igmp_defer().
+	 */
+	if (n == igmp_recv_batch.size && igmp_dispatch.upcalls_run >= UPCALL_BUDGET)
+	    igmp_dispatch.exhausted++;
+    } while (n == igmp_recv_batch.size && upcalls > 0 &&
+	     igmp_dispatch.upcalls_run < UPCALL_BUDGET &&
+	     igmp_dispatch.len < IGMP_BACKLOG_MAX);
+#else
+    } while (0);		/* recvfrom() would block */
+#endif /* HAVE_RECVMMSG */
+}
+
+/*
+ * Keep a copy of a packet for igmp_run_backlog(), the batch buffers are
+ * reused by the next k_recv().
+ */
+static void igmp_defer(char *buf, ssize_t len)
+{
+    struct igmp_deferred *d;
+
+    if (igmp_dispatch.len >= IGMP_BACKLOG_MAX) {
+	igmp_dispatch.dropped++;
 	return;
     }
-    
-    accept_igmp(len);
+
+    d = (struct igmp_deferred *)malloc(sizeof(*d) + len);
+    if (!d) {
+	igmp_dispatch.dropped++;
+	return;
+    }
+    d->next = NULL;
+    d->len  = len;
+    memcpy(d->data, buf, len);
+
+    if (igmp_dispatch.tail)
+	igmp_dispatch.tail->next = d;
+    else
+	igmp_dispatch.head = d;
+    igmp_dispatch.tail = d;
+
+    igmp_dispatch.deferred++;
+    if (++igmp_dispatch.len > igmp_dispatch.peak)
+	igmp_dispatch.peak = igmp_dispatch.len;
+}
+
+/*
+ * Called once per main loop iteration, after the input handlers.  Uses
+ * what is left of the IGMP_BUDGET on the backlog, then starts the
+ * budgets over for the next iteration.
+ */
+void igmp_run_backlog(void)
+{
+    struct igmp_deferred *d;
+
+    while (igmp_dispatch.head && igmp_dispatch.control_run < IGMP_BUDGET) {
+	d = igmp_dispatch.head;
+	igmp_dispatch.head = d->next;
+	if (!igmp_dispatch.head)
+	    igmp_dispatch.tail = NULL;
+	igmp_dispatch.len--;
+
+	igmp_dispatch.control++;
+	igmp_dispatch.control_run++;
+	igmp_recv_buf = d->data;
+	accept_igmp(d->len);
+	free(d);
+    }
+
+    igmp_recv_buf = igmp_recv_batch.buf[0];
+    igmp_dispatch.upcalls_run = 0;
+    igmp_dispatch.control_run = 0;
+}
+
+/*
+ * Returns TRUE if the backlog has packets waiting, the main loop should
+ * then not sleep.
+ */
+int igmp_backlog_pending(void)
+{
+    return igmp_dispatch.head != NULL;
+}
+
+void dump_igmp_dispatch(FILE *fp)
+{
+    fprintf(fp, "Dispatch        Upcalls     Control    Deferred     Dropped  Backlog  Peak   Exhausted\n");
+    fprintf(fp, "%-12s %10lu %11lu %11lu %11lu %8u %5u %11lu\n\n", "IGMP",
+	    igmp_dispatch.upcalls, igmp_dispatch.control, igmp_dispatch.deferred,
+	    igmp_dispatch.dropped, igmp_dispatch.len, igmp_dispatch.peak,
+	    igmp_dispatch.exhausted);
 }
 
 
@@ -282,7 +437,6 @@ static void accept_igmp(ssize_t recvlen)
 
 void send_igmp(char *buf, u_int32 src, u_int32 dst, int type, int code, u_int32 group, int datalen)
 {
-    struct sockaddr_in sdst;
     struct ip *ip;
     struct igmp *igmp;
     int sendlen;
@@ -307,11 +461,8 @@ void send_igmp(char *buf, u_int32 src, u_int32 dst, int type, int code, u_int32
 					 IGMP_MINLEN + datalen);
     
     if (IN_MULTICAST(ntohl(dst))) {
-	k_set_if(igmp_socket, src);
-	if (type != IGMP_DVMRP || dst == allhosts_group) {
+	if (type != IGMP_DVMRP || dst == allhosts_group)
 	    setloop = 1;
-	    k_set_loop(igmp_socket, TRUE);
-	}
 #ifdef RAW_OUTPUT_IS_RAW
 	ip->ip_ttl = curttl;
     } else {
@@ -319,29 +470,14 @@ void send_igmp(char *buf, u_int32 src, u_int32 dst, int type, int code, u_int32
 #endif /* RAW_OUTPUT_IS_RAW */
     }
     
-    memset(&sdst, 0, sizeof(sdst));
-    sdst.sin_family = AF_INET;
-#ifdef HAVE_SA_LEN
-    sdst.sin_len = sizeof(sdst);
-#endif
-    sdst.sin_addr.s_addr = dst;
-    while (sendto(igmp_socket, igmp_send_buf, sendlen, 0, (struct sockaddr *)&sdst, sizeof(sdst)) < 0) {
-	if (errno == EINTR)
-	    continue;		/* Received signal, retry syscall. */
-	else if (errno == ENETDOWN || errno == ENODEV)
+    if (k_send(igmp_socket, igmp_send_buf, sendlen, src, dst, setloop) < 0) {
+	if (errno == ENETDOWN || errno == ENODEV)
 	    check_vif_state();
 	else
 	    logit(log_level(IPPROTO_IGMP, type, code), errno, "Sendto to %s on %s",
 		   inet_fmt(dst, s1, sizeof(s1)), inet_fmt(src, s2, sizeof(s2)));
-
-	 if (setloop)
-	     k_set_loop(igmp_socket, FALSE);
-
-	 return;
-     }
-
-     if (setloop)
-	 k_set_loop(igmp_socket, FALSE);
+	return;
+    }
 
      IF_DEBUG(DEBUG_PKT|debug_kind(IPPROTO_IGMP, type, code)) {
 	 logit(LOG_DEBUG, 0, "SENT %s from %-15s to %s",
@@ -55,6 +55,7 @@ typedef struct {
 static void DelVif       (void *arg);
 static int SetTimer      (vifi_t vifi, struct listaddr *g);
 static int DeleteTimer   (int id);
+static int ResetTimer    (vifi_t vifi, struct listaddr *g);
 static void SendQuery    (void *arg);
 static int SetQueryTimer (struct listaddr *g, vifi_t vifi, int to_expire, int q_time);
 
@@ -198,15 +199,14 @@ void accept_membership_query(u_int32 src, u_int32 dst __attribute__((unused)), u
 	for (g = v->uv_groups; g != NULL; g = g->al_next) {
 	    if (group == g->al_addr && g->al_query == 0) {
 		/* setup a timeout to remove the group membership */
-		if (g->al_timerid)
-		    g->al_timerid = DeleteTimer(g->al_timerid);
-		g->al_timer = IGMP_LAST_MEMBER_QUERY_COUNT * tmo / IGMP_TIMER_SCALE;
+		/* tmo is in 1/IGMP_TIMER_SCALE seconds, keep the fraction */
+		g->al_timer = IGMP_LAST_MEMBER_QUERY_COUNT * tmo * 1000 / IGMP_TIMER_SCALE;
 		/* use al_query to record our presence in last-member state */
 		g->al_query = -1;
-		g->al_timerid = SetTimer(vifi, g);
+		g->al_timerid = ResetTimer(vifi, g);
 		IF_DEBUG(DEBUG_IGMP) {
 		    logit(LOG_DEBUG, 0,
-			  "timer for grp %s on vif %d set to %ld",
+			  "timer for grp %s on vif %d set to %ld msec",
 			  inet_fmt(group, s2, sizeof(s2)), vifi, g->al_timer);
 		}
 		break;
@@ -246,13 +246,11 @@ void accept_group_report(u_int32 src, u_int32 dst __attribute__((unused)), u_int
 
 	    g->al_reporter = src;
 
-	    /** delete old timers, set a timer for expiration **/
-	    g->al_timer = IGMP_GROUP_MEMBERSHIP_INTERVAL;
+	    /** delete old query timer, move the timer for expiration **/
+	    g->al_timer = IGMP_GROUP_MEMBERSHIP_INTERVAL * 1000;
 	    if (g->al_query)
 		g->al_query = DeleteTimer(g->al_query);
-	    if (g->al_timerid)
-		g->al_timerid = DeleteTimer(g->al_timerid);
-	    g->al_timerid = SetTimer(vifi, g);
+	    g->al_timerid = ResetTimer(vifi, g);
 	    /* TODO: might need to add a check if I am the forwarder??? */
 	    /* if (v->uv_flags & VIFF_DR) */
 	    add_leaf(vifi, INADDR_ANY_N, group);
@@ -278,7 +276,7 @@ void accept_group_report(u_int32 src, u_int32 dst __attribute__((unused)), u_int
 
 	/** set a timer for expiration **/
 	g->al_query     = 0;
-	g->al_timer     = IGMP_GROUP_MEMBERSHIP_INTERVAL;
+	g->al_timer     = IGMP_GROUP_MEMBERSHIP_INTERVAL * 1000;
 	g->al_reporter  = src;
 	g->al_timerid   = SetTimer(vifi, g);
 	g->al_next      = v->uv_groups;
@@ -340,10 +338,6 @@ void accept_leave_message(u_int32 src, u_int32 dst __attribute__((unused)), u_in
 	    if (g->al_query)
 		return;
 
-	    /** delete old timer set a timer for expiration **/
-	    if (g->al_timerid)
-		g->al_timerid = DeleteTimer(g->al_timerid);
-
 #if IGMP_LAST_MEMBER_QUERY_COUNT != 2
 /*
   This code needs to be updated to keep a counter of the number
@@ -351,7 +345,7 @@ void accept_leave_message(u_int32 src, u_int32 dst __attribute__((unused)), u_in
 */
 #endif
 	    /** send a group specific querry **/
-	    g->al_timer = IGMP_LAST_MEMBER_QUERY_INTERVAL *
+	    g->al_timer = IGMP_LAST_MEMBER_QUERY_INTERVAL * 1000 *
 		(IGMP_LAST_MEMBER_QUERY_COUNT + 1);
 	    if (v->uv_flags & VIFF_QUERIER) {
 		send_igmp(igmp_send_buf, v->uv_lcl_addr, g->al_addr,
@@ -360,9 +354,10 @@ void accept_leave_message(u_int32 src, u_int32 dst __attribute__((unused)), u_in
 			  g->al_addr, 0);
 	    }
 	    g->al_query = SetQueryTimer(g, vifi,
-					IGMP_LAST_MEMBER_QUERY_INTERVAL,
+					IGMP_LAST_MEMBER_QUERY_INTERVAL * 1000,
 					IGMP_LAST_MEMBER_QUERY_INTERVAL * IGMP_TIMER_SCALE);
-	    g->al_timerid = SetTimer(vifi, g);
+	    /** move the timer for expiration **/
+	    g->al_timerid = ResetTimer(vifi, g);
 	    break;
 	}
     }
@@ -418,7 +413,20 @@ static int SetTimer(vifi_t vifi, struct listaddr *g)
     cbk->vifi = vifi;
     cbk->g = g;
 
-    return timer_setTimer(g->al_timer, DelVif, cbk);
+    return timer_setTimer_ms(g->al_timer, DelVif, cbk);
+}
+
+
+/*
+ * Move the timer of a group membership to the new al_timer, without
+ * giving it a new callback.  Sets a new timer if it has already gone.
+ */
+static int ResetTimer(vifi_t vifi, struct listaddr *g)
+{
+    if (timer_rescheduleTimer_ms(g->al_timerid, g->al_timer))
+	return g->al_timerid;
+
+    return SetTimer(vifi, g);
 }
 
 
@@ -452,7 +460,7 @@ static void SendQuery(void *arg)
 
 
 /*
- * Set a timer to send a group-specific query.
+ * Set a timer to send a group-specific query, to_expire is in msec.
  */
 static int SetQueryTimer(struct listaddr *g, vifi_t vifi, int to_expire, int q_time)
 {
@@ -468,7 +476,7 @@ static int SetQueryTimer(struct listaddr *g, vifi_t vifi, int to_expire, int q_t
     cbk->q_time = q_time;
     cbk->vifi = vifi;
 
-    return timer_setTimer(to_expire, SendQuery, cbk);
+    return timer_setTimer_ms(to_expire, SendQuery, cbk);
 }
 
 /**
@@ -51,6 +51,11 @@ int curttl = 0;
 #define MRT_PIM MRT_ASSERT
 #endif /* MRT_PIM */
 
+static void k_mfc_shadow_reset	(void);
+static int  k_put_mfc		(int socket, u_int32 source, u_int32 group, vifi_t iif,
+				 vifbitmap_t oifs, u_int32 rp_addr);
+static int  k_rm_mfc		(int socket, u_int32 source, u_int32 group);
+
 /*
  * Open/init the multicast routing in the kernel and sets the
  * MRT_PIM (aka MRT_ASSERT) flag in the kernel.
@@ -68,6 +73,11 @@ void k_init_pim(int socket)
 
     if (setsockopt(socket, IPPROTO_IP, MRT_PIM, (char *)&v, sizeof(int)) < 0)
         logit(LOG_ERR, errno, "Cannot set PIM flag in kernel");
+
+#ifdef HAVE_NETLINK_MFC
+    nl_mfc_init();
+#endif /* HAVE_NETLINK_MFC */
+    k_mfc_shadow_reset();
 }
 
 
@@ -79,6 +89,10 @@ void k_stop_pim(int socket)
 {
     int v = 0;
 
+#ifdef HAVE_NETLINK_MFC
+    nl_mfc_stop();
+#endif /* HAVE_NETLINK_MFC */
+
     if (setsockopt(socket, IPPROTO_IP, MRT_PIM, (char *)&v, sizeof(int)) < 0)
         logit(LOG_ERR, errno, "Cannot reset PIM flag in kernel");
 
@@ -239,6 +253,114 @@ void k_set_if(int socket, u_int32 ifa)
     }
 }
 
+/*
+ * Setup the multicast loopback of a socket used with k_send().  With
+ * IP_PKTINFO it is left enabled, since nearly every message we send to
+ * a group is link-local and wants it, and only toggled for the others.
+ */
+void k_init_send(int socket)
+{
+#ifdef HAVE_IP_PKTINFO
+    k_set_loop(socket, TRUE);
+#else
+    k_set_loop(socket, FALSE);
+#endif /* HAVE_IP_PKTINFO */
+}
+
+#ifdef HAVE_IP_PKTINFO
+/*
+ * Fill in an IP_PKTINFO control message sending a multicast out the
+ * interface owning src.  The buffer must hold K_PKTINFO_SPACE bytes,
+ * suitably aligned for a struct cmsghdr.  Returns the msg_controllen.
+ */
+socklen_t k_set_pktinfo(void *ctl, u_int32 src)
+{
+    struct cmsghdr *cmsg = (struct cmsghdr *)ctl;
+    struct in_pktinfo *pktinfo;
+    vifi_t vifi;
+
+    memset(ctl, 0, K_PKTINFO_SPACE);
+    cmsg->cmsg_level = IPPROTO_IP;
+    cmsg->cmsg_type  = IP_PKTINFO;
+    cmsg->cmsg_len   = CMSG_LEN(sizeof(struct in_pktinfo));
+
+    pktinfo = (struct in_pktinfo *)CMSG_DATA(cmsg);
+    vifi    = local_address(src);
+    if (vifi != NO_VIF && uvifs[vifi].uv_ifindex > 0)
+	pktinfo->ipi_ifindex = uvifs[vifi].uv_ifindex;
+    pktinfo->ipi_spec_dst.s_addr = src;
+
+    return K_PKTINFO_SPACE;
+}
+#endif /* HAVE_IP_PKTINFO */
+
+/*
+ * Send a raw IP packet to dst.  A multicast leaves on the interface
+ * owning src, and is looped back to local members if loop is set.
+ * Returns like sendto(), but never fails with EINTR.
+ */
+int k_send(int socket, char *buf, int len, u_int32 src, u_int32 dst, int loop)
+{
+    struct sockaddr_in sdst;
+    int multicast = IN_MULTICAST(ntohl(dst));
+    int result, err;
+#ifdef HAVE_IP_PKTINFO
+    struct msghdr msg;
+    struct iovec iov;
+    union {
+	struct cmsghdr hdr;
+	char	       buf[K_PKTINFO_SPACE];
+    } ctl;
+#endif /* HAVE_IP_PKTINFO */
+
+    memset(&sdst, 0, sizeof(sdst));
+    sdst.sin_family = AF_INET;
+#ifdef HAVE_SA_LEN
+    sdst.sin_len = sizeof(sdst);
+#endif
+    sdst.sin_addr.s_addr = dst;
+
+#ifdef HAVE_IP_PKTINFO
+    iov.iov_base = buf;
+    iov.iov_len  = len;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name    = &sdst;
+    msg.msg_namelen = sizeof(sdst);
+    msg.msg_iov     = &iov;
+    msg.msg_iovlen  = 1;
+    if (multicast) {
+	msg.msg_control    = ctl.buf;
+	msg.msg_controllen = k_set_pktinfo(ctl.buf, src);
+	if (!loop)
+	    k_set_loop(socket, FALSE);
+    }
+
+    while ((result = sendmsg(socket, &msg, 0)) < 0 && errno == EINTR)
+	;			/* Received signal, retry syscall. */
+
+    err = errno;
+    if (multicast && !loop)
+	k_set_loop(socket, TRUE);
+#else
+    if (multicast) {
+	k_set_if(socket, src);
+	if (loop)
+	    k_set_loop(socket, TRUE);
+    }
+
+    while ((result = sendto(socket, buf, len, 0, (struct sockaddr *)&sdst, sizeof(sdst))) < 0
+	   && errno == EINTR)
+	;			/* Received signal, retry syscall. */
+
+    err = errno;
+    if (multicast && loop)
+	k_set_loop(socket, FALSE);
+#endif /* HAVE_IP_PKTINFO */
+
+    errno = err;
+    return result;
+}
+
 
 /*
  * Join a multicast group on virtual interface 'v'.
@@ -366,15 +488,249 @@ void k_del_vif(int socket, vifi_t vifi, struct uvif *v __attribute__((unused)))
 
 
 /*
- * Delete all MFC entries for particular routing entry from the kernel.
+ * Shadow of the MFC entries installed in the kernel.  k_chg_mfc() and
+ * k_del_mfc() only record the wanted state of the (S,G) and put it on
+ * the dirty list.  k_flush_mfc(), once per main loop iteration, writes
+ * the entries whose iif or oifs differ from what the kernel has.  The
+ * changes one J/P message or a burst of IGMP reports makes to the same
+ * entry cost one kernel write, and a change back to the installed state
+ * costs none.
+ */
+typedef struct mfc_shadow {
+    hash_entry_t	hash;		/* in mfc_shadow_hash, by (S,G)	    */
+    struct mfc_shadow  *next;		/* all entries, in no order	    */
+    struct mfc_shadow  *prev;
+    struct mfc_shadow  *dirty;		/* next on the dirty list	    */
+    u_int32		source;
+    u_int32		group;
+    u_int8		flags;
+    vifi_t		iif;		/* as installed in the kernel	    */
+    vifbitmap_t		oifs;
+    u_int32		rp_addr;
+    vifi_t		want_iif;	/* as wanted after the next flush   */
+    vifbitmap_t		want_oifs;
+    u_int32		want_rp_addr;
+} mfc_shadow_t;
+
+#define MFC_SHADOW_INSTALLED	0x01	/* iif and oifs are in the kernel   */
+#define MFC_SHADOW_WANTED	0x02	/* want_* should be in the kernel   */
+#define MFC_SHADOW_DIRTY	0x04	/* on the dirty list		    */
+#define MFC_SHADOW_DELETED	0x08	/* deleted since the last flush	    */
+
+static pool_t	     mfc_shadow_pool;
+static hash_table_t  mfc_shadow_hash;
+static mfc_shadow_t *mfc_shadow_list;
+static mfc_shadow_t *mfc_shadow_dirty;
+
+static struct {
+    u_long	 changes;	/* k_chg_mfc() calls			    */
+    u_long	 deletes;	/* k_del_mfc() calls			    */
+    u_long	 adds;		/* entries written to the kernel	    */
+    u_long	 dels;		/* entries removed from the kernel	    */
+    u_long	 elided;	/* dirty entries found as installed	    */
+    u_long	 flushes;	/* k_flush_mfc() calls with dirty entries   */
+} mfc_shadow_stats;
+
+static void k_mfc_shadow_free(mfc_shadow_t *ms)
+{
+    hash_remove(&mfc_shadow_hash, &ms->hash);
+    if (ms->prev != NULL)
+	ms->prev->next = ms->next;
+    else
+	mfc_shadow_list = ms->next;
+    if (ms->next != NULL)
+	ms->next->prev = ms->prev;
+    pool_free(&mfc_shadow_pool, ms);
+}
+
+/*
+ * Forget the whole shadow, the kernel cache is gone with MRT_DONE.
+ */
+static void k_mfc_shadow_reset(void)
+{
+    if (!mfc_shadow_pool.size) {
+	pool_init(&mfc_shadow_pool, "mfc_shadow", sizeof(mfc_shadow_t));
+	hash_init(&mfc_shadow_hash, "MFC shadow", HASH_DEFAULT_SIZE);
+	return;
+    }
+
+    mfc_shadow_dirty = NULL;
+    while (mfc_shadow_list != NULL)
+	k_mfc_shadow_free(mfc_shadow_list);
+}
+
+/*
+ * Returns the shadow of the (S,G), on the dirty list.  NULL if it did
+ * not exist and create is FALSE, or if out of memory.
+ */
+static mfc_shadow_t *k_mfc_shadow(u_int32 source, u_int32 group, int create)
+{
+    mfc_shadow_t *ms;
+
+    ms = (mfc_shadow_t *)hash_find(&mfc_shadow_hash, source, group);
+    if (ms == NULL) {
+	if (!create)
+	    return NULL;
+	ms = (mfc_shadow_t *)pool_alloc(&mfc_shadow_pool);
+	if (ms == NULL)
+	    return NULL;
+	ms->source = source;
+	ms->group  = group;
+	hash_insert(&mfc_shadow_hash, &ms->hash, source, group, ms);
+	ms->next = mfc_shadow_list;
+	if (mfc_shadow_list != NULL)
+	    mfc_shadow_list->prev = ms;
+	mfc_shadow_list = ms;
+    }
+
+    if (!(ms->flags & MFC_SHADOW_DIRTY)) {
+	ms->flags |= MFC_SHADOW_DIRTY;
+	ms->dirty = mfc_shadow_dirty;
+	mfc_shadow_dirty = ms;
+    }
+
+    return ms;
+}
+
+/*
+ * The kernel has no resolved entry for the (S,G), whatever the shadow
+ * says: it just reported a cache miss for it, or refused to add it.  The
+ * next k_chg_mfc() of the entry is written out again.
+ */
+void k_forget_mfc(u_int32 source, u_int32 group)
+{
+    mfc_shadow_t *ms;
+
+    ms = (mfc_shadow_t *)hash_find(&mfc_shadow_hash, source, group);
+    if (ms == NULL)
+	return;
+
+    ms->flags &= ~(MFC_SHADOW_INSTALLED | MFC_SHADOW_DELETED);
+    if (!(ms->flags & MFC_SHADOW_DIRTY)) {
+	ms->flags &= ~MFC_SHADOW_WANTED;
+	k_mfc_shadow_free(ms);
+    }
+}
+
+/*
+ * Push the MFC changes made since the last call to the kernel.  Called
+ * from the main loop before it waits for more input, and before the
+ * kernel counters are read.
+ */
+void k_flush_mfc(void)
+{
+    mfc_shadow_t *ms;
+
+    if (mfc_shadow_dirty != NULL)
+	mfc_shadow_stats.flushes++;
+
+    while ((ms = mfc_shadow_dirty) != NULL) {
+	mfc_shadow_dirty = ms->dirty;
+	ms->flags &= ~MFC_SHADOW_DIRTY;
+
+	/* Deleted and added again: the kernel counters must start over */
+	if ((ms->flags & MFC_SHADOW_INSTALLED)
+	    && (!(ms->flags & MFC_SHADOW_WANTED) || (ms->flags & MFC_SHADOW_DELETED))) {
+	    k_rm_mfc(igmp_socket, ms->source, ms->group);
+	    ms->flags &= ~MFC_SHADOW_INSTALLED;
+	    mfc_shadow_stats.dels++;
+	}
+	ms->flags &= ~MFC_SHADOW_DELETED;
+
+	if (ms->flags & MFC_SHADOW_WANTED) {
+	    if ((ms->flags & MFC_SHADOW_INSTALLED)
+		&& ms->iif == ms->want_iif && VIFM_SAME(ms->oifs, ms->want_oifs)
+		&& ms->rp_addr == ms->want_rp_addr) {
+		mfc_shadow_stats.elided++;
+		continue;
+	    }
+	    if (k_put_mfc(igmp_socket, ms->source, ms->group, ms->want_iif, ms->want_oifs,
+			  ms->want_rp_addr)) {
+		ms->flags  |= MFC_SHADOW_INSTALLED;
+		ms->iif     = ms->want_iif;
+		VIFM_COPY(ms->want_oifs, ms->oifs);
+		ms->rp_addr = ms->want_rp_addr;
+		mfc_shadow_stats.adds++;
+		continue;
+	    }
+	    ms->flags &= ~(MFC_SHADOW_INSTALLED | MFC_SHADOW_WANTED);
+	}
+
+	if (!(ms->flags & MFC_SHADOW_INSTALLED))
+	    k_mfc_shadow_free(ms);
+    }
+
+#ifdef HAVE_NETLINK_MFC
+    nl_mfc_flush();
+#endif /* HAVE_NETLINK_MFC */
+}
+
+/*
+ * Delete all MFC entries for particular routing entry from the kernel,
+ * at the next k_flush_mfc().
  */
 int k_del_mfc(int socket, u_int32 source, u_int32 group)
+{
+    mfc_shadow_t *ms;
+
+    mfc_shadow_stats.deletes++;
+    ms = (mfc_shadow_t *)hash_find(&mfc_shadow_hash, source, group);
+    if (ms == NULL)		/* Written directly by k_chg_mfc(), if at all */
+	return k_rm_mfc(socket, source, group);
+
+    if (ms->flags & MFC_SHADOW_INSTALLED)
+	ms->flags |= MFC_SHADOW_DELETED;
+    ms->flags &= ~MFC_SHADOW_WANTED;
+    k_mfc_shadow(source, group, FALSE);
+
+    return TRUE;
+}
+
+/*
+ * Install/modify a MFC entry in the kernel, at the next k_flush_mfc().
+ */
+int k_chg_mfc(int socket, u_int32 source, u_int32 group, vifi_t iif, vifbitmap_t oifs, u_int32 rp_addr)
+{
+    mfc_shadow_t *ms;
+
+    mfc_shadow_stats.changes++;
+    ms = k_mfc_shadow(source, group, TRUE);
+    if (ms == NULL)
+	return k_put_mfc(socket, source, group, iif, oifs, rp_addr);
+
+    /* The iif is removed at the packet forwarding phase, see k_put_mfc() */
+    VIFM_CLR(iif, oifs);
+    ms->flags       |= MFC_SHADOW_WANTED;
+    ms->want_iif     = iif;
+    VIFM_COPY(oifs, ms->want_oifs);
+    ms->want_rp_addr = rp_addr;
+
+    return TRUE;
+}
+
+void dump_mfc_shadow(FILE *fp)
+{
+    fprintf(fp, "MFC shadow    Entries     Changes     Deletes        Adds        Dels      Elided     Flushes\n");
+    fprintf(fp, "%-12s %8u %11lu %11lu %11lu %11lu %11lu %11lu\n\n", "Kernel",
+	    mfc_shadow_hash.count, mfc_shadow_stats.changes, mfc_shadow_stats.deletes,
+	    mfc_shadow_stats.adds, mfc_shadow_stats.dels, mfc_shadow_stats.elided,
+	    mfc_shadow_stats.flushes);
+}
+
+/*
+ * Remove an (S,G) entry from the kernel.
+ */
+static int k_rm_mfc(int socket, u_int32 source, u_int32 group)
 {
     struct mfcctl mc;
 
     mc.mfcc_origin.s_addr   = source;
     mc.mfcc_mcastgrp.s_addr = group;
 
+#ifdef HAVE_NETLINK_MFC
+    /* Batched over netlink when the kernel takes it, see nl_mfc_del() */
+    if (!nl_mfc_del(source, group))
+#endif /* HAVE_NETLINK_MFC */
     if (setsockopt(socket, IPPROTO_IP, MRT_DEL_MFC, (char *)&mc, sizeof(mc)) < 0) {
         logit(LOG_WARNING, errno, "Failed removing MFC entry src %s, grp %s",
               inet_fmt(mc.mfcc_origin.s_addr, s1, sizeof(s1)),
@@ -396,7 +752,7 @@ int k_del_mfc(int socket, u_int32 source, u_int32 group)
 /*
  * Install/modify a MFC entry in the kernel
  */
-int k_chg_mfc(int socket, u_int32 source, u_int32 group, vifi_t iif, vifbitmap_t oifs, u_int32 rp_addr __attribute__((unused)))
+static int k_put_mfc(int socket, u_int32 source, u_int32 group, vifi_t iif, vifbitmap_t oifs, u_int32 rp_addr __attribute__((unused)))
 {
     struct mfcctl mc;
     vifi_t vifi;
@@ -424,6 +780,11 @@ int k_chg_mfc(int socket, u_int32 source, u_int32 group, vifi_t iif, vifbitmap_t
 #ifdef PIM_REG_KERNEL_ENCAP
     mc.mfcc_rp_addr.s_addr = rp_addr;
 #endif
+#ifdef HAVE_NETLINK_MFC
+    /* Batched over netlink when the kernel takes it, see nl_mfc_add() */
+    if (nl_mfc_add(source, group, iif, oifs))
+	return TRUE;
+#endif /* HAVE_NETLINK_MFC */
     if (setsockopt(socket, IPPROTO_IP, MRT_ADD_MFC, (char *)&mc, sizeof(mc)) < 0) {
         logit(LOG_WARNING, errno, "Failed adding MFC entry src %s grp %s",
               inet_fmt(mc.mfcc_origin.s_addr, s1, sizeof(s1)),
@@ -493,6 +854,112 @@ int k_get_sg_cnt(int socket, u_int32 source, u_int32 group, struct sg_count *ret
     return 0;
 }
 
+static recv_batch_t *recv_batch_list;	/* all batches, for the dump */
+
+/*
+ * Set up a batch of `size' receive buffers.  Without recvmmsg() there is
+ * only ever one packet per call.
+ */
+void k_recv_init(recv_batch_t *rb, const char *name, int size)
+{
+#ifdef HAVE_RECVMMSG
+    int i;
+#else
+    size = 1;
+#endif /* HAVE_RECVMMSG */
+
+    memset(rb, 0, sizeof(*rb));
+    rb->name  = name;
+    rb->size  = size;
+    rb->buf   = (char **)calloc(size, sizeof(char *));
+    rb->len   = (ssize_t *)calloc(size, sizeof(ssize_t));
+    rb->slots = (char *)malloc(size * RECV_SLOT_SIZE);
+#ifdef HAVE_RECVMMSG
+    rb->msgs  = (struct mmsghdr *)calloc(size, sizeof(struct mmsghdr));
+    rb->iovs  = (struct iovec *)calloc(size, sizeof(struct iovec));
+    if (!rb->msgs || !rb->iovs)
+	logit(LOG_ERR, 0, "Ran out of memory in k_recv_init(%s)", name);
+
+    for (i = 0; i < size; i++) {
+	rb->iovs[i].iov_base = rb->slots + i * RECV_SLOT_SIZE;
+	rb->iovs[i].iov_len  = RECV_SLOT_SIZE;
+	rb->msgs[i].msg_hdr.msg_iov    = &rb->iovs[i];
+	rb->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+#endif /* HAVE_RECVMMSG */
+    if (!rb->buf || !rb->len || !rb->slots)
+	logit(LOG_ERR, 0, "Ran out of memory in k_recv_init(%s)", name);
+    rb->buf[0] = rb->slots;
+
+    rb->next = recv_batch_list;
+    recv_batch_list = rb;
+}
+
+/*
+ * Read the packets waiting on the socket, up to the batch size, with a
+ * single system call.  The packets are left in rb->buf[] and rb->len[].
+ * Returns their number, or -1 with errno set.
+ */
+int k_recv(int socket, recv_batch_t *rb)
+{
+    int n, got;
+#ifdef HAVE_RECVMMSG
+    int i;
+
+    while ((got = recvmmsg(socket, rb->msgs, rb->size, MSG_DONTWAIT, NULL)) < 0) {
+	if (errno == EINTR)
+	    continue;		/* Received signal, retry syscall. */
+	if (errno == EAGAIN || errno == EWOULDBLOCK)
+	    return 0;	/* Somebody else got it first */
+	return -1;
+    }
+
+    for (i = 0, n = 0; i < got; i++) {
+	if (rb->msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+	    rb->truncated++;
+	    continue;
+	}
+	rb->buf[n]   = rb->iovs[i].iov_base;
+	rb->len[n++] = rb->msgs[i].msg_len;
+    }
+#else
+    socklen_t dummy = 0;
+    ssize_t len;
+
+    while ((len = recvfrom(socket, rb->slots, RECV_SLOT_SIZE, 0, NULL, &dummy)) < 0) {
+	if (errno == EINTR)
+	    continue;		/* Received signal, retry syscall. */
+	return -1;
+    }
+    rb->buf[0] = rb->slots;
+    rb->len[0] = len;
+    n = got = 1;
+#endif /* HAVE_RECVMMSG */
+
+    rb->calls++;
+    rb->packets += got;
+    if ((u_int)got > rb->largest)
+	rb->largest = got;
+    if (got == rb->size)
+	rb->full++;
+
+    return n;
+}
+
+void dump_recv_batches(FILE *fp)
+{
+    recv_batch_t *rb;
+
+    fprintf(fp, "Receive      Batch       Calls     Packets  Avg  Largest        Full   Truncated\n");
+    for (rb = recv_batch_list; rb; rb = rb->next) {
+	fprintf(fp, "%-12s %5d %11lu %11lu %4lu %8u %11lu %11lu\n", rb->name,
+		rb->size, rb->calls, rb->packets,
+		rb->calls ? rb->packets / rb->calls : 0, rb->largest,
+		rb->full, rb->truncated);
+    }
+    fprintf(fp, "\n");
+}
+
 /**
  * Local Variables:
  *  version-control: t
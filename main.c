@@ -45,6 +45,11 @@
 #include <err.h>
 #include <getopt.h>
 #include <sys/stat.h>
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#endif /* HAVE_EPOLL */
 
 #ifdef SNMP
 #include "snmp.h"
@@ -79,6 +84,26 @@ static struct ihandler {
 } ihandlers[NHANDLERS];
 static int nhandlers = 0;
 
+#ifdef HAVE_EPOLL
+/*
+ * The handlers are registered with epoll once, by their index in
+ * ihandlers[].  The callout queue wakes us up through a timerfd, and
+ * the signals are read from a signalfd instead of interrupting us.
+ */
+#define EVENT_TIMER	NHANDLERS	/* epoll data of timer_fd	 */
+#define EVENT_SIGNAL	(NHANDLERS + 1)	/* epoll data of signal_fd	 */
+#define EVENT_MAX	(NHANDLERS + 2)	/* events returned per wakeup	 */
+
+static int event_fd  = -1;		/* the epoll instance		 */
+static int timer_fd  = -1;		/* expires with the callout queue */
+static int signal_fd = -1;		/* the signals of handler()	 */
+
+static void event_init	(void);
+static void event_signals(void);
+static int  event_add	(int fd, u_int32 id);
+static void event_wait	(void);
+#endif /* HAVE_EPOLL */
+
 static struct debugname {
     char	*name;
     uint32_t	 level;
@@ -169,11 +194,137 @@ int register_input_handler(int fd, ihfunc_t func)
 	return -1;
 
     ihandlers[nhandlers].fd = fd;
-    ihandlers[nhandlers++].func = func;
+    ihandlers[nhandlers].func = func;
+#ifdef HAVE_EPOLL
+    if (event_add(fd, nhandlers) < 0)
+	return -1;
+#endif /* HAVE_EPOLL */
+    nhandlers++;
 
     return 0;
 }
 
+#ifdef HAVE_EPOLL
+static int event_add(int fd, u_int32 id)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u32 = id;
+    if (epoll_ctl(event_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+	logit(LOG_WARNING, errno, "Cannot add fd %d to epoll", fd);
+	return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Must be called before any input handler is registered.  The
+ * descriptors survive a restart(), the sockets closed there drop out of
+ * the epoll set by themselves.
+ */
+static void event_init(void)
+{
+    sigset_t set;
+
+    event_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (event_fd < 0)
+	logit(LOG_ERR, errno, "epoll_create1");
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd < 0)
+	logit(LOG_ERR, errno, "timerfd_create");
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGALRM);
+    sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGUSR2);
+    if (sigprocmask(SIG_BLOCK, &set, NULL) < 0)
+	logit(LOG_ERR, errno, "sigprocmask");
+
+    if (event_add(timer_fd, EVENT_TIMER) < 0)
+	logit(LOG_ERR, 0, "Cannot initialize the event loop");
+}
+
+/*
+ * Must be called after detaching from the terminal: epoll only reports
+ * a signalfd readable for the process which added it.  The signals
+ * blocked by event_init() stay pending until then.
+ */
+static void event_signals(void)
+{
+    sigset_t set;
+
+    if (sigprocmask(SIG_BLOCK, NULL, &set) < 0)
+	logit(LOG_ERR, errno, "sigprocmask");
+    signal_fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd < 0)
+	logit(LOG_ERR, errno, "signalfd");
+
+    if (event_add(signal_fd, EVENT_SIGNAL) < 0)
+	logit(LOG_ERR, 0, "Cannot initialize the event loop");
+}
+
+/*
+ * Wait until a handler is readable, a signal arrives, or the next
+ * callout is due, and dispatch what we got.
+ */
+static void event_wait(void)
+{
+    struct epoll_event events[EVENT_MAX];
+    struct signalfd_siginfo ssi;
+    struct itimerspec its;
+    u_int64_t expired;
+    int msecs, n, i;
+    u_int32 id;
+
+    msecs = timer_nextTimer();
+    if (igmp_backlog_pending())
+	msecs = 0;
+    if (msecs > 0) {
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = msecs / 1000;
+	its.it_value.tv_nsec = (msecs % 1000) * 1000000;
+	if (timerfd_settime(timer_fd, 0, &its, NULL) < 0)
+	    logit(LOG_WARNING, errno, "timerfd_settime");
+    }
+
+    /* Nothing pending: sleep until some input, something due: just poll */
+    n = epoll_wait(event_fd, events, EVENT_MAX, msecs > 0 ? -1 : msecs);
+    if (n < 0) {
+	if (errno != EINTR)
+	    logit(LOG_WARNING, errno, "epoll_wait failed");
+	return;
+    }
+
+    for (i = 0; i < n; i++) {
+	id = events[i].data.u32;
+	if (id == EVENT_TIMER) {
+	    /* Only clears the timer, age_callout_queue() reads the clock */
+	    if (read(timer_fd, &expired, sizeof(expired)) < 0 && errno != EAGAIN)
+		logit(LOG_WARNING, errno, "read timerfd");
+	} else if (id == EVENT_SIGNAL) {
+	    while (read(signal_fd, &ssi, sizeof(ssi)) == sizeof(ssi))
+		handler(ssi.ssi_signo);
+	} else if (id < (u_int32)nhandlers && ihandlers[id].fd == igmp_socket) {
+	    /* The kernel upcalls first, see igmp_read() */
+	    (*ihandlers[id].func)(ihandlers[id].fd, NULL);
+	}
+    }
+
+    for (i = 0; i < n; i++) {
+	id = events[i].data.u32;
+	if (id < (u_int32)nhandlers && ihandlers[id].fd != igmp_socket)
+	    (*ihandlers[id].func)(ihandlers[id].fd, NULL);
+    }
+}
+#endif /* HAVE_EPOLL */
+
 static void do_randomize(void)
 {
 #define rol32(data,shift) ((data) >> (shift)) | ((data) << (32 - (shift)))
@@ -289,10 +440,13 @@ static int usage(void)
 int main(int argc, char *argv[])
 {
     int dummysigalrm, foreground = 0;
-    struct timeval tv, difftime, curtime, lasttime, *timeout;
+#ifndef HAVE_EPOLL
+    struct timeval tv, *timeout;
     fd_set rfds, readers;
-    int nfds, n, i, secs, ch;
+    int nfds, msecs;
     struct sigaction sa;
+#endif /* HAVE_EPOLL */
+    int n, i __attribute__((unused)), ch;
     time_t boottime;
     struct option long_options[] = {
 	{"config", 1, 0, 'c'},
@@ -451,10 +605,14 @@ int main(int argc, char *argv[])
     do_randomize();
     time(&boottime);
 
+    callout_init();
+
     /* Start up the log rate-limiter */
     resetlogging(NULL);
 
-    callout_init();
+#ifdef HAVE_EPOLL
+    event_init();
+#endif /* HAVE_EPOLL */
     init_igmp();
     init_pim();
 #ifdef HAVE_ROUTING_SOCKETS
@@ -476,6 +634,7 @@ int main(int argc, char *argv[])
     rsrr_init();
 #endif /* RSRR */
 
+#ifndef HAVE_EPOLL
     sa.sa_handler = handler;
     sa.sa_flags = 0;	/* Interrupt system calls */
     sigemptyset(&sa.sa_mask);
@@ -494,6 +653,7 @@ int main(int argc, char *argv[])
 	if (ihandlers[i].fd >= nfds)
 	    nfds = ihandlers[i].fd + 1;
     }
+#endif /* HAVE_EPOLL */
 
     IF_DEBUG(DEBUG_IF)
 	dump_vifs(stderr);
@@ -530,6 +690,10 @@ int main(int argc, char *argv[])
 #endif /* SYSV */
     } /* End of child process code */
 
+#ifdef HAVE_EPOLL
+    event_signals();
+#endif /* HAVE_EPOLL */
+
     if (pidfile(NULL)) {
 	warn("Cannot create pidfile");
     }
@@ -538,20 +702,7 @@ int main(int argc, char *argv[])
      * Main receive loop.
      */
     dummysigalrm = SIGALRM;
-    difftime.tv_usec = 0;
-    gettimeofday(&curtime, NULL);
-    lasttime = curtime;
     while (1) {
-	memcpy(&rfds, &readers, sizeof(rfds));
-	secs = timer_nextTimer();
-	if (secs == -1)
-	    timeout = NULL;
-	else {
-	    timeout = &tv;
-	    timeout->tv_sec = secs;
-	   timeout->tv_usec = 0;
-        }
-
         if (boottime) {
            time_t n;
 
@@ -578,6 +729,7 @@ int main(int argc, char *argv[])
 		sighandled &= ~GOT_SIGHUP;
 		restart(SIGHUP);
 
+#ifndef HAVE_EPOLL
 		/* reconstruct readers and nfds */
 		FD_ZERO(&readers);
 		FD_SET(igmp_socket, &readers);
@@ -587,7 +739,7 @@ int main(int argc, char *argv[])
 		    if (ihandlers[i].fd >= nfds)
 			nfds = ihandlers[i].fd + 1;
 		}
-		memcpy(&rfds, &readers, sizeof(rfds));
+#endif /* HAVE_EPOLL */
 	    }
 	    if (sighandled & GOT_SIGUSR1) {
 		sighandled &= ~GOT_SIGUSR1;
@@ -602,60 +754,52 @@ int main(int argc, char *argv[])
 		timer(&dummysigalrm);
 	    }
 	}
+
+	/* Program the kernel with the MFC changes of the last round */
+	k_flush_mfc();
+
+#ifdef HAVE_EPOLL
+	event_wait();
+#else
+	memcpy(&rfds, &readers, sizeof(rfds));
+	msecs = timer_nextTimer();
+	if (igmp_backlog_pending())
+	    msecs = 0;
+	if (msecs == -1)
+	    timeout = NULL;
+	else {
+	    timeout = &tv;
+	    timeout->tv_sec = msecs / 1000;
+	    timeout->tv_usec = (msecs % 1000) * 1000;
+        }
+
 	if ((n = select(nfds, &rfds, NULL, NULL, timeout)) < 0) {
 	    if (errno != EINTR) /* SIGALRM is expected */
 		logit(LOG_WARNING, errno, "select failed");
 	    continue;
 	}
 	if (n > 0) {
-	    /* TODO: shall check first igmp_socket for better performance? */
+	    /* The IGMP socket first, it carries the kernel upcalls */
 	    for (i = 0; i < nhandlers; i++) {
-		if (FD_ISSET(ihandlers[i].fd, &rfds)) {
+		if (ihandlers[i].fd == igmp_socket && FD_ISSET(ihandlers[i].fd, &rfds))
+		    (*ihandlers[i].func)(ihandlers[i].fd, &rfds);
+	    }
+	    for (i = 0; i < nhandlers; i++) {
+		if (ihandlers[i].fd != igmp_socket && FD_ISSET(ihandlers[i].fd, &rfds))
 		    (*ihandlers[i].func)(ihandlers[i].fd, &rfds);
-		}
 	    }
 	}
+#endif /* HAVE_EPOLL */
+
+	/* IGMP packets deferred behind the kernel upcalls */
+	igmp_run_backlog();
 
 	/*
-	 * Handle timeout queue.
-	 *
-	 * If select + packet processing took more than 1 second,
-	 * or if there is a timeout pending, age the timeout queue.
-	 *
-	 * If not, collect usec in difftime to make sure that the
-	 * time doesn't drift too badly.
-	 *
-	 * If the timeout handlers took more than 1 second,
-	 * age the timeout queue again.  XXX This introduces the
-	 * potential for infinite loops!
+	 * Handle timeout queue.  The callout queue keeps track of the
+	 * monotonic clock itself, so there is no need to account for the
+	 * time spent waiting or in the packet handlers here.
 	 */
-	do {
-	    /*
-	     * If the select timed out, then there's no other
-	     * activity to account for and we don't need to
-	     * call gettimeofday.
-	     */
-	    if (n == 0) {
-		curtime.tv_sec = lasttime.tv_sec + secs;
-		curtime.tv_usec = lasttime.tv_usec;
-		n = -1;	/* don't do this next time through the loop */
-	    } else
-		gettimeofday(&curtime, NULL);
-	    difftime.tv_sec = curtime.tv_sec - lasttime.tv_sec;
-	    difftime.tv_usec += curtime.tv_usec - lasttime.tv_usec;
-	    while (difftime.tv_usec >= 1000000) {
-		difftime.tv_sec++;
-		difftime.tv_usec -= 1000000;
-	    }
-	    if (difftime.tv_usec < 0) {
-		difftime.tv_sec--;
-		difftime.tv_usec += 1000000;
-	    }
-	    lasttime = curtime;
-	    if (secs == 0 || difftime.tv_sec > 0)
-		age_callout_queue(difftime.tv_sec);
-	    secs = -1;
-	} while (difftime.tv_sec > 0);
+	age_callout_queue();
     } /* Main loop */
 
     logit(LOG_NOTICE, 0, "%s exiting", versionstring);
@@ -689,9 +833,11 @@ u_long virtual_time = 0;
  */
 static void timer(void *i __attribute__((unused)))
 {
+    pim_txq_start();	/* Batch the periodic PIM messages	*/
     age_vifs();	        /* Timeout neighbors and groups         */
     age_routes();  	/* Timeout routing entries              */
     age_misc();         /* Timeout the rest (Cand-RP list, etc) */
+    pim_txq_flush();
 
     virtual_time += TIMER_INTERVAL;
     timer_setTimer(TIMER_INTERVAL, timer, NULL);
@@ -774,6 +920,7 @@ static void restart(int i __attribute__((unused)))
        free_all_routes();
        */
     free_all_callouts();
+    init_jp_txq();
     stop_all_vifs();
     k_stop_pim(igmp_socket);
     nhandlers = 0;
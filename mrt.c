@@ -37,29 +37,53 @@
 
 srcentry_t		*srclist;
 grpentry_t		*grplist;
+hash_table_t		srchash;	/* Index of srclist, by source address */
+hash_table_t		grphash;	/* Index of grplist, by group address */
+hash_table_t		sghash;		/* Index of all (S,G) routing entries */
+hash_table_t		kchash;		/* Index of all kernel cache mirrors */
+
+/* Slab allocators for the routing table entries */
+static pool_t		srcentry_pool;
+static pool_t		grpentry_pool;
+static pool_t		kernel_cache_pool;
+static pool_t		*mrtentry_pool;		/* For the current number of vifs */
+static u_int8		mrtentry_pool_vifs;
 
 /*
  * Local functions definition
  */
 static srcentry_t *create_srcentry  (u_int32 source);
 static int        search_srclist    (u_int32 source, srcentry_t **sourceEntry);
-static int        search_srcmrtlink (srcentry_t *srcentry_ptr, u_int32 group, mrtentry_t **mrtPtr);
-static void       insert_srcmrtlink (mrtentry_t *elementPtr, mrtentry_t *insertPtr, srcentry_t *srcListPtr);
+static void       insert_srcmrtlink (mrtentry_t *elementPtr, srcentry_t *srcListPtr);
 static grpentry_t *create_grpentry  (u_int32 group);
 static int        search_grplist    (u_int32 group, grpentry_t **groupEntry);
-static int        search_grpmrtlink (grpentry_t *grpentry_ptr, u_int32 source, mrtentry_t **mrtPtr);
-static void       insert_grpmrtlink (mrtentry_t *elementPtr, mrtentry_t *insertPtr, grpentry_t *grpListPtr);
+static void       insert_grpmrtlink (mrtentry_t *elementPtr, grpentry_t *grpListPtr);
+static pool_t     *get_mrtentry_pool(u_int8 vif_numbers);
 static mrtentry_t *alloc_mrtentry   (srcentry_t *srcentry_ptr, grpentry_t *grpentry_ptr);
 static mrtentry_t *create_mrtentry  (srcentry_t *srcentry_ptr, grpentry_t *grpentry_ptr, u_int16 flags);
+static void       link_kernel_cache (mrtentry_t *mrtentry_ptr, kernel_cache_t *kernel_cache_ptr);
+static void       unlink_kernel_cache(kernel_cache_t *kernel_cache_ptr);
+static void       free_kernel_cache (kernel_cache_t *kernel_cache_ptr);
 static void       move_kernel_cache (mrtentry_t *mrtentry_ptr, u_int16 flags);
 
 void init_pim_mrt(void)
 {
     /* TODO: delete any existing routing table */
 
+    /* The pools are kept across restarts, the RP-set may still use them */
+    if (!srcentry_pool.size) {
+	pool_init(&srcentry_pool, "srcentry", sizeof(srcentry_t));
+	pool_init(&grpentry_pool, "grpentry", sizeof(grpentry_t));
+	pool_init(&kernel_cache_pool, "kernel_cache", sizeof(kernel_cache_t));
+
+	/* Same for the kernel cache mirrors of the (*,*,RP) entries */
+	hash_init(&kchash, "Kernel cache", HASH_DEFAULT_SIZE);
+    }
+    init_neg_mfc();
+
     /* Initialize the source list */
     /* The first entry has address 'INADDR_ANY' and is not used */
-    /* The order is the smallest address first. */
+    /* The list is not ordered, lookups go through srchash instead. */
     srclist             = (srcentry_t *)calloc(1, sizeof(srcentry_t));
     if (!srclist)
 	logit(LOG_ERR, 0, "Ran out of memory in init_pim_mrt()");
@@ -76,7 +100,7 @@ void init_pim_mrt(void)
 
     /* Initialize the group list */
     /* The first entry has address 'INADDR_ANY' and is not used */
-    /* The order is the smallest address first. */
+    /* The list is not ordered, lookups go through grphash instead. */
     grplist             = (grpentry_t *)calloc(1, sizeof(grpentry_t));
     if (!grplist)
 	logit(LOG_ERR, 0, "Ran out of memory in init_pim_mrt()");
@@ -89,6 +113,13 @@ void init_pim_mrt(void)
     grplist->mrtlink    = NULL;
     grplist->active_rp_grp = NULL;
     grplist->grp_route   = NULL;
+
+    hash_free(&srchash);
+    hash_init(&srchash, "Source", HASH_DEFAULT_SIZE);
+    hash_free(&grphash);
+    hash_init(&grphash, "Group", HASH_DEFAULT_SIZE);
+    hash_free(&sghash);
+    hash_init(&sghash, "(S,G)", HASH_DEFAULT_SIZE);
 }
 
 
@@ -145,6 +176,13 @@ mrtentry_t *find_route(u_int32 source, u_int32 group, u_int16 flags, char create
 
     if (create == DONT_CREATE) {
         if (flags & (MRTF_SG | MRTF_WC)) {
+            /* Search for the exact (S,G) entry first */
+            if (flags & MRTF_SG) {
+                mrtentry_ptr = (mrtentry_t *)hash_find(&sghash, source, group);
+                if (mrtentry_ptr)
+                    return mrtentry_ptr;
+            }
+
             if (search_grplist(group, &grpentry_ptr) == FALSE) {
                 /* Group not found. Return the (*,*,RP) entry */
                 if (flags & MRTF_PMBR) {
@@ -156,14 +194,6 @@ mrtentry_t *find_route(u_int32 source, u_int32 group, u_int16 flags, char create
                 return NULL;
             }
 
-            /* Search for the source */
-            if (flags & MRTF_SG) {
-                if (search_grpmrtlink(grpentry_ptr, source, &mrtentry_ptr) == TRUE) {
-                    /* Exact (S,G) entry found */
-                    return mrtentry_ptr;
-                }
-            }
-
             /* No (S,G) entry. Return the (*,G) entry (if exist) */
             if ((flags & MRTF_WC) && grpentry_ptr->grp_route)
                 return grpentry_ptr->grp_route;
@@ -358,12 +388,14 @@ void delete_srcentry(srcentry_t *srcentry_ptr)
     srcentry_ptr->prev->next =  srcentry_ptr->next;
     if (srcentry_ptr->next)
         srcentry_ptr->next->prev = srcentry_ptr->prev;
+    hash_remove(&srchash, &srcentry_ptr->hash);
 
     for (ptr = srcentry_ptr->mrtlink; ptr; ptr = next) {
         next = ptr->srcnext;
         if (ptr->flags & MRTF_KERNEL_CACHE)
             /* Delete the kernel cache first */
             delete_mrtentry_all_kernel_cache(ptr);
+        hash_remove(&sghash, &ptr->hash);
 
         if (ptr->grpprev) {
             ptr->grpprev->grpnext = ptr->grpnext;
@@ -381,7 +413,7 @@ void delete_srcentry(srcentry_t *srcentry_ptr)
         FREE_MRTENTRY(ptr);
     }
 
-    free((char *)srcentry_ptr);
+    pool_free(&srcentry_pool, srcentry_ptr);
 }
 
 
@@ -397,6 +429,7 @@ void delete_grpentry(grpentry_t *grpentry_ptr)
     grpentry_ptr->prev->next = grpentry_ptr->next;
     if (grpentry_ptr->next)
         grpentry_ptr->next->prev = grpentry_ptr->prev;
+    hash_remove(&grphash, &grpentry_ptr->hash);
 
     if (grpentry_ptr->grp_route) {
         if (grpentry_ptr->grp_route->flags & MRTF_KERNEL_CACHE)
@@ -420,6 +453,7 @@ void delete_grpentry(grpentry_t *grpentry_ptr)
         if (ptr->flags & MRTF_KERNEL_CACHE)
             /* Delete the kernel cache first */
             delete_mrtentry_all_kernel_cache(ptr);
+        hash_remove(&sghash, &ptr->hash);
 
         if (ptr->srcprev) {
             ptr->srcprev->srcnext = ptr->srcnext;
@@ -437,7 +471,7 @@ void delete_grpentry(grpentry_t *grpentry_ptr)
         FREE_MRTENTRY(ptr);
     }
 
-    free((char *)grpentry_ptr);
+    pool_free(&grpentry_pool, grpentry_ptr);
 }
 
 
@@ -464,6 +498,7 @@ void delete_mrtentry(mrtentry_t *mrtentry_ptr)
         mrtentry_ptr->source->mrtlink = NULL;
     } else if (mrtentry_ptr->flags & MRTF_SG) {
         /* (S,G) mrtentry */
+        hash_remove(&sghash, &mrtentry_ptr->hash);
 
         /* Delete from the grpentry MRT chain */
         if (mrtentry_ptr->grpprev != NULL) {
@@ -519,48 +554,41 @@ void delete_mrtentry(mrtentry_t *mrtentry_ptr)
 }
 
 
+/*
+ * The srclist is not ordered, hence if the source is not found the
+ * insertion point returned in *sourceEntry is always the first (unused)
+ * entry, i.e., new sources are added at the head of the list.
+ */
 static int search_srclist(u_int32 source, srcentry_t **sourceEntry)
 {
-    srcentry_t *s_prev,*s;
-    u_int32 source_h = ntohl(source);
-
-    for (s_prev = srclist, s = s_prev->next; s != NULL; s_prev = s, s = s->next) {
-        /* The srclist is ordered with the smallest addresses first.
-         * The first entry is not used.
-         */
-        if (ntohl(s->address) < source_h)
-            continue;
+    srcentry_t *s;
 
-        if (s->address == source) {
-            *sourceEntry = s;
-            return TRUE;
-        }
-        break;
+    s = (srcentry_t *)hash_find(&srchash, source, INADDR_ANY_N);
+    if (s) {
+        *sourceEntry = s;
+        return TRUE;
     }
-    *sourceEntry = s_prev;   /* The insertion point is between s_prev and s */
+    *sourceEntry = srclist;
 
     return FALSE;
 }
 
 
+/*
+ * The grplist is not ordered, hence if the group is not found the
+ * insertion point returned in *groupEntry is always the first (unused)
+ * entry, i.e., new groups are added at the head of the list.
+ */
 static int search_grplist(u_int32 group, grpentry_t **groupEntry)
 {
-    grpentry_t *g_prev, *g;
-    u_int32 group_h = ntohl(group);
+    grpentry_t *g;
 
-    for (g_prev = grplist, g = g_prev->next; g != NULL; g_prev = g, g = g->next) {
-        /* The grplist is ordered with the smallest address first.
-         * The first entry is not used.
-         */
-        if (ntohl(g->group) < group_h)
-            continue;
-        if (g->group == group) {
-            *groupEntry = g;
-            return TRUE;
-        }
-        break;
+    g = (grpentry_t *)hash_find(&grphash, group, INADDR_ANY_N);
+    if (g) {
+        *groupEntry = g;
+        return TRUE;
     }
-    *groupEntry = g_prev;    /* The insertion point is between g_prev and g */
+    *groupEntry = grplist;
 
     return FALSE;
 }
@@ -574,7 +602,7 @@ static srcentry_t *create_srcentry(u_int32 source)
     if (search_srclist(source, &srcentry_prev) == TRUE)
         return srcentry_prev;
 
-    srcentry_ptr = (srcentry_t *)calloc(1, sizeof(srcentry_t));
+    srcentry_ptr = (srcentry_t *)pool_alloc(&srcentry_pool);
     if (!srcentry_ptr) {
         logit(LOG_WARNING, 0, "Memory allocation error for srcentry %s",
 	      inet_fmt(source, s1, sizeof(s1)));
@@ -587,7 +615,7 @@ static srcentry_t *create_srcentry(u_int32 source)
      * the next hop (upstream) router.
      */
     if (set_incoming(srcentry_ptr, PIM_IIF_SOURCE) == FALSE) {
-        free((char *)srcentry_ptr);
+        pool_free(&srcentry_pool, srcentry_ptr);
         return NULL;
     }
 
@@ -599,6 +627,7 @@ static srcentry_t *create_srcentry(u_int32 source)
     srcentry_ptr->prev    = srcentry_prev;
     if (srcentry_ptr->next)
         srcentry_ptr->next->prev = srcentry_ptr;
+    hash_insert(&srchash, &srcentry_ptr->hash, source, INADDR_ANY_N, srcentry_ptr);
 
     IF_DEBUG(DEBUG_MFC) {
         logit(LOG_DEBUG, 0, "create source entry, source %s",
@@ -619,7 +648,7 @@ static grpentry_t *create_grpentry(u_int32 group)
     if (search_grplist(group, &grpentry_prev) == TRUE)
         return grpentry_prev;
 
-    grpentry_ptr = (grpentry_t *)calloc(1, sizeof(grpentry_t));
+    grpentry_ptr = (grpentry_t *)pool_alloc(&grpentry_pool);
     if (!grpentry_ptr) {
         logit(LOG_WARNING, 0, "Memory allocation error for grpentry %s",
 	      inet_fmt(group, s1, sizeof(s1)));
@@ -646,6 +675,7 @@ static grpentry_t *create_grpentry(u_int32 group)
     grpentry_ptr->prev          = grpentry_prev;
     if (grpentry_ptr->next)
         grpentry_ptr->next->prev = grpentry_ptr;
+    hash_insert(&grphash, &grpentry_ptr->hash, group, INADDR_ANY_N, grpentry_ptr);
 
     IF_DEBUG(DEBUG_MFC) {
         logit(LOG_DEBUG, 0, "create group entry, group %s", inet_fmt(group, s1, sizeof(s1)));
@@ -656,122 +686,83 @@ static grpentry_t *create_grpentry(u_int32 group)
 
 
 /*
- * Return TRUE if the entry is found and then *mrtPtr is set to point to that
- * entry. Otherwise return FALSE and *mrtPtr points the previous entry
- * (or NULL if first in the chain.
+ * The mrtlink chains are not ordered, the (S,G) lookups go through
+ * sghash, hence a new entry is simply placed at the head of the chains.
  */
-static int search_srcmrtlink(srcentry_t *srcentry_ptr, u_int32 group, mrtentry_t **mrtPtr)
+static void insert_srcmrtlink(mrtentry_t *mrtentry_new, srcentry_t *srcentry_ptr)
 {
-    mrtentry_t *mrtentry_ptr;
-    mrtentry_t *m_prev = NULL;
-    u_int32 group_h = ntohl(group);
-
-    for (mrtentry_ptr = srcentry_ptr->mrtlink;
-	 mrtentry_ptr != NULL;
-	 m_prev = mrtentry_ptr, mrtentry_ptr = mrtentry_ptr->srcnext) {
-        /* The entries are ordered with the smaller group address first.
-         * The addresses are in network order.
-         */
-        if (ntohl(mrtentry_ptr->group->group) < group_h)
-            continue;
-
-        if (mrtentry_ptr->group->group == group) {
-            *mrtPtr = mrtentry_ptr;
-            return TRUE;
-        }
+    mrtentry_new->srcnext = srcentry_ptr->mrtlink;
+    mrtentry_new->srcprev = NULL;
+    srcentry_ptr->mrtlink = mrtentry_new;
 
-        break;
-    }
-
-    *mrtPtr = m_prev;
-
-    return FALSE;
+    if (mrtentry_new->srcnext != NULL)
+        mrtentry_new->srcnext->srcprev = mrtentry_new;
 }
 
 
-/*
- * Return TRUE if the entry is found and then *mrtPtr is set to point to that
- * entry. Otherwise return FALSE and *mrtPtr points the previous entry
- * (or NULL if first in the chain.
- */
-static int search_grpmrtlink(grpentry_t *grpentry_ptr, u_int32 source, mrtentry_t **mrtPtr)
+static void insert_grpmrtlink(mrtentry_t *mrtentry_new, grpentry_t *grpentry_ptr)
 {
-    mrtentry_t *mrtentry_ptr;
-    mrtentry_t *m_prev = NULL;
-    u_int32 source_h = ntohl(source);
-
-    for (mrtentry_ptr = grpentry_ptr->mrtlink;
-         mrtentry_ptr != NULL;
-         m_prev = mrtentry_ptr, mrtentry_ptr = mrtentry_ptr->grpnext) {
-        /* The entries are ordered with the smaller source address first.
-         * The addresses are in network order.
-         */
-        if (ntohl(mrtentry_ptr->source->address) < source_h)
-            continue;
-
-        if (source == mrtentry_ptr->source->address) {
-            *mrtPtr = mrtentry_ptr;
-            return TRUE;
-        }
-
-        break;
-    }
-
-    *mrtPtr = m_prev;
+    mrtentry_new->grpnext = grpentry_ptr->mrtlink;
+    mrtentry_new->grpprev = NULL;
+    grpentry_ptr->mrtlink = mrtentry_new;
 
-    return FALSE;
+    if (mrtentry_new->grpnext != NULL)
+        mrtentry_new->grpnext->grpprev = mrtentry_new;
 }
 
 
-static void insert_srcmrtlink(mrtentry_t *mrtentry_new, mrtentry_t *mrtentry_prev, srcentry_t *srcentry_ptr)
+/*
+ * The vif_timers and vif_deletion_delay arrays are placed inline, right
+ * after the mrtentry_t, hence the pool object size depends on the number
+ * of vifs.  The number is fixed once the vifs are configured, but may
+ * change when the configuration is reloaded.  In that case a new pool is
+ * created, and the old entries are returned to the pool they came from.
+ */
+static pool_t *get_mrtentry_pool(u_int8 vif_numbers)
 {
-    if (mrtentry_prev == NULL) {
-        /* Has to be insert as the head entry for this source */
-        mrtentry_new->srcnext = srcentry_ptr->mrtlink;
-        mrtentry_new->srcprev = NULL;
-        srcentry_ptr->mrtlink = mrtentry_new;
-    } else {
-        /* Insert right after the mrtentry_prev */
-        mrtentry_new->srcnext = mrtentry_prev->srcnext;
-        mrtentry_new->srcprev = mrtentry_prev;
-        mrtentry_prev->srcnext = mrtentry_new;
-    }
-
-    if (mrtentry_new->srcnext != NULL)
-        mrtentry_new->srcnext->srcprev = mrtentry_new;
-}
+    if (mrtentry_pool && mrtentry_pool_vifs == vif_numbers)
+	return mrtentry_pool;
 
+    mrtentry_pool = (pool_t *)calloc(1, sizeof(pool_t));
+    if (!mrtentry_pool)
+	logit(LOG_ERR, 0, "Ran out of memory in get_mrtentry_pool()");
+    pool_init(mrtentry_pool, "mrtentry",
+	      sizeof(mrtentry_t) + vif_numbers * (sizeof(u_int32) + sizeof(u_int16)));
+    mrtentry_pool_vifs = vif_numbers;
 
-static void insert_grpmrtlink(mrtentry_t *mrtentry_new, mrtentry_t *mrtentry_prev, grpentry_t *grpentry_ptr)
-{
-    if (mrtentry_prev == NULL) {
-        /* Has to be insert as the head entry for this group */
-        mrtentry_new->grpnext = grpentry_ptr->mrtlink;
-        mrtentry_new->grpprev = NULL;
-        grpentry_ptr->mrtlink = mrtentry_new;
-    } else {
-        /* Insert right after the mrtentry_prev */
-        mrtentry_new->grpnext = mrtentry_prev->grpnext;
-        mrtentry_new->grpprev = mrtentry_prev;
-        mrtentry_prev->grpnext = mrtentry_new;
-    }
-
-    if (mrtentry_new->grpnext != NULL)
-        mrtentry_new->grpnext->grpprev = mrtentry_new;
+    return mrtentry_pool;
 }
 
 
 static mrtentry_t *alloc_mrtentry(srcentry_t *srcentry_ptr, grpentry_t *grpentry_ptr)
 {
     mrtentry_t *mrtentry_ptr;
-    u_int16 i, *i_ptr;
+    pool_t *pool;
+    u_int16 i;
     u_int8  vif_numbers;
 
-    mrtentry_ptr = (mrtentry_t *)calloc(1, sizeof(mrtentry_t));
+    /* XXX: TODO: if we are short in memory, we can reserve as few as possible
+     * space for vif timers (per group and/or routing entry), but then everytime
+     * when a new interfaces is configured, the router will be restarted and
+     * will delete the whole routing table. The "memory is cheap" solution is
+     * to reserve timer space for all potential vifs in advance and then no
+     * need to delete the routing table and disturb the forwarding.
+     */
+#ifdef SAVE_MEMORY
+    vif_numbers = numvifs;
+#else
+    vif_numbers = total_interfaces;
+#endif /* SAVE_MEMORY */
+
+    pool = get_mrtentry_pool(vif_numbers);
+    mrtentry_ptr = (mrtentry_t *)pool_alloc(pool);
     if (mrtentry_ptr == NULL) {
         logit(LOG_WARNING, 0, "alloc_mrtentry(): out of memory");
         return NULL;
     }
+    mrtentry_ptr->pool = pool;
+    mrtentry_ptr->vif_timers = (u_int32 *)(mrtentry_ptr + 1);
+    mrtentry_ptr->vif_deletion_delay = (u_int16 *)(mrtentry_ptr->vif_timers + vif_numbers);
 
     /*
      * grpnext, grpprev, srcnext, srcprev will be setup when we link the
@@ -793,35 +784,10 @@ static mrtentry_t *alloc_mrtentry(srcentry_t *srcentry_ptr, grpentry_t *grpentry
     mrtentry_ptr->rsrr_cache = NULL;
 #endif /* RSRR */
 
-    /* XXX: TODO: if we are short in memory, we can reserve as few as possible
-     * space for vif timers (per group and/or routing entry), but then everytime
-     * when a new interfaces is configured, the router will be restarted and
-     * will delete the whole routing table. The "memory is cheap" solution is
-     * to reserve timer space for all potential vifs in advance and then no
-     * need to delete the routing table and disturb the forwarding.
-     */
-#ifdef SAVE_MEMORY
-    mrtentry_ptr->vif_timers = (u_int16 *)calloc(1, sizeof(u_int16) * numvifs);
-    mrtentry_ptr->vif_deletion_delay = (u_int16 *)calloc(1, sizeof(u_int16) * numvifs);
-    vif_numbers = numvifs;
-#else
-    mrtentry_ptr->vif_timers = (u_int16 *)calloc(1, sizeof(u_int16) * total_interfaces);
-    mrtentry_ptr->vif_deletion_delay = (u_int16 *)calloc(1, sizeof(u_int16) * total_interfaces);
-    vif_numbers = total_interfaces;
-#endif /* SAVE_MEMORY */
-    if ((mrtentry_ptr->vif_timers == NULL) ||
-        (mrtentry_ptr->vif_deletion_delay == NULL)) {
-        logit(LOG_WARNING, 0, "alloc_mrtentry(): out of memory");
-        FREE_MRTENTRY(mrtentry_ptr);
-        return NULL;
-    }
-
     /* Reset the timers */
-    for (i = 0, i_ptr = mrtentry_ptr->vif_timers; i < vif_numbers; i++, i_ptr++) {
-        RESET_TIMER(*i_ptr);
-    }
-    for (i = 0, i_ptr = mrtentry_ptr->vif_deletion_delay; i < vif_numbers; i++, i_ptr++) {
-        RESET_TIMER(*i_ptr);
+    for (i = 0; i < vif_numbers; i++) {
+        RESET_TIMER(mrtentry_ptr->vif_timers[i]);
+        RESET_TIMER(mrtentry_ptr->vif_deletion_delay[i]);
     }
 
     mrtentry_ptr->flags = MRTF_NEW;
@@ -830,16 +796,43 @@ static mrtentry_t *alloc_mrtentry(srcentry_t *srcentry_ptr, grpentry_t *grpentry
     RESET_TIMER(mrtentry_ptr->rs_timer);
     RESET_TIMER(mrtentry_ptr->assert_timer);
     RESET_TIMER(mrtentry_ptr->assert_rate_timer);
+    mrtentry_ptr->jp_ms_due = 0;
+    mrtentry_ptr->assert_ms_due = 0;
+    mrtentry_ptr->msnext = (mrtentry_t *)NULL;
+    mrtentry_ptr->msprev = (mrtentry_t **)NULL;
     mrtentry_ptr->kernel_cache = NULL;
 
+    /* All timers are expired, age the entry on the next timer interval */
+    schedule_mrtentry(mrtentry_ptr, 0);
+
     return mrtentry_ptr;
 }
 
 
+/*
+ * Free the entry and any remaining kernel cache entries.  The entry must
+ * already be unlinked from the routing table.
+ */
+void free_mrtentry(mrtentry_t *mrtentry_ptr)
+{
+    kernel_cache_t *prev;
+    kernel_cache_t *next;
+
+    for (next = mrtentry_ptr->kernel_cache; next != NULL; ) {
+        prev = next;
+        next = next->next;
+        free_kernel_cache(prev);
+    }
+
+    unlink_mrt_ms(mrtentry_ptr);
+    unschedule_mrtentry(mrtentry_ptr);
+    pool_free(mrtentry_ptr->pool, mrtentry_ptr);
+}
+
+
 static mrtentry_t *create_mrtentry(srcentry_t *srcentry_ptr, grpentry_t *grpentry_ptr, u_int16 flags)
 {
     mrtentry_t *r_new;
-    mrtentry_t *r_grp_insert, *r_src_insert; /* pointers to insert */
     u_int32 source;
     u_int32 group;
 
@@ -848,33 +841,22 @@ static mrtentry_t *create_mrtentry(srcentry_t *srcentry_ptr, grpentry_t *grpentr
         source = srcentry_ptr->address;
         group  = grpentry_ptr->group;
 
-        if (search_grpmrtlink(grpentry_ptr, source, &r_grp_insert) == TRUE) {
-            return r_grp_insert;
-        }
-        if (search_srcmrtlink(srcentry_ptr, group, &r_src_insert) == TRUE) {
-            /*
-             * Hmmm, search_grpmrtlink() didn't find the entry, but
-             * search_srcmrtlink() did find it! Shoudn't happen. Panic!
-             */
-            logit(LOG_ERR, 0, "MRT inconsistency for src %s and grp %s\n",
-		  inet_fmt(source, s1, sizeof(s1)), inet_fmt(group, s2, sizeof(s2)));
-            /* not reached but to make lint happy */
-            return NULL;
-        }
+        r_new = (mrtentry_t *)hash_find(&sghash, source, group);
+        if (r_new != NULL)
+            return r_new;
+
         /*
          * Create and insert in group mrtlink and source mrtlink chains.
          */
         r_new = alloc_mrtentry(srcentry_ptr, grpentry_ptr);
         if (r_new == NULL)
             return NULL;
-        /*
-         * r_new has to be insert right after r_grp_insert in the
-         * grp mrtlink chain and right after r_src_insert in the
-         * src mrtlink chain
-         */
-        insert_grpmrtlink(r_new, r_grp_insert, grpentry_ptr);
-        insert_srcmrtlink(r_new, r_src_insert, srcentry_ptr);
+        insert_grpmrtlink(r_new, grpentry_ptr);
+        insert_srcmrtlink(r_new, srcentry_ptr);
+        hash_insert(&sghash, &r_new->hash, source, group, r_new);
         r_new->flags |= MRTF_SG;
+        /* Traffic the kernel was told to drop has a route now */
+        neg_mfc_clear(source, group);
         return r_new;
     }
 
@@ -887,6 +869,7 @@ static mrtentry_t *create_mrtentry(srcentry_t *srcentry_ptr, grpentry_t *grpentr
             return NULL;
         grpentry_ptr->grp_route = r_new;
         r_new->flags |= (MRTF_WC | MRTF_RP);
+        neg_mfc_clear(INADDR_ANY_N, grpentry_ptr->group);
         return r_new;
     }
 
@@ -899,6 +882,7 @@ static mrtentry_t *create_mrtentry(srcentry_t *srcentry_ptr, grpentry_t *grpentr
             return NULL;
         srcentry_ptr->mrtlink = r_new;
         r_new->flags |= (MRTF_PMBR | MRTF_RP);
+        neg_mfc_clear(INADDR_ANY_N, INADDR_ANY_N);
         return r_new;
     }
 
@@ -906,6 +890,52 @@ static mrtentry_t *create_mrtentry(srcentry_t *srcentry_ptr, grpentry_t *grpentr
 }
 
 
+/*
+ * The kernel cache mirrors of an entry are kept on a doubly linked list,
+ * in no particular order.  Every mirror is also indexed by its (source,
+ * group) pair in kchash, hence finding, adding, deleting, or moving a
+ * mirror between its owning entries never walks the list.
+ */
+static void link_kernel_cache(mrtentry_t *mrtentry_ptr, kernel_cache_t *kernel_cache_ptr)
+{
+    kernel_cache_ptr->owner = mrtentry_ptr;
+    kernel_cache_ptr->prev  = NULL;
+    kernel_cache_ptr->next  = mrtentry_ptr->kernel_cache;
+    if (mrtentry_ptr->kernel_cache != NULL)
+        mrtentry_ptr->kernel_cache->prev = kernel_cache_ptr;
+    mrtentry_ptr->kernel_cache = kernel_cache_ptr;
+    mrtentry_ptr->flags |= MRTF_KERNEL_CACHE;
+}
+
+
+static void unlink_kernel_cache(kernel_cache_t *kernel_cache_ptr)
+{
+    mrtentry_t *mrtentry_ptr = kernel_cache_ptr->owner;
+
+    if (kernel_cache_ptr->prev == NULL) {
+        mrtentry_ptr->kernel_cache = kernel_cache_ptr->next;
+        if (mrtentry_ptr->kernel_cache == NULL)
+            mrtentry_ptr->flags &= ~(MRTF_KERNEL_CACHE | MRTF_MFC_CLONE_SG);
+    } else {
+        kernel_cache_ptr->prev->next = kernel_cache_ptr->next;
+    }
+
+    if (kernel_cache_ptr->next != NULL)
+        kernel_cache_ptr->next->prev = kernel_cache_ptr->prev;
+
+    kernel_cache_ptr->owner = NULL;
+    kernel_cache_ptr->prev  = NULL;
+    kernel_cache_ptr->next  = NULL;
+}
+
+
+static void free_kernel_cache(kernel_cache_t *kernel_cache_ptr)
+{
+    hash_remove(&kchash, &kernel_cache_ptr->hash);
+    pool_free(&kernel_cache_pool, kernel_cache_ptr);
+}
+
+
 /*
  * Delete all kernel cache for this mrtentry
  */
@@ -924,7 +954,7 @@ void delete_mrtentry_all_kernel_cache(mrtentry_t *mrtentry_ptr)
         kernel_cache_ptr         = kernel_cache_ptr->next;
         k_del_mfc(igmp_socket, kernel_cache_prev->source,
                   kernel_cache_prev->group);
-        free((char *)kernel_cache_prev);
+        free_kernel_cache(kernel_cache_prev);
     }
     mrtentry_ptr->kernel_cache = NULL;
 
@@ -933,18 +963,10 @@ void delete_mrtentry_all_kernel_cache(mrtentry_t *mrtentry_ptr)
 }
 
 
-void delete_single_kernel_cache(mrtentry_t *mrtentry_ptr, kernel_cache_t *kernel_cache_ptr)
+void delete_single_kernel_cache(mrtentry_t *mrtentry_ptr __attribute__((unused)),
+				kernel_cache_t *kernel_cache_ptr)
 {
-    if (kernel_cache_ptr->prev == NULL) {
-        mrtentry_ptr->kernel_cache = kernel_cache_ptr->next;
-        if (mrtentry_ptr->kernel_cache == NULL)
-            mrtentry_ptr->flags &= ~(MRTF_KERNEL_CACHE | MRTF_MFC_CLONE_SG);
-    } else {
-        kernel_cache_ptr->prev->next = kernel_cache_ptr->next;
-    }
-
-    if (kernel_cache_ptr->next != NULL)
-        kernel_cache_ptr->next->prev = kernel_cache_ptr->prev;
+    unlink_kernel_cache(kernel_cache_ptr);
 
     IF_DEBUG(DEBUG_MFC) {
         logit(LOG_DEBUG, 0, "Deleting MFC entry for source %s and group %s",
@@ -953,62 +975,23 @@ void delete_single_kernel_cache(mrtentry_t *mrtentry_ptr, kernel_cache_t *kernel
     }
 
     k_del_mfc(igmp_socket, kernel_cache_ptr->source, kernel_cache_ptr->group);
-    free((char *)kernel_cache_ptr);
+    free_kernel_cache(kernel_cache_ptr);
 }
 
 
 void delete_single_kernel_cache_addr(mrtentry_t *mrtentry_ptr, u_int32 source, u_int32 group)
 {
-    u_int32 source_h;
-    u_int32 group_h;
     kernel_cache_t *kernel_cache_ptr;
 
     if (mrtentry_ptr == NULL)
         return;
 
-    source_h = ntohl(source);
-    group_h  = ntohl(group);
-
     /* Find the exact (S,G) kernel_cache entry */
-    for (kernel_cache_ptr = mrtentry_ptr->kernel_cache;
-         kernel_cache_ptr != NULL;
-         kernel_cache_ptr = kernel_cache_ptr->next) {
-        if (ntohl(kernel_cache_ptr->group) < group_h)
-            continue;
-        if (ntohl(kernel_cache_ptr->group) > group_h)
-            return;	/* Not found */
-        if (ntohl(kernel_cache_ptr->source) < source_h)
-            continue;
-        if (ntohl(kernel_cache_ptr->source) > source_h)
-            return;	/* Not found */
-
-        /* Found exact match */
-        break;
-    }
-
-    if (kernel_cache_ptr == NULL)
-        return;
+    kernel_cache_ptr = (kernel_cache_t *)hash_find(&kchash, source, group);
+    if (kernel_cache_ptr == NULL || kernel_cache_ptr->owner != mrtentry_ptr)
+        return;	/* Not found */
 
-    /* Found. Delete it */
-    if (kernel_cache_ptr->prev == NULL) {
-        mrtentry_ptr->kernel_cache = kernel_cache_ptr->next;
-        if (mrtentry_ptr->kernel_cache == NULL)
-            mrtentry_ptr->flags &= ~(MRTF_KERNEL_CACHE | MRTF_MFC_CLONE_SG);
-    } else{
-        kernel_cache_ptr->prev->next = kernel_cache_ptr->next;
-    }
-
-    if (kernel_cache_ptr->next != NULL)
-        kernel_cache_ptr->next->prev = kernel_cache_ptr->prev;
-
-    IF_DEBUG(DEBUG_MFC) {
-        logit(LOG_DEBUG, 0, "Deleting MFC entry for source %s and group %s",
-	      inet_fmt(kernel_cache_ptr->source, s1, sizeof(s1)),
-	      inet_fmt(kernel_cache_ptr->group, s2, sizeof(s2)));
-    }
-
-    k_del_mfc(igmp_socket, kernel_cache_ptr->source, kernel_cache_ptr->group);
-    free((char *)kernel_cache_ptr);
+    delete_single_kernel_cache(mrtentry_ptr, kernel_cache_ptr);
 }
 
 
@@ -1018,78 +1001,40 @@ void delete_single_kernel_cache_addr(mrtentry_t *mrtentry_ptr, u_int32 source, u
  */
 void add_kernel_cache(mrtentry_t *mrtentry_ptr, u_int32 source, u_int32 group, u_int16 flags)
 {
-    u_int32 source_h;
-    u_int32 group_h;
-    kernel_cache_t *kernel_cache_next;
-    kernel_cache_t *kernel_cache_prev;
-    kernel_cache_t *kernel_cache_new;
+    kernel_cache_t *kernel_cache_ptr;
 
     if (mrtentry_ptr == NULL)
         return;
 
     move_kernel_cache(mrtentry_ptr, flags);
 
-    if (mrtentry_ptr->flags & MRTF_SG) {
-        /* (S,G) */
-        if (mrtentry_ptr->flags & MRTF_KERNEL_CACHE)
-            return;
+    if ((mrtentry_ptr->flags & MRTF_SG) && (mrtentry_ptr->flags & MRTF_KERNEL_CACHE))
+        return;
 
-        kernel_cache_new = (kernel_cache_t *)calloc(1, sizeof(kernel_cache_t));
-        kernel_cache_new->next = NULL;
-        kernel_cache_new->prev = NULL;
-        kernel_cache_new->source = source;
-        kernel_cache_new->group = group;
-        kernel_cache_new->sg_count.pktcnt = 0;
-        kernel_cache_new->sg_count.bytecnt = 0;
-        kernel_cache_new->sg_count.wrong_if = 0;
-        mrtentry_ptr->kernel_cache = kernel_cache_new;
-        mrtentry_ptr->flags |= MRTF_KERNEL_CACHE;
+    kernel_cache_ptr = (kernel_cache_t *)hash_find(&kchash, source, group);
+    if (kernel_cache_ptr != NULL) {
+        if (kernel_cache_ptr->owner == mrtentry_ptr)
+            return;	/* Found exact match. Nothing to change. */
 
+        /*
+         * There is only one MFC entry per (source, group) in the kernel,
+         * so the mirror follows the entry which installs it.
+         */
+        unlink_kernel_cache(kernel_cache_ptr);
+        link_kernel_cache(mrtentry_ptr, kernel_cache_ptr);
         return;
     }
 
-    source_h = ntohl(source);
-    group_h = ntohl(group);
-    kernel_cache_prev = NULL;
-
-    for (kernel_cache_next = mrtentry_ptr->kernel_cache;
-         kernel_cache_next != NULL;
-         kernel_cache_prev = kernel_cache_next,
-             kernel_cache_next = kernel_cache_next->next) {
-        if (ntohl(kernel_cache_next->group) < group_h)
-            continue;
-        if (ntohl(kernel_cache_next->group) > group_h)
-            break;
-        if (ntohl(kernel_cache_next->source) < source_h)
-            continue;
-        if (ntohl(kernel_cache_next->source) > source_h)
-            break;
-
-        /* Found exact match. Nothing to change. */
+    kernel_cache_ptr = (kernel_cache_t *)pool_alloc(&kernel_cache_pool);
+    if (kernel_cache_ptr == NULL)
         return;
-    }
-
-    /*
-     * The new entry must be placed between kernel_cache_prev and
-     * kernel_cache_next
-     */
-    kernel_cache_new = (kernel_cache_t *)calloc(1, sizeof(kernel_cache_t));
-    if (kernel_cache_prev != NULL)
-        kernel_cache_prev->next = kernel_cache_new;
-    else
-        mrtentry_ptr->kernel_cache = kernel_cache_new;
-
-    if (kernel_cache_next != NULL)
-        kernel_cache_next->prev = kernel_cache_new;
-
-    kernel_cache_new->prev = kernel_cache_prev;
-    kernel_cache_new->next = kernel_cache_next;
-    kernel_cache_new->source = source;
-    kernel_cache_new->group = group;
-    kernel_cache_new->sg_count.pktcnt = 0;
-    kernel_cache_new->sg_count.bytecnt = 0;
-    kernel_cache_new->sg_count.wrong_if = 0;
-    mrtentry_ptr->flags |= MRTF_KERNEL_CACHE;
+    kernel_cache_ptr->source = source;
+    kernel_cache_ptr->group = group;
+    kernel_cache_ptr->sg_count.pktcnt = 0;
+    kernel_cache_ptr->sg_count.bytecnt = 0;
+    kernel_cache_ptr->sg_count.wrong_if = 0;
+    hash_insert(&kchash, &kernel_cache_ptr->hash, source, group, kernel_cache_ptr);
+    link_kernel_cache(mrtentry_ptr, kernel_cache_ptr);
 }
 
 /*
@@ -1098,15 +1043,10 @@ void add_kernel_cache(mrtentry_t *mrtentry_ptr, u_int32 source, u_int32 group, u
 static void move_kernel_cache(mrtentry_t *mrtentry_ptr, u_int16 flags)
 {
     kernel_cache_t *kernel_cache_ptr;
-    kernel_cache_t *insert_kernel_cache_ptr;
-    kernel_cache_t *first_kernel_cache_ptr;
-    kernel_cache_t *last_kernel_cache_ptr;
-    kernel_cache_t *prev_kernel_cache_ptr;
+    kernel_cache_t *kernel_cache_next;
     mrtentry_t     *mrtentry_pmbr;
     mrtentry_t     *mrtentry_rp;
-    u_int32 group_h;
-    u_int32 source_h;
-    int found;
+    u_int32 group;
 
     if (mrtentry_ptr == NULL)
         return;
@@ -1116,101 +1056,35 @@ static void move_kernel_cache(mrtentry_t *mrtentry_ptr, u_int16 flags)
 
     if (mrtentry_ptr->flags & MRTF_WC) {
         /* Move the cache info from (*,*,RP) to (*,G) */
-        group_h = ntohl(mrtentry_ptr->group->group);
+        group = mrtentry_ptr->group->group;
         mrtentry_pmbr =
             mrtentry_ptr->group->active_rp_grp->rp->rpentry->mrtlink;
         if (mrtentry_pmbr == NULL)
             return;    /* Nothing to move */
 
-        first_kernel_cache_ptr = last_kernel_cache_ptr = NULL;
+        /*
+         * The sources of the group are not known here, so this is the
+         * only place we walk a list.  It is done only once, when the
+         * (*,G) entry gets its first kernel cache.
+         */
         for (kernel_cache_ptr = mrtentry_pmbr->kernel_cache;
              kernel_cache_ptr != NULL;
-             kernel_cache_ptr = kernel_cache_ptr->next) {
-            /*
-             * The order is: (1) smaller group;
-             *               (2) smaller source within group
-             */
-            if (ntohl(kernel_cache_ptr->group) < group_h)
+             kernel_cache_ptr = kernel_cache_next) {
+            kernel_cache_next = kernel_cache_ptr->next;
+            if (kernel_cache_ptr->group != group)
                 continue;
 
-            if (ntohl(kernel_cache_ptr->group) != group_h)
-                break;
-
-            /* Select the kernel_cache entries to move  */
-            if (first_kernel_cache_ptr == NULL) {
-                first_kernel_cache_ptr = last_kernel_cache_ptr =
-                    kernel_cache_ptr;
-            } else {
-                last_kernel_cache_ptr = kernel_cache_ptr;
-	    }
-        }
-
-        if (first_kernel_cache_ptr != NULL) {
-            /* Fix the old chain */
-            if (first_kernel_cache_ptr->prev != NULL) {
-                first_kernel_cache_ptr->prev->next =
-                    last_kernel_cache_ptr->next;
-            } else {
-                mrtentry_pmbr->kernel_cache = last_kernel_cache_ptr->next;
-	    }
-
-            if (last_kernel_cache_ptr->next != NULL)
-                last_kernel_cache_ptr->next->prev = first_kernel_cache_ptr->prev;
-
-            if (mrtentry_pmbr->kernel_cache == NULL)
-                mrtentry_pmbr->flags &= ~(MRTF_KERNEL_CACHE | MRTF_MFC_CLONE_SG);
-
-            /* Insert in the new place */
-            prev_kernel_cache_ptr = NULL;
-            last_kernel_cache_ptr->next = NULL;
-            mrtentry_ptr->flags |= MRTF_KERNEL_CACHE;
-
-            for (kernel_cache_ptr = mrtentry_ptr->kernel_cache;
-                 kernel_cache_ptr != NULL; ) {
-                if (first_kernel_cache_ptr == NULL)
-                    break;  /* All entries have been inserted */
-
-                if (ntohl(kernel_cache_ptr->source) >
-                    ntohl(first_kernel_cache_ptr->source)) {
-                    /* Insert the entry before kernel_cache_ptr */
-                    insert_kernel_cache_ptr = first_kernel_cache_ptr;
-                    first_kernel_cache_ptr = first_kernel_cache_ptr->next;
-
-                    if (kernel_cache_ptr->prev != NULL)
-                        kernel_cache_ptr->prev->next = insert_kernel_cache_ptr;
-                    else
-                        mrtentry_ptr->kernel_cache = insert_kernel_cache_ptr;
-
-                    insert_kernel_cache_ptr->prev = kernel_cache_ptr->prev;
-                    insert_kernel_cache_ptr->next = kernel_cache_ptr;
-                    kernel_cache_ptr->prev = insert_kernel_cache_ptr;
-                }
-                prev_kernel_cache_ptr = kernel_cache_ptr;
-                kernel_cache_ptr = kernel_cache_ptr->next;
-            }
-
-            if (first_kernel_cache_ptr != NULL) {
-                /* Place all at the end after prev_kernel_cache_ptr */
-                if (prev_kernel_cache_ptr != NULL)
-                    prev_kernel_cache_ptr->next = first_kernel_cache_ptr;
-                else
-                    mrtentry_ptr->kernel_cache = first_kernel_cache_ptr;
-
-                first_kernel_cache_ptr->prev = prev_kernel_cache_ptr;
-            }
+            unlink_kernel_cache(kernel_cache_ptr);
+            link_kernel_cache(mrtentry_ptr, kernel_cache_ptr);
         }
 
         return;
     }
 
     if (mrtentry_ptr->flags & MRTF_SG) {
-        /* (S,G) entry. Move the whole group cache from (*,*,RP) to (*,G) and
-         * then get the necessary entry from (*,G).
-         * TODO: Not optimized! The particular entry is moved first to (*,G),
-         * then we have to search again (*,G) to find it and move to (S,G).
+        /* (S,G) entry. Move the entry from (*,G), or from (*,*,RP)
+         * if there is no (*,G).
          */
-        /* TODO: XXX: No need for this? Thinking.... */
-/*	move_kernel_cache(mrtentry_ptr->group->grp_route, flags); */
         if ((mrtentry_rp = mrtentry_ptr->group->grp_route) == NULL)
             mrtentry_rp = mrtentry_ptr->group->active_rp_grp->rp->rpentry->mrtlink;
 
@@ -1232,51 +1106,14 @@ static void move_kernel_cache(mrtentry_t *mrtentry_ptr, u_int16 flags)
         }
 
         /* Find the exact entry */
-        source_h = ntohl(mrtentry_ptr->source->address);
-        group_h  = ntohl(mrtentry_ptr->group->group);
-        found = FALSE;
-        for (kernel_cache_ptr = mrtentry_rp->kernel_cache;
-             kernel_cache_ptr != NULL;
-             kernel_cache_ptr = kernel_cache_ptr->next) {
-            if (ntohl(kernel_cache_ptr->group) < group_h)
-                continue;
-
-            if (ntohl(kernel_cache_ptr->group) > group_h)
-                break;
-
-            if (ntohl(kernel_cache_ptr->source) < source_h)
-                continue;
-
-            if (ntohl(kernel_cache_ptr->source) > source_h)
-                break;
-
-            /* We found it! */
-            if (kernel_cache_ptr->prev != NULL){
-                kernel_cache_ptr->prev->next = kernel_cache_ptr->next;
-            } else {
-                mrtentry_rp->kernel_cache = kernel_cache_ptr->next;
-            }
-
-            if (kernel_cache_ptr->next != NULL)
-                kernel_cache_ptr->next->prev = kernel_cache_ptr->prev;
-
-            found = TRUE;
-
-            break;
-        }
-
-        if (found == TRUE) {
-            if (mrtentry_rp->kernel_cache == NULL)
-                mrtentry_rp->flags &= ~(MRTF_KERNEL_CACHE | MRTF_MFC_CLONE_SG);
-
-            if (mrtentry_ptr->kernel_cache != NULL)
-                free ((char *)mrtentry_ptr->kernel_cache);
+        kernel_cache_ptr = (kernel_cache_t *)hash_find(&kchash,
+                                                       mrtentry_ptr->source->address,
+                                                       mrtentry_ptr->group->group);
+        if (kernel_cache_ptr == NULL || kernel_cache_ptr->owner != mrtentry_rp)
+            return;
 
-            mrtentry_ptr->flags |= MRTF_KERNEL_CACHE;
-            mrtentry_ptr->kernel_cache = kernel_cache_ptr;
-            kernel_cache_ptr->prev = NULL;
-            kernel_cache_ptr->next = NULL;
-        }
+        unlink_kernel_cache(kernel_cache_ptr);
+        link_kernel_cache(mrtentry_ptr, kernel_cache_ptr);
     }
 }
 
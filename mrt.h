@@ -59,21 +59,28 @@
 	       numvifs * sizeof((from)->vif_deletion_delay[0]));	\
     } while (0)
 
-#define FREE_MRTENTRY(mrtentry_ptr)				\
-    do {							\
-	kernel_cache_t *prev;					\
-	kernel_cache_t *next;					\
-								\
-	free((char *)((mrtentry_ptr)->vif_timers));		\
-	free((char *)((mrtentry_ptr)->vif_deletion_delay));	\
-	for (next = (mrtentry_ptr)->kernel_cache;		\
-	     next != (kernel_cache_t *)NULL; ) {		\
-	    prev = next; next = next->next;			\
-	    free(prev);						\
-	}							\
-	free((char *)((mrtentry_ptr)->kernel_cache));		\
-	free((char *)(mrtentry_ptr));				\
-    } while (0)
+/*
+ * The timers of the routing entries are absolute deadlines on the route
+ * clock (see timer.c), zero is an expired or reset timer.  Setting a timer
+ * schedules the entry, so that age_routes() only looks at the entries
+ * which have something due.
+ */
+#define MRT_TIMER_LEFT(timer)						\
+	((timer) > route_clock ? (timer) - route_clock : 0)
+#define SET_MRT_TIMER(mrt, timer, value)				\
+	set_mrt_timer((mrt), &(mrt)->timer, (value))
+#define SET_MRT_TIMER_MS(mrt, timer, msec)				\
+	set_mrt_timer_ms((mrt), &(mrt)->timer, (msec))
+#define MRT_TIMER_LEFT_MS(mrt, timer)					\
+	mrt_timer_left_ms((mrt), &(mrt)->timer)
+#define FIRE_MRT_TIMER(mrt, timer)	set_mrt_timer((mrt), &(mrt)->timer, 0)
+#define RESET_MRT_TIMER(mrt, timer)	set_mrt_timer((mrt), &(mrt)->timer, 0)
+#define IF_MRT_TIMER_SET(timer)		if (MRT_TIMER_LEFT(timer) > 0)
+#define IF_MRT_TIMER_NOT_SET(timer)	if (MRT_TIMER_LEFT(timer) == 0)
+#define MRT_TIMEOUT(timer)		(MRT_TIMER_LEFT(timer) == 0)
+
+/* Return the entry, its vif timers and kernel cache list to the pools */
+#define FREE_MRTENTRY(mrtentry_ptr)	free_mrtentry(mrtentry_ptr)
 
 
 /*
@@ -113,6 +120,7 @@ typedef struct pim_nbr_entry {
 					   * complicated Join/Prune
 					   * message construction.
 					   */
+    hash_entry_t hash;			  /* link in uv_pim_nbr_hash	    */
 } pim_nbr_entry_t;
 
 
@@ -127,6 +135,7 @@ typedef struct srcentry {
     u_int32		preference;	/* The metric preference (for assers)*/
     u_int16		timer;		/* Entry timer??? Delete?      	    */
     struct cand_rp      *cand_rp;       /* Used if this is rpentry_t        */
+    hash_entry_t	hash;		/* link in srchash (or rphash)	    */
 } srcentry_t;
 typedef srcentry_t rpentry_t;
 
@@ -150,6 +159,16 @@ typedef struct grp_mask {
     u_int8           group_rp_number;     /* Used when assembling segments  */
 } grp_mask_t;
 
+/*
+ * Binary trie over the group prefixes of grp_mask_list, one level per
+ * prefix bit.  Looking up a group visits at most 33 nodes, regardless of
+ * the number of prefixes in the RP-set.
+ */
+typedef struct grp_mask_node {
+    struct grp_mask_node *child[2];       /* Next bit clear/set             */
+    grp_mask_t       *mask;               /* The prefix ending here, if any */
+} grp_mask_node_t;
+
 typedef struct rp_grp_entry {
     struct	rp_grp_entry *rp_grp_next;/* Next entry for same RP         */
     struct	rp_grp_entry *rp_grp_prev;/* Prev entry for same RP         */
@@ -175,6 +194,7 @@ typedef struct grpentry {
     struct mrtentry	*mrtlink;      /* link to (S,G) routing entries	    */
     rp_grp_entry_t      *active_rp_grp;/* Pointer to the active rp_grp entry*/
     struct mrtentry	*grp_route;    /* Pointer to the (*,G) routing entry*/
+    hash_entry_t	hash;	       /* link in grphash, keyed by group   */
 } grpentry_t;
 
 typedef struct mrtentry {
@@ -198,15 +218,28 @@ typedef struct mrtentry {
     u_int32             metric;         /* Routing Metric for this entry    */
     u_int32		preference;	/* The metric preference value      */
     u_int32             pmbr_addr;      /* The PMBR address (for interop)   */
-    u_int16	        *vif_timers;    /* vifs timer list		    */
+    u_int32	        *vif_timers;    /* vifs timer list, inline after
+					 * the entry (see alloc_mrtentry)   */
     u_int16	        *vif_deletion_delay; /* vifs deletion delay list    */
     u_int16	        flags;	        /* The MRTF_* flags                 */
-    u_int16	        timer;	        /* entry timer			    */
-    u_int16	        jp_timer;	/* The Join/Prune timer		    */
-    u_int16             rs_timer;       /* Register-Suppression Timer       */
-    u_int	        assert_timer;
+    u_int32	        timer;	        /* entry timer			    */
+    u_int32	        jp_timer;	/* The Join/Prune timer		    */
+    u_int32             rs_timer;       /* Register-Suppression Timer       */
+    u_int32	        assert_timer;
     u_int	        assert_rate_timer;
-    struct kernel_cache *kernel_cache;  /* List of the kernel cache entries */
+    u_int32		jp_ms_due;	/* callout clock jp_timer expires at,
+					 * if set in msec, see timer.c	    */
+    u_int32		assert_ms_due;	/* same for assert_timer	    */
+    struct mrtentry	*msnext;	/* next entry with a msec timer	    */
+    struct mrtentry	**msprev;	/* link to us, NULL if none	    */
+    struct mrtentry	*duenext;	/* next entry due at the same time  */
+    struct mrtentry	**dueprev;	/* link to us, NULL if not scheduled*/
+    u_int32		due;		/* route clock we are due at	    */
+    u_int32		aged;		/* route clock we were last aged at */
+    struct kernel_cache *kernel_cache;  /* List of the kernel cache entries,
+					 * not ordered, see kchash	    */
+    hash_entry_t	hash;		/* link in sghash, (S,G) entries only*/
+    pool_t		*pool;		/* the pool this entry came from    */
 #ifdef RSRR
     struct rsrr_cache   *rsrr_cache;    /* Used to save RSRR requests for
 					 * routes change notification.
@@ -254,6 +287,10 @@ typedef struct kernel_cache {
     u_int32     source;
     u_int32     group;
     struct sg_count sg_count; /* The (s,g) data retated counters (see above) */
+    struct sg_count sg_dump;  /* ... as read by the last counter dump	    */
+    u_int32     sg_dump_gen;  /* stamp of that dump, see nl_dump_sg_cnt()   */
+    struct mrtentry *owner;   /* The entry whose list this one is on	    */
+    hash_entry_t hash;	      /* link in kchash, by (source, group)	    */
 } kernel_cache_t;
 
 /**
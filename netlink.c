@@ -226,6 +226,423 @@ static int getmsg(struct rtmsg *rtm, int msglen, struct rpfctl *rpf)
     return TRUE;
 }
 
+#ifdef HAVE_NETLINK_MFC
+/*
+ * Batched MFC programming.  The (S,G) entries are sent to the kernel as
+ * RTM_NEWROUTE and RTM_DELROUTE messages for RTNL_FAMILY_IPMR, many per
+ * sendmsg(), on a netlink socket of their own.  Only the last message of
+ * a batch asks for an ack, failed messages are reported back by the
+ * kernel anyway and are read by nl_mfc_read() from the main loop.
+ */
+#define NL_MFC_BUF_SIZE	32768
+
+static int   nl_mfc_socket = -1;
+static char  nl_mfc_buf[NL_MFC_BUF_SIZE];
+static int   nl_mfc_len;		/* bytes queued in nl_mfc_buf	   */
+static int   nl_mfc_last;		/* offset of the last message	   */
+static int   nl_mfc_count;		/* messages queued		   */
+static __u32 nl_mfc_seq;
+
+static struct {
+    u_long	adds;		/* RTM_NEWROUTE sent		   */
+    u_long	dels;		/* RTM_DELROUTE sent		   */
+    u_long	batches;	/* sendmsg() calls		   */
+    u_long	acks;		/* batches acked by the kernel	   */
+    u_long	errors;		/* messages failed		   */
+    u_long	fallbacks;	/* entries sent with setsockopt()  */
+    u_int32	largest;	/* largest batch		   */
+    u_long	dumps;		/* counter dumps		   */
+    u_long	dumped;		/* entries in the dumps		   */
+    u_long	matched;	/* ... with a kernel cache mirror  */
+} nl_mfc_stats;
+
+static void nl_mfc_read (int fd, fd_set *rfd);
+
+static struct nlmsghdr *nl_mfc_msg(int type, u_int32 source, u_int32 group)
+{
+    struct nlmsghdr *n = (struct nlmsghdr *)(nl_mfc_buf + nl_mfc_len);
+    struct rtmsg *r = NLMSG_DATA(n);
+
+    memset(n, 0, NLMSG_SPACE(sizeof(*r)));
+    n->nlmsg_type  = type;
+    n->nlmsg_flags = NLM_F_REQUEST;
+    if (type == RTM_NEWROUTE)
+	n->nlmsg_flags |= NLM_F_CREATE | NLM_F_REPLACE;
+    n->nlmsg_len   = NLMSG_LENGTH(sizeof(*r));
+    n->nlmsg_seq   = ++nl_mfc_seq;
+
+    r->rtm_family   = RTNL_FAMILY_IPMR;
+    r->rtm_type     = RTN_MULTICAST;
+    r->rtm_protocol = RTPROT_MROUTED;	/* flushed with MRT_DONE, like MRT_ADD_MFC */
+    r->rtm_scope    = RT_SCOPE_UNIVERSE;
+    r->rtm_table    = RT_TABLE_DEFAULT;
+    r->rtm_src_len  = 32;
+    r->rtm_dst_len  = 32;
+
+    addattr32(n, NL_MFC_BUF_SIZE - nl_mfc_len, RTA_SRC, source);
+    addattr32(n, NL_MFC_BUF_SIZE - nl_mfc_len, RTA_DST, group);
+
+    return n;
+}
+
+static void nl_mfc_queue(struct nlmsghdr *n)
+{
+    nl_mfc_last = nl_mfc_len;
+    nl_mfc_len += NLMSG_ALIGN(n->nlmsg_len);
+    nl_mfc_count++;
+}
+
+/*
+ * Open the MFC netlink socket, and find out whether the kernel takes
+ * RTNL_FAMILY_IPMR routes at all.  Returns FALSE if it does not, the
+ * MFC is then programmed with setsockopt() only.
+ */
+int nl_mfc_init(void)
+{
+    struct sockaddr_nl addr;
+    struct nlmsghdr *n;
+    struct nlmsgerr *e;
+    char buf[512];
+    int len;
+
+    nl_mfc_socket = socket(PF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+    if (nl_mfc_socket < 0) {
+	logit(LOG_WARNING, errno, "MFC netlink socket");
+	return FALSE;
+    }
+    k_set_rcvbuf(nl_mfc_socket, SO_RECV_BUF_SIZE_MAX, SO_RECV_BUF_SIZE_MIN);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    if (bind(nl_mfc_socket, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+	logit(LOG_WARNING, errno, "MFC netlink bind");
+	goto fail;
+    }
+
+    /* Probe with the removal of an entry which cannot exist */
+    nl_mfc_len = nl_mfc_count = 0;
+    n = nl_mfc_msg(RTM_DELROUTE, INADDR_ANY_N, INADDR_ANY_N);
+    n->nlmsg_flags |= NLM_F_ACK;
+    while (sendto(nl_mfc_socket, n, n->nlmsg_len, 0, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+	if (errno == EINTR)
+	    continue;		/* Received signal, retry syscall. */
+	logit(LOG_WARNING, errno, "MFC netlink probe");
+	goto fail;
+    }
+    do {
+	len = recv(nl_mfc_socket, buf, sizeof(buf), 0);
+	if (len < 0 && errno != EINTR) {
+	    logit(LOG_WARNING, errno, "MFC netlink probe");
+	    goto fail;
+	}
+	n = (struct nlmsghdr *)buf;
+    } while (len < (int)NLMSG_LENGTH(sizeof(*e)) || n->nlmsg_seq != nl_mfc_seq);
+
+    e = NLMSG_DATA(n);
+    if (n->nlmsg_type == NLMSG_ERROR
+	&& (e->error == -EOPNOTSUPP || e->error == -EAFNOSUPPORT || e->error == -EPROTONOSUPPORT)) {
+	logit(LOG_INFO, 0, "No MFC support in kernel netlink, using setsockopt()");
+	goto fail;
+    }
+
+    if (register_input_handler(nl_mfc_socket, nl_mfc_read) < 0) {
+	logit(LOG_WARNING, 0, "Failed registering nl_mfc_read() as an input handler");
+	goto fail;
+    }
+
+    return TRUE;
+
+  fail:
+    close(nl_mfc_socket);
+    nl_mfc_socket = -1;
+
+    return FALSE;
+}
+
+/*
+ * Throw away what is not sent yet, MRT_DONE removes the entries anyway.
+ */
+void nl_mfc_stop(void)
+{
+    nl_mfc_len = nl_mfc_count = 0;
+    if (nl_mfc_socket >= 0) {
+	close(nl_mfc_socket);
+	nl_mfc_socket = -1;
+    }
+}
+
+/*
+ * Queue an (S,G) entry, the counterpart of MRT_ADD_MFC.  Returns FALSE
+ * if the entry must go through setsockopt(), with the queue flushed so
+ * the kernel still sees the changes in order.
+ */
+int nl_mfc_add(u_int32 source, u_int32 group, vifi_t iif, vifbitmap_t oifs)
+{
+    struct nlmsghdr *n;
+    struct rtattr *mp;
+    struct rtnexthop *nh;
+    vifi_t vifi, nhops;
+    int need;
+
+    if (nl_mfc_socket < 0)
+	return FALSE;
+
+    /*
+     * The kernel takes the TTL thresholds by position, one nexthop per
+     * vif, and the vifs after the last one default to 0.  It rejects the
+     * whole entry with MAXVIFS nexthops or more, see ipmr_nla_get_ttls().
+     */
+    nhops = 0;
+    for (vifi = 0; vifi < numvifs; vifi++) {
+	/* The iif is removed at the packet forwarding phase, see k_put_mfc() */
+	if (vifi != iif && VIFM_ISSET(vifi, oifs))
+	    nhops = vifi + 1;
+    }
+
+    if (iif >= numvifs || uvifs[iif].uv_ifindex <= 0 || nhops >= MAXVIFS) {
+	nl_mfc_flush();
+	nl_mfc_stats.fallbacks++;
+	return FALSE;
+    }
+
+    need = NLMSG_SPACE(sizeof(struct rtmsg)) + 3 * RTA_SPACE(4)
+	+ RTA_SPACE(nhops * RTNH_ALIGN(sizeof(*nh)));
+    if (nl_mfc_len + need > NL_MFC_BUF_SIZE)
+	nl_mfc_flush();
+
+    n = nl_mfc_msg(RTM_NEWROUTE, source, group);
+    addattr32(n, NL_MFC_BUF_SIZE - nl_mfc_len, RTA_IIF, uvifs[iif].uv_ifindex);
+
+    mp = (struct rtattr *)((char *)n + NLMSG_ALIGN(n->nlmsg_len));
+    mp->rta_type = RTA_MULTIPATH;
+    mp->rta_len  = RTA_LENGTH(0);
+    for (vifi = 0; vifi < nhops; vifi++) {
+	nh = (struct rtnexthop *)((char *)mp + RTA_ALIGN(mp->rta_len));
+	memset(nh, 0, sizeof(*nh));
+	nh->rtnh_len = sizeof(*nh);
+	if (vifi != iif && VIFM_ISSET(vifi, oifs))
+	    nh->rtnh_hops = uvifs[vifi].uv_threshold;
+	mp->rta_len += RTNH_ALIGN(sizeof(*nh));
+    }
+    n->nlmsg_len = NLMSG_ALIGN(n->nlmsg_len) + RTA_ALIGN(mp->rta_len);
+
+    nl_mfc_queue(n);
+    nl_mfc_stats.adds++;
+
+    return TRUE;
+}
+
+/*
+ * Queue the removal of an (S,G) entry, the counterpart of MRT_DEL_MFC.
+ */
+int nl_mfc_del(u_int32 source, u_int32 group)
+{
+    if (nl_mfc_socket < 0)
+	return FALSE;
+
+    if (nl_mfc_len + (int)(NLMSG_SPACE(sizeof(struct rtmsg)) + 2 * RTA_SPACE(4)) > NL_MFC_BUF_SIZE)
+	nl_mfc_flush();
+
+    nl_mfc_queue(nl_mfc_msg(RTM_DELROUTE, source, group));
+    nl_mfc_stats.dels++;
+
+    return TRUE;
+}
+
+/*
+ * Send the queued entries in one go.  Called from the main loop before
+ * waiting for input, and whenever the queue fills up.
+ */
+void nl_mfc_flush(void)
+{
+    struct sockaddr_nl addr;
+    struct nlmsghdr *n;
+
+    if (!nl_mfc_len)
+	return;
+
+    n = (struct nlmsghdr *)(nl_mfc_buf + nl_mfc_last);
+    n->nlmsg_flags |= NLM_F_ACK;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    while (sendto(nl_mfc_socket, nl_mfc_buf, nl_mfc_len, 0, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+	if (errno == EINTR)
+	    continue;		/* Received signal, retry syscall. */
+	logit(LOG_WARNING, errno, "Failed sending %d MFC updates", nl_mfc_count);
+	nl_mfc_stats.errors += nl_mfc_count;
+	break;
+    }
+
+    nl_mfc_stats.batches++;
+    if ((u_int32)nl_mfc_count > nl_mfc_stats.largest)
+	nl_mfc_stats.largest = nl_mfc_count;
+
+    IF_DEBUG(DEBUG_MFC)
+	logit(LOG_DEBUG, 0, "Sent %d MFC updates over netlink", nl_mfc_count);
+
+    nl_mfc_len = nl_mfc_count = 0;
+}
+
+/*
+ * Read the acks and errors for the batches sent by nl_mfc_flush().
+ * Failed messages come back with the request, for the log.
+ */
+static void nl_mfc_read(int fd __attribute__((unused)), fd_set *rfd __attribute__((unused)))
+{
+    struct rtattr *rta[RTA_MAX + 1];
+    struct nlmsghdr *n;
+    struct nlmsgerr *e;
+    struct rtmsg *r;
+    u_int32 source, group;
+    char buf[8192];
+    u_int echoed;
+    int len;
+
+    while ((len = recv(nl_mfc_socket, buf, sizeof(buf), MSG_DONTWAIT)) != 0) {
+	if (len < 0) {
+	    if (errno == EINTR)
+		continue;	/* Received signal, retry syscall. */
+	    if (errno == ENOBUFS)
+		logit(LOG_WARNING, 0, "Lost MFC netlink replies, kernel cache may be out of sync");
+	    else if (errno != EAGAIN && errno != EWOULDBLOCK)
+		logit(LOG_WARNING, errno, "Failed reading MFC netlink socket");
+	    return;
+	}
+
+	for (n = (struct nlmsghdr *)buf; NLMSG_OK(n, (u_int)len); n = NLMSG_NEXT(n, len)) {
+	    if (n->nlmsg_type != NLMSG_ERROR || n->nlmsg_len < NLMSG_LENGTH(sizeof(*e)))
+		continue;
+
+	    e = NLMSG_DATA(n);
+	    if (!e->error) {
+		nl_mfc_stats.acks++;
+		continue;
+	    }
+
+	    nl_mfc_stats.errors++;
+	    source = group = INADDR_ANY_N;
+	    echoed = n->nlmsg_len - NLMSG_LENGTH(sizeof(*e)) + sizeof(e->msg);
+	    if (e->msg.nlmsg_len >= NLMSG_LENGTH(sizeof(*r)) && e->msg.nlmsg_len <= echoed) {
+		r = NLMSG_DATA(&e->msg);
+		memset(rta, 0, sizeof(rta));
+		parse_rtattr(rta, RTA_MAX, RTM_RTA(r), e->msg.nlmsg_len - NLMSG_LENGTH(sizeof(*r)));
+		if (rta[RTA_SRC])
+		    source = *(u_int32 *)RTA_DATA(rta[RTA_SRC]);
+		if (rta[RTA_DST])
+		    group = *(u_int32 *)RTA_DATA(rta[RTA_DST]);
+	    }
+	    logit(LOG_WARNING, -e->error, "Failed %s MFC entry src %s grp %s",
+		  e->msg.nlmsg_type == RTM_DELROUTE ? "removing" : "adding",
+		  inet_fmt(source, s1, sizeof(s1)), inet_fmt(group, s2, sizeof(s2)));
+	    if (e->msg.nlmsg_type != RTM_DELROUTE)
+		k_forget_mfc(source, group);
+	}
+    }
+}
+
+/*
+ * Read the counters of all MFC entries with one RTM_GETROUTE dump of
+ * the IPMR table, instead of one SIOCGETSGCNT per entry.  The counters
+ * are stored in the matching kernel cache mirrors, stamped with gen.
+ * Returns FALSE if the dump failed, the caller should use the ioctl.
+ */
+int nl_dump_sg_cnt(u_int32 gen)
+{
+    static char buf[32768];
+    struct rtattr *rta[RTA_MAX + 1];
+    struct rta_mfc_stats *mfcs;
+    struct sockaddr_nl addr;
+    kernel_cache_t *kc;
+    struct nlmsghdr *n;
+    struct rtmsg *r;
+    u_int32 source, group;
+    int len;
+
+    if (nl_mfc_socket < 0)
+	return FALSE;		/* No IPMR netlink support */
+
+    memset(buf, 0, NLMSG_SPACE(sizeof(*r)));
+    n = (struct nlmsghdr *)buf;
+    r = NLMSG_DATA(n);
+    n->nlmsg_type  = RTM_GETROUTE;
+    n->nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    n->nlmsg_len   = NLMSG_LENGTH(sizeof(*r));
+    n->nlmsg_pid   = pid;
+    n->nlmsg_seq   = ++seq;
+    r->rtm_family  = RTNL_FAMILY_IPMR;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    while (sendto(routing_socket, buf, n->nlmsg_len, 0, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+	if (errno == EINTR)
+	    continue;		/* Received signal, retry syscall. */
+	logit(LOG_WARNING, errno, "Failed requesting the MFC counters");
+	return FALSE;
+    }
+
+    nl_mfc_stats.dumps++;
+    while (1) {
+	len = recv(routing_socket, buf, sizeof(buf), 0);
+	if (len < 0) {
+	    if (errno == EINTR)
+		continue;	/* Received signal, retry syscall. */
+	    logit(LOG_WARNING, errno, "Failed reading the MFC counters");
+	    return FALSE;
+	}
+
+	for (n = (struct nlmsghdr *)buf; NLMSG_OK(n, (u_int)len); n = NLMSG_NEXT(n, len)) {
+	    if (n->nlmsg_seq != seq || n->nlmsg_pid != pid)
+		continue;	/* Not ours, e.g. a late k_req_incoming() reply */
+	    if (n->nlmsg_type == NLMSG_DONE)
+		return TRUE;
+	    if (n->nlmsg_type == NLMSG_ERROR) {
+		logit(LOG_WARNING, -(*(int *)NLMSG_DATA(n)), "Failed dumping the MFC counters");
+		return FALSE;
+	    }
+	    if (n->nlmsg_type != RTM_NEWROUTE || n->nlmsg_len < NLMSG_LENGTH(sizeof(*r)))
+		continue;
+
+	    r = NLMSG_DATA(n);
+	    if (r->rtm_family != RTNL_FAMILY_IPMR || r->rtm_table != RT_TABLE_DEFAULT
+		|| (r->rtm_flags & RTNH_F_UNRESOLVED))
+		continue;
+
+	    memset(rta, 0, sizeof(rta));
+	    parse_rtattr(rta, RTA_MAX, RTM_RTA(r), n->nlmsg_len - NLMSG_LENGTH(sizeof(*r)));
+	    if (!rta[RTA_SRC] || !rta[RTA_DST] || !rta[RTA_MFC_STATS])
+		continue;
+
+	    nl_mfc_stats.dumped++;
+	    source = *(u_int32 *)RTA_DATA(rta[RTA_SRC]);
+	    group  = *(u_int32 *)RTA_DATA(rta[RTA_DST]);
+	    kc = (kernel_cache_t *)hash_find(&kchash, source, group);
+	    if (!kc)
+		continue;
+
+	    mfcs = (struct rta_mfc_stats *)RTA_DATA(rta[RTA_MFC_STATS]);
+	    kc->sg_dump.pktcnt   = mfcs->mfcs_packets;
+	    kc->sg_dump.bytecnt  = mfcs->mfcs_bytes;
+	    kc->sg_dump.wrong_if = mfcs->mfcs_wrong_if;
+	    kc->sg_dump_gen      = gen;
+	    nl_mfc_stats.matched++;
+	}
+    }
+}
+
+void dump_nl_mfc(FILE *fp)
+{
+    fprintf(fp, "MFC netlink       Adds        Dels     Batches  Largest        Acks      Errors   Fallbacks\n");
+    fprintf(fp, "%-12s %10lu %11lu %11lu %8u %11lu %11lu %11lu\n",
+	    nl_mfc_socket < 0 ? "disabled" : "enabled",
+	    nl_mfc_stats.adds, nl_mfc_stats.dels, nl_mfc_stats.batches,
+	    nl_mfc_stats.largest, nl_mfc_stats.acks, nl_mfc_stats.errors,
+	    nl_mfc_stats.fallbacks);
+    fprintf(fp, "Counter dumps %9lu, %lu entries read, %lu matched the kernel cache\n\n",
+	    nl_mfc_stats.dumps, nl_mfc_stats.dumped, nl_mfc_stats.matched);
+}
+#endif /* HAVE_NETLINK_MFC */
+
 #endif /* __linux__ */
 
 /**
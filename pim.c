@@ -42,6 +42,52 @@ char	*pim_send_buf;		/* output packet buffer  */
 u_int32	allpimrouters_group;	/* ALL_PIM_ROUTERS address in net order */
 int	pim_socket;		/* socket for PIM control msgs */
 
+static recv_batch_t pim_recv_batch;	/* input packet buffers */
+
+#ifdef HAVE_SENDMMSG
+/*
+ * Transmit queue for the multicast control messages produced by one
+ * timer tick: periodic Join/Prunes and bootstraps.  Hellos have their
+ * own callouts, see set_pim_hello_timer(), and are sent one by one.
+ * The queue is flushed with sendmmsg(), the outgoing interface of each
+ * message is selected with IP_PKTINFO, see k_set_pktinfo().  Only
+ * link-local groups are queued, they all go out with the socket's
+ * multicast loopback.
+ */
+#define PIM_TXQ_LEN	64		/* messages per sendmmsg() */
+#define PIM_TXQ_BYTES	65536		/* data bytes in the queue */
+
+struct pim_txq_msg {
+    struct sockaddr_in	dst;
+    struct iovec	iov;
+    union {
+	struct cmsghdr	hdr;
+	char		buf[K_PKTINFO_SPACE];
+    } ctl;
+    socklen_t		ctllen;
+    u_int32		src;
+    int			type;
+};
+
+static struct {
+    int			held;		/* queue messages instead of sending */
+    int			count;
+    size_t		used;
+    struct pim_txq_msg	msg[PIM_TXQ_LEN];
+    struct mmsghdr	hdr[PIM_TXQ_LEN];
+    char		data[PIM_TXQ_BYTES];
+    /* Statistics */
+    u_long		flushes;
+    u_long		calls;
+    u_long		messages;
+    u_long		errors;
+    u_int32		largest;
+} pim_txq;
+
+static void pim_txq_add  (char *buf, int sendlen, u_int32 src, u_int32 dst, int type);
+static int  pim_txq_send (int first, int num);
+#endif /* HAVE_SENDMMSG */
+
 #ifdef RAW_OUTPUT_IS_RAW
 extern int curttl;
 #endif /* RAW_OUTPUT_IS_RAW */
@@ -66,13 +112,15 @@ void init_pim(void)
     k_set_rcvbuf(pim_socket, SO_RECV_BUF_SIZE_MAX,
                  SO_RECV_BUF_SIZE_MIN);   /* lots of input buffering        */
     k_set_ttl(pim_socket, MINTTL);        /* restrict multicasts to one hop */
-    k_set_loop(pim_socket, FALSE);        /* disable multicast loopback     */
+    k_init_send(pim_socket);              /* multicast loopback for k_send() */
 
     allpimrouters_group = htonl(INADDR_ALL_PIM_ROUTERS);
 
-    pim_recv_buf = calloc(1, RECV_BUF_SIZE);
+    if (!pim_recv_batch.size)
+	k_recv_init(&pim_recv_batch, "PIM", RECV_BATCH_SIZE);
+    pim_recv_buf = pim_recv_batch.buf[0];
     pim_send_buf = calloc(1, SEND_BUF_SIZE);
-    if (!pim_recv_buf || !pim_send_buf)
+    if (!pim_send_buf)
 	logit(LOG_ERR, 0, "Ran out of memory in init_pim()");
 
     /* One time setup in the buffers */
@@ -99,25 +147,25 @@ void init_pim(void)
 }
 
 
-/* Read a PIM message */
+/* Read a batch of PIM messages */
 static void pim_read(int f __attribute__((unused)), fd_set *rfd __attribute__((unused)))
 {
-    ssize_t len;
-    socklen_t dummy = 0;
+    int n, i;
+#ifndef HAVE_EPOLL
 #if defined(SYSV) || defined(__USE_SVID)
     sigset_t block, oblock;
 #else
     int omask;
 #endif
+#endif /* HAVE_EPOLL */
 
-    while ((len = recvfrom(pim_socket, pim_recv_buf, RECV_BUF_SIZE, 0, NULL, &dummy)) < 0) {
-	if (errno == EINTR)
-	    continue;		/* Received signal, retry syscall. */
-
-	logit(LOG_ERR, errno, "Failed recvfrom() in pim_read()");
+    if ((n = k_recv(pim_socket, &pim_recv_batch)) < 0) {
+	logit(LOG_ERR, errno, "Failed k_recv() in pim_read()");
         return;
     }
 
+    /* With epoll the signals are always blocked, read from a signalfd */
+#ifndef HAVE_EPOLL
 #if defined(SYSV) || defined(__USE_SVID)
     (void)sigemptyset(&block);
     (void)sigaddset(&block, SIGALRM);
@@ -127,14 +175,20 @@ static void pim_read(int f __attribute__((unused)), fd_set *rfd __attribute__((u
     /* Use of omask taken from main() */
     omask = sigblock(sigmask(SIGALRM));
 #endif /* SYSV */
+#endif /* HAVE_EPOLL */
 
-    accept_pim(len);
+    for (i = 0; i < n; i++) {
+	pim_recv_buf = pim_recv_batch.buf[i];
+	accept_pim(pim_recv_batch.len[i]);
+    }
 
+#ifndef HAVE_EPOLL
 #if defined(SYSV) || defined(__USE_SVID)
     (void)sigprocmask(SIG_SETMASK, &oblock, (sigset_t *)NULL);
 #else
     (void)sigsetmask(omask);
 #endif /* SYSV */
+#endif /* HAVE_EPOLL */
 }
 
 static void accept_pim(ssize_t recvlen)
@@ -222,7 +276,6 @@ static void accept_pim(ssize_t recvlen)
  */
 void send_pim(char *buf, u_int32 src, u_int32 dst, int type, int datalen)
 {
-    struct sockaddr_in sdst;
     struct ip *ip;
     pim_header_t *pim;
     int sendlen;
@@ -252,41 +305,33 @@ void send_pim(char *buf, u_int32 src, u_int32 dst, int type, int datalen)
                                     sizeof(pim_header_t) + datalen);
 
     if (IN_MULTICAST(ntohl(dst))) {
-        k_set_if(pim_socket, src);
         if ((dst == allhosts_group) || (dst == allrouters_group) ||
-            (dst == allpimrouters_group)) {
+            (dst == allpimrouters_group))
             setloop = 1;
-            k_set_loop(pim_socket, TRUE);
-        }
 #ifdef RAW_OUTPUT_IS_RAW
         ip->ip_ttl = curttl;
+#endif /* RAW_OUTPUT_IS_RAW */
+#ifdef HAVE_SENDMMSG
+        if (pim_txq.held && setloop) {
+            pim_txq_add(buf, sendlen, src, dst, type);
+            return;
+        }
+#endif /* HAVE_SENDMMSG */
+#ifdef RAW_OUTPUT_IS_RAW
     } else {
         ip->ip_ttl = MAXTTL;
 #endif /* RAW_OUTPUT_IS_RAW */
     }
 
-    memset(&sdst, 0, sizeof(sdst));
-    sdst.sin_family = AF_INET;
-#ifdef HAVE_SA_LEN
-    sdst.sin_len = sizeof(sdst);
-#endif
-    sdst.sin_addr.s_addr = dst;
-    while (sendto(pim_socket, buf, sendlen, 0, (struct sockaddr *)&sdst, sizeof(sdst)) < 0) {
-	if (errno == EINTR)
-	    continue;		/* Received signal, retry syscall. */
-        else if (errno == ENETDOWN)
+    if (k_send(pim_socket, buf, sendlen, src, dst, setloop) < 0) {
+        if (errno == ENETDOWN)
             check_vif_state();
         else
             logit(LOG_WARNING, errno, "sendto from %s to %s",
 		  inet_fmt(src, s1, sizeof(s1)), inet_fmt(dst, s2, sizeof(s2)));
-        if (setloop)
-            k_set_loop(pim_socket, FALSE);
         return;
     }
 
-    if (setloop)
-        k_set_loop(pim_socket, FALSE);
-
     IF_DEBUG(DEBUG_PIM_DETAIL) {
         IF_DEBUG(DEBUG_PIM) {
             logit(LOG_DEBUG, 0, "SENT %s from %-15s to %s",
@@ -297,6 +342,142 @@ void send_pim(char *buf, u_int32 src, u_int32 dst, int type, int datalen)
     }
 }
 
+
+/*
+ * Start queueing the multicast PIM messages, until pim_txq_flush().
+ */
+void pim_txq_start(void)
+{
+#ifdef HAVE_SENDMMSG
+    pim_txq.held = TRUE;
+#endif /* HAVE_SENDMMSG */
+}
+
+#ifdef HAVE_SENDMMSG
+static void pim_txq_add(char *buf, int sendlen, u_int32 src, u_int32 dst, int type)
+{
+    struct pim_txq_msg *m;
+
+    if (pim_txq.count == PIM_TXQ_LEN || pim_txq.used + sendlen > PIM_TXQ_BYTES) {
+	pim_txq_flush();
+	pim_txq.held = TRUE;
+    }
+
+    m = &pim_txq.msg[pim_txq.count];
+    memset(m, 0, sizeof(*m));
+    m->dst.sin_family      = AF_INET;
+#ifdef HAVE_SA_LEN
+    m->dst.sin_len         = sizeof(m->dst);
+#endif
+    m->dst.sin_addr.s_addr = dst;
+    m->iov.iov_base        = pim_txq.data + pim_txq.used;
+    m->iov.iov_len         = sendlen;
+    m->src                 = src;
+    m->ctllen              = k_set_pktinfo(m->ctl.buf, src);
+    m->type                = type;
+    memcpy(m->iov.iov_base, buf, sendlen);
+
+    pim_txq.used += sendlen;
+    pim_txq.count++;
+}
+
+/*
+ * Send num queued messages, starting at first, returns the number of
+ * sendmmsg() calls made.
+ */
+static int pim_txq_send(int first, int num)
+{
+    struct pim_txq_msg *m;
+    int i, n, calls = 0;
+
+    for (i = first; i < first + num; i++) {
+	m = &pim_txq.msg[i];
+	memset(&pim_txq.hdr[i], 0, sizeof(pim_txq.hdr[i]));
+	pim_txq.hdr[i].msg_hdr.msg_name       = &m->dst;
+	pim_txq.hdr[i].msg_hdr.msg_namelen    = sizeof(m->dst);
+	pim_txq.hdr[i].msg_hdr.msg_iov        = &m->iov;
+	pim_txq.hdr[i].msg_hdr.msg_iovlen     = 1;
+	pim_txq.hdr[i].msg_hdr.msg_control    = m->ctl.buf;
+	pim_txq.hdr[i].msg_hdr.msg_controllen = m->ctllen;
+    }
+
+    i = first;
+    while (i < first + num) {
+	calls++;
+	n = sendmmsg(pim_socket, &pim_txq.hdr[i], first + num - i, 0);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;	/* Received signal, retry syscall. */
+
+	    /* The message at i failed, report it and go on with the rest */
+	    m = &pim_txq.msg[i];
+	    pim_txq.errors++;
+	    if (errno == ENETDOWN)
+		check_vif_state();
+	    else
+		logit(LOG_WARNING, errno, "sendmmsg from %s to %s",
+		      inet_fmt(m->src, s1, sizeof(s1)),
+		      inet_fmt(m->dst.sin_addr.s_addr, s2, sizeof(s2)));
+	    i++;
+	    continue;
+	}
+
+	IF_DEBUG(DEBUG_PIM_DETAIL) {
+	    IF_DEBUG(DEBUG_PIM) {
+		int j;
+
+		for (j = i; j < i + n; j++) {
+		    m = &pim_txq.msg[j];
+		    logit(LOG_DEBUG, 0, "SENT %s from %-15s to %s",
+			  packet_kind(IPPROTO_PIM, m->type, 0),
+			  m->src == INADDR_ANY_N ? "INADDR_ANY" :
+			  inet_fmt(m->src, s1, sizeof(s1)),
+			  inet_fmt(m->dst.sin_addr.s_addr, s2, sizeof(s2)));
+		}
+	    }
+	}
+	i += n;
+    }
+
+    return calls;
+}
+#endif /* HAVE_SENDMMSG */
+
+/*
+ * Send all queued messages and stop queueing.
+ */
+void pim_txq_flush(void)
+{
+#ifdef HAVE_SENDMMSG
+    pim_txq.held = FALSE;
+    if (!pim_txq.count)
+	return;
+
+    pim_txq.flushes++;
+    pim_txq.messages += pim_txq.count;
+    if ((u_int32)pim_txq.count > pim_txq.largest)
+	pim_txq.largest = pim_txq.count;
+
+    pim_txq.calls += pim_txq_send(0, pim_txq.count);
+
+    pim_txq.count = 0;
+    pim_txq.used  = 0;
+#endif /* HAVE_SENDMMSG */
+}
+
+void dump_pim_txq(FILE *fp)
+{
+#ifdef HAVE_SENDMMSG
+    fprintf(fp, "Transmit     Queue     Flushes       Calls    Messages  Avg  Largest      Errors\n");
+    fprintf(fp, "%-12s %5d %11lu %11lu %11lu %4lu %8u %11lu\n\n", "pim",
+	    PIM_TXQ_LEN, pim_txq.flushes, pim_txq.calls, pim_txq.messages,
+	    pim_txq.flushes ? pim_txq.messages / pim_txq.flushes : 0,
+	    pim_txq.largest, pim_txq.errors);
+#else
+    (void)fp;
+#endif /* HAVE_SENDMMSG */
+}
+
 u_int pim_send_cnt = 0;
 #define SEND_DEBUG_NUMBER 50
 
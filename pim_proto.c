@@ -43,6 +43,12 @@ static build_jp_message_t *get_jp_working_buff (void);
 static void return_jp_working_buff (pim_nbr_entry_t *pim_nbr);
 static void pack_jp_message        (pim_nbr_entry_t *pim_nbr);
 static void send_jp_message        (pim_nbr_entry_t *pim_nbr);
+static int  jp_take_tokens         (struct uvif *v, u_int16 datalen);
+static u_int32 jp_token_wait       (struct uvif *v, u_int16 datalen);
+static void jp_xmit                (vifi_t vifi, u_int8 *data, u_int16 datalen);
+static void jp_enqueue             (vifi_t vifi, u_int8 *data, u_int16 datalen);
+static void jp_txq_timeout         (void *arg);
+static void pim_hello_timeout      (void *arg);
 static int compare_metrics         (u_int32 local_preference,
                                     u_int32 local_metric,
                                     u_int32 local_address,
@@ -53,6 +59,15 @@ static int compare_metrics         (u_int32 local_preference,
 build_jp_message_t *build_jp_message_pool;
 int build_jp_message_pool_counter;
 
+/* A Join/Prune message waiting for the rate limit of its vif */
+struct jp_txq_entry {
+    struct jp_txq_entry *next;
+    u_int16		 datalen;
+    u_int8		 data[1];
+};
+
+static int jp_txq_timerid;	/* drains the J/P queues of all vifs */
+
 /************************************************************************
  *                        PIM_HELLO
  ************************************************************************/
@@ -96,40 +111,35 @@ int receive_pim_hello(u_int32 src, u_int32 dst __attribute__((unused)), char *pi
               inet_fmt(src, s1, sizeof(s1)), holdtime);
     }
 
-    for (prev_nbr = (pim_nbr_entry_t *)NULL, nbr = v->uv_pim_neighbors;
-         nbr != (pim_nbr_entry_t *)NULL;
-         prev_nbr = nbr, nbr = nbr->next) {
-        /* The PIM neighbors are sorted in decreasing order of the
-         * network addresses (note that to be able to compare them
-         * correctly we must translate the addresses in host order.
-         */
-        if (ntohl(src) < ntohl(nbr->address))
-            continue;
-
-        if (src == nbr->address) {
-            /* We already have an entry for this host */
-            if (0 == holdtime) {
-                /* Looks like we have a nice neighbor who is going down
-                 * and wants to inform us by sending "holdtime=0". Thanks
-                 * buddy and see you again!
-                 */
-                logit(LOG_INFO, 0, "PIM HELLO received: neighbor %s going down",
-                      inet_fmt(src, s1, sizeof(s1)));
-                delete_pim_nbr(nbr);
-
-                return TRUE;
-            }
-            SET_TIMER(nbr->timer, holdtime);
+    nbr = find_vif_pim_nbr(vifi, src);
+    if (nbr != (pim_nbr_entry_t *)NULL) {
+        /* We already have an entry for this host */
+        if (0 == holdtime) {
+            /* Looks like we have a nice neighbor who is going down
+             * and wants to inform us by sending "holdtime=0". Thanks
+             * buddy and see you again!
+             */
+            logit(LOG_INFO, 0, "PIM HELLO received: neighbor %s going down",
+                  inet_fmt(src, s1, sizeof(s1)));
+            delete_pim_nbr(nbr);
 
             return TRUE;
         }
-        else {
-            /*
-             * No entry for this neighbor. Exit the loop and create an
-             * entry for it.
-             */
+        SET_TIMER(nbr->timer, holdtime);
+
+        return TRUE;
+    }
+
+    /* The PIM neighbors are sorted in decreasing order of the
+     * network addresses (note that to be able to compare them
+     * correctly we must translate the addresses in host order.
+     * The first neighbor is the potential DR.
+     */
+    for (prev_nbr = (pim_nbr_entry_t *)NULL, nbr = v->uv_pim_neighbors;
+         nbr != (pim_nbr_entry_t *)NULL;
+         prev_nbr = nbr, nbr = nbr->next) {
+        if (ntohl(src) > ntohl(nbr->address))
             break;
-	}
     }
 
     /*
@@ -152,6 +162,8 @@ int receive_pim_hello(u_int32 src, u_int32 dst __attribute__((unused)), char *pi
         v->uv_pim_neighbors = new_nbr;
     if (new_nbr->next != (pim_nbr_entry_t *)NULL)
         new_nbr->next->prev = new_nbr;
+    hash_insert(&v->uv_pim_nbr_hash, &new_nbr->hash, src, INADDR_ANY_N, new_nbr);
+    v->uv_pim_nbr_count++;
 
     v->uv_flags &= ~VIFF_NONBRS;
     v->uv_flags |= VIFF_PIM_NBR;
@@ -218,6 +230,15 @@ int receive_pim_hello(u_int32 src, u_int32 dst __attribute__((unused)), char *pi
 }
 
 
+/*
+ * Return the PIM neighbor with the given address on the vif, or NULL.
+ */
+pim_nbr_entry_t *find_vif_pim_nbr(vifi_t vifi, u_int32 address)
+{
+    return (pim_nbr_entry_t *)hash_find(&uvifs[vifi].uv_pim_nbr_hash, address, INADDR_ANY_N);
+}
+
+
 void delete_pim_nbr(pim_nbr_entry_t *nbr_delete)
 {
     srcentry_t *srcentry_ptr;
@@ -240,6 +261,8 @@ void delete_pim_nbr(pim_nbr_entry_t *nbr_delete)
         v->uv_pim_neighbors = nbr_delete->next;
     if (nbr_delete->next != (pim_nbr_entry_t *)NULL)
         nbr_delete->next->prev = nbr_delete->prev;
+    hash_remove(&v->uv_pim_nbr_hash, &nbr_delete->hash);
+    v->uv_pim_nbr_count--;
 
     return_jp_working_buff(nbr_delete);
 
@@ -434,12 +457,46 @@ int send_pim_hello(struct uvif *v, u_int16 holdtime)
 
     datalen = data_ptr - (u_int8 *)buf;
     send_pim(pim_send_buf, v->uv_lcl_addr, allpimrouters_group, PIM_HELLO, datalen);
-    SET_TIMER(v->uv_pim_hello_timer, PIM_TIMER_HELLO_PERIOD);
+    if (holdtime)
+        set_pim_hello_timer(v, PIM_TIMER_HELLO_PERIOD * 1000);
 
     return TRUE;
 }
 
 
+/*
+ * Send the next Hello on that vif in `msec' milliseconds.  The Hellos are
+ * callouts of their own, so they go out on time and not on the next
+ * TIMER_INTERVAL.
+ */
+void set_pim_hello_timer(struct uvif *v, u_int32 msec)
+{
+    vifi_t *cbk;
+
+    timer_clearTimer(v->uv_pim_hello_timerid);
+    v->uv_pim_hello_timerid = 0;
+
+    cbk = (vifi_t *)malloc(sizeof(vifi_t));
+    if (!cbk) {
+        logit(LOG_ERR, 0, "Ran out of memory in set_pim_hello_timer()");
+        return;
+    }
+    *cbk = v - uvifs;
+
+    v->uv_pim_hello_timerid = timer_setTimer_ms(msec, pim_hello_timeout, cbk);
+}
+
+
+static void pim_hello_timeout(void *arg)
+{
+    struct uvif *v = &uvifs[*(vifi_t *)arg];
+
+    free(arg);
+    v->uv_pim_hello_timerid = 0;
+    send_pim_hello(v, PIM_TIMER_HELLO_HOLDTIME);
+}
+
+
 /************************************************************************
  *                        PIM_REGISTER
  ************************************************************************/
@@ -551,7 +608,7 @@ int receive_pim_register(u_int32 reg_src, u_int32 reg_dst, char *pim_message, si
     if (mrtentry_ptr->flags & MRTF_SG) {
         /* (S,G) found */
         /* TODO: check the timer again */
-        SET_TIMER(mrtentry_ptr->timer, PIM_DATA_TIMEOUT); /* restart timer */
+        SET_MRT_TIMER(mrtentry_ptr, timer, PIM_DATA_TIMEOUT); /* restart timer */
         if (!(mrtentry_ptr->flags & MRTF_SPT)) { /* The SPT bit is not set */
             if (!nullRegisterBit) {
                 calc_oifs(mrtentry_ptr, &oifs);
@@ -600,9 +657,9 @@ int receive_pim_register(u_int32 reg_src, u_int32 reg_dst, char *pim_message, si
                 mrtentry_ptr2->pmbr_addr = reg_src;
                 /* Clear the SPT flag */
                 mrtentry_ptr2->flags &= ~(MRTF_SPT | MRTF_NEW);
-                SET_TIMER(mrtentry_ptr2->timer, PIM_DATA_TIMEOUT);
+                SET_MRT_TIMER(mrtentry_ptr2, timer, PIM_DATA_TIMEOUT);
                 /* TODO: explicitly call the Join/Prune send function? */
-                FIRE_TIMER(mrtentry_ptr2->jp_timer); /* Send the Join immediately */
+                FIRE_MRT_TIMER(mrtentry_ptr2, jp_timer); /* Send the Join immediately */
                 /* TODO: explicitly call this function?
                    send_pim_join_prune(mrtentry_ptr2->upstream->vifi,
                    mrtentry_ptr2->upstream,
@@ -659,7 +716,7 @@ int receive_pim_register(u_int32 reg_src, u_int32 reg_dst, char *pim_message, si
                 /* TODO: something else? Have the feeling sth is missing */
                 mrtentry_ptr2->flags &= ~MRTF_NEW;
                 /* TODO: XXX: copy the timer from the (*,*,RP) entry? */
-                COPY_TIMER(mrtentry_ptr->timer, mrtentry_ptr2->timer);
+                SET_MRT_TIMER(mrtentry_ptr2, timer, MRT_TIMER_LEFT(mrtentry_ptr->timer));
             }
             /* Install cache entry in the kernel */
 #ifdef KERNEL_MFC_WC_G
@@ -721,12 +778,12 @@ int send_pim_register(char *packet)
     if (mrtentry_ptr->flags & MRTF_NEW) {
         /* A new entry */
         mrtentry_ptr->flags &= ~MRTF_NEW;
-        RESET_TIMER(mrtentry_ptr->rs_timer); /* Reset the Register-Suppression timer */
+        RESET_MRT_TIMER(mrtentry_ptr, rs_timer); /* Reset the Register-Suppression timer */
 	mrtentry_ptr2 = mrtentry_ptr->group->grp_route;
         if (!mrtentry_ptr2)
             mrtentry_ptr2 = mrtentry_ptr->group->active_rp_grp->rp->rpentry->mrtlink;
         if (mrtentry_ptr2) {
-            FIRE_TIMER(mrtentry_ptr2->jp_timer); /* Timeout the Join/Prune timer */
+            FIRE_MRT_TIMER(mrtentry_ptr2, jp_timer); /* Timeout the Join/Prune timer */
             /* TODO: explicitly call this function?
                send_pim_join_prune(mrtentry_ptr2->upstream->vifi,
                mrtentry_ptr2->upstream,
@@ -735,9 +792,9 @@ int send_pim_register(char *packet)
         }
     }
     /* Restart the (S,G) Entry-timer */
-    SET_TIMER(mrtentry_ptr->timer, PIM_DATA_TIMEOUT);
+    SET_MRT_TIMER(mrtentry_ptr, timer, PIM_DATA_TIMEOUT);
 
-    IF_TIMER_NOT_SET(mrtentry_ptr->rs_timer) {
+    IF_MRT_TIMER_NOT_SET(mrtentry_ptr->rs_timer) {
         /* The Register-Suppression Timer is not running.
          * Encapsulate the data and send to the RP.
          */
@@ -878,7 +935,7 @@ int receive_pim_register_stop(u_int32 reg_src, u_int32 reg_dst, char *pim_messag
         return FALSE;
 
     /* restart the Register-Suppression timer */
-    SET_TIMER(mrtentry_ptr->rs_timer, (0.5 * PIM_REGISTER_SUPPRESSION_TIMEOUT)
+    SET_MRT_TIMER(mrtentry_ptr, rs_timer, (0.5 * PIM_REGISTER_SUPPRESSION_TIMEOUT)
               + (RANDOM() % (PIM_REGISTER_SUPPRESSION_TIMEOUT + 1)));
     /* Prune the register_vif from the outgoing list */
     VIFM_COPY(mrtentry_ptr->pruned_oifs, pruned_oifs);
@@ -1031,6 +1088,7 @@ int receive_pim_join_prune(u_int32 src, u_int32 dst __attribute__((unused)), cha
     mrtentry_t *mrtentry_rp;
     grpentry_t *grpentry_ptr;
     u_int16 jp_value;
+    u_int32 jp_delay;		/* Join override delay, in msec */
     pim_nbr_entry_t *upstream_router;
     int my_action;
     int ignore_group;
@@ -1093,6 +1151,11 @@ int receive_pim_join_prune(u_int32 src, u_int32 dst __attribute__((unused)), cha
         if (!upstream_router)
             return FALSE;   /* I have no such neighbor */
 
+        /* One override delay for the whole message, so that the Joins
+         * it triggers are aged and sent together, see set_mrt_timer_ms().
+         */
+        jp_delay = RANDOM() % (int)(1000 * PIM_RANDOM_DELAY_JOIN_TIMEOUT);
+
         while (num_groups--) {
             GET_EGADDR(&encod_group, data_ptr);
             GET_HOSTSHORT(num_j_srcs, data_ptr);
@@ -1128,10 +1191,10 @@ int receive_pim_join_prune(u_int32 src, u_int32 dst __attribute__((unused)), cha
 
                         /* Check the holdtime */
                         /* TODO: XXX: TIMER implem. dependency! */
-                        if (mrtentry_rp->jp_timer > holdtime)
+                        if (MRT_TIMER_LEFT(mrtentry_rp->jp_timer) > holdtime)
                             continue;
 
-                        if ((mrtentry_rp->jp_timer == holdtime) && (ntohl(src) > ntohl(v->uv_lcl_addr)))
+                        if ((MRT_TIMER_LEFT(mrtentry_rp->jp_timer) == holdtime) && (ntohl(src) > ntohl(v->uv_lcl_addr)))
                             continue;
 
                         /* Set the Join/Prune suppression timer for this
@@ -1140,8 +1203,8 @@ int receive_pim_join_prune(u_int32 src, u_int32 dst __attribute__((unused)), cha
                          */
                         jp_value = PIM_JOIN_PRUNE_PERIOD + 0.5 * (RANDOM() % PIM_JOIN_PRUNE_PERIOD);
                         /* TODO: XXX: TIMER implem. dependency! */
-                        if (mrtentry_rp->jp_timer < jp_value)
-                            SET_TIMER(mrtentry_rp->jp_timer, jp_value);
+                        if (MRT_TIMER_LEFT(mrtentry_rp->jp_timer) < jp_value)
+                            SET_MRT_TIMER(mrtentry_rp, jp_timer, jp_value);
                     }
                 } /* num_j_srcs */
 
@@ -1168,20 +1231,19 @@ int receive_pim_join_prune(u_int32 src, u_int32 dst __attribute__((unused)), cha
                         my_action = join_or_prune(mrtentry_rp, upstream_router);
                         if (my_action == PIM_ACTION_PRUNE) {
                             /* TODO: XXX: TIMER implem. dependency! */
-                            if ((mrtentry_rp->jp_timer < holdtime)
-				|| ((mrtentry_rp->jp_timer == holdtime) &&
+                            if ((MRT_TIMER_LEFT(mrtentry_rp->jp_timer) < holdtime)
+				|| ((MRT_TIMER_LEFT(mrtentry_rp->jp_timer) == holdtime) &&
 				    (ntohl(src) > ntohl(v->uv_lcl_addr)))) {
                                 /* Suppress the Prune */
                                 jp_value = PIM_JOIN_PRUNE_PERIOD + 0.5 * (RANDOM() % PIM_JOIN_PRUNE_PERIOD);
-                                if (mrtentry_rp->jp_timer < jp_value)
-                                    SET_TIMER(mrtentry_rp->jp_timer, jp_value);
+                                if (MRT_TIMER_LEFT(mrtentry_rp->jp_timer) < jp_value)
+                                    SET_MRT_TIMER(mrtentry_rp, jp_timer, jp_value);
                             }
                         } else if (my_action == PIM_ACTION_JOIN) {
                             /* Override the Prune by scheduling a Join */
-                            jp_value = (RANDOM() % (int)(10 * PIM_RANDOM_DELAY_JOIN_TIMEOUT)) / 10;
                             /* TODO: XXX: TIMER implem. dependency! */
-                            if (mrtentry_rp->jp_timer > jp_value)
-                                SET_TIMER(mrtentry_rp->jp_timer, jp_value);
+                            if (MRT_TIMER_LEFT_MS(mrtentry_rp, jp_timer) > jp_delay)
+                                SET_MRT_TIMER_MS(mrtentry_rp, jp_timer, jp_delay);
                         }
 
                         /* Check all (*,G) and (S,G) matching to this RP.
@@ -1193,20 +1255,18 @@ int receive_pim_join_prune(u_int32 src, u_int32 dst __attribute__((unused)), cha
                              grpentry_ptr = grpentry_ptr->rpnext) {
                             my_action = join_or_prune(grpentry_ptr->grp_route, upstream_router);
                             if (my_action == PIM_ACTION_JOIN) {
-                                jp_value = (RANDOM() % (int)(10 * PIM_RANDOM_DELAY_JOIN_TIMEOUT)) / 10;
                                 /* TODO: XXX: TIMER implem. dependency! */
-                                if (grpentry_ptr->grp_route->jp_timer > jp_value)
-                                    SET_TIMER(grpentry_ptr->grp_route->jp_timer, jp_value);
+                                if (MRT_TIMER_LEFT_MS(grpentry_ptr->grp_route, jp_timer) > jp_delay)
+                                    SET_MRT_TIMER_MS(grpentry_ptr->grp_route, jp_timer, jp_delay);
                             }
                             for (mrtentry_srcs = grpentry_ptr->mrtlink;
                                  mrtentry_srcs != (mrtentry_t *)NULL;
                                  mrtentry_srcs = mrtentry_srcs->grpnext) {
                                 my_action = join_or_prune(mrtentry_srcs, upstream_router);
                                 if (my_action == PIM_ACTION_JOIN) {
-                                    jp_value = (RANDOM() % (int)(10 * PIM_RANDOM_DELAY_JOIN_TIMEOUT)) / 10;
                                     /* TODO: XXX: TIMER implem. dependency! */
-                                    if (mrtentry_srcs->jp_timer > jp_value)
-                                        SET_TIMER(mrtentry_srcs->jp_timer, jp_value);
+                                    if (MRT_TIMER_LEFT_MS(mrtentry_srcs, jp_timer) > jp_delay)
+                                        SET_MRT_TIMER_MS(mrtentry_srcs, jp_timer, jp_delay);
                                 }
                             } /* For all (S,G) */
                         } /* For all (*,G) */
@@ -1246,15 +1306,15 @@ int receive_pim_join_prune(u_int32 src, u_int32 dst __attribute__((unused)), cha
 
                     /* Check the holdtime */
                     /* TODO: XXX: TIMER implem. dependency! */
-                    if (mrtentry_ptr->jp_timer > holdtime)
+                    if (MRT_TIMER_LEFT(mrtentry_ptr->jp_timer) > holdtime)
                         continue;
 
-                    if ((mrtentry_ptr->jp_timer == holdtime) && (ntohl(src) > ntohl(v->uv_lcl_addr)))
+                    if ((MRT_TIMER_LEFT(mrtentry_ptr->jp_timer) == holdtime) && (ntohl(src) > ntohl(v->uv_lcl_addr)))
                         continue;
 
                     jp_value = PIM_JOIN_PRUNE_PERIOD + 0.5 * (RANDOM() % PIM_JOIN_PRUNE_PERIOD);
-                    if (mrtentry_ptr->jp_timer < jp_value)
-                        SET_TIMER(mrtentry_ptr->jp_timer, jp_value);
+                    if (MRT_TIMER_LEFT(mrtentry_ptr->jp_timer) < jp_value)
+                        SET_MRT_TIMER(mrtentry_ptr, jp_timer, jp_value);
                     continue;
                 } /* End of (*,G) Join suppression */
 
@@ -1269,15 +1329,15 @@ int receive_pim_join_prune(u_int32 src, u_int32 dst __attribute__((unused)), cha
 
                 /* Check the holdtime */
                 /* TODO: XXX: TIMER implem. dependency! */
-                if (mrtentry_ptr->jp_timer > holdtime)
+                if (MRT_TIMER_LEFT(mrtentry_ptr->jp_timer) > holdtime)
                     continue;
 
-                if ((mrtentry_ptr->jp_timer == holdtime) && (ntohl(src) > ntohl(v->uv_lcl_addr)))
+                if ((MRT_TIMER_LEFT(mrtentry_ptr->jp_timer) == holdtime) && (ntohl(src) > ntohl(v->uv_lcl_addr)))
                     continue;
 
                 jp_value = PIM_JOIN_PRUNE_PERIOD + 0.5 * (RANDOM() % PIM_JOIN_PRUNE_PERIOD);
-                if (mrtentry_ptr->jp_timer < jp_value)
-                    SET_TIMER(mrtentry_ptr->jp_timer, jp_value);
+                if (MRT_TIMER_LEFT(mrtentry_ptr->jp_timer) < jp_value)
+                    SET_MRT_TIMER(mrtentry_ptr, jp_timer, jp_value);
                 continue;
             }
 
@@ -1303,21 +1363,20 @@ int receive_pim_join_prune(u_int32 src, u_int32 dst __attribute__((unused)), cha
                     my_action = join_or_prune(mrtentry_ptr, upstream_router);
                     if (my_action == PIM_ACTION_PRUNE) {
                         /* TODO: XXX: TIMER implem. dependency! */
-                        if ((mrtentry_ptr->jp_timer < holdtime)
-                            || ((mrtentry_ptr->jp_timer == holdtime)
+                        if ((MRT_TIMER_LEFT(mrtentry_ptr->jp_timer) < holdtime)
+                            || ((MRT_TIMER_LEFT(mrtentry_ptr->jp_timer) == holdtime)
                                 && (ntohl(src) > ntohl(v->uv_lcl_addr)))) {
                             /* Suppress the Prune */
                             jp_value = PIM_JOIN_PRUNE_PERIOD + 0.5 * (RANDOM() % PIM_JOIN_PRUNE_PERIOD);
-                            if (mrtentry_ptr->jp_timer < jp_value)
-                                SET_TIMER(mrtentry_ptr->jp_timer, jp_value);
+                            if (MRT_TIMER_LEFT(mrtentry_ptr->jp_timer) < jp_value)
+                                SET_MRT_TIMER(mrtentry_ptr, jp_timer, jp_value);
                         }
                     }
                     else if (my_action == PIM_ACTION_JOIN) {
                         /* Override the Prune by scheduling a Join */
-                        jp_value = (RANDOM() % (int)(10 * PIM_RANDOM_DELAY_JOIN_TIMEOUT)) / 10;
                         /* TODO: XXX: TIMER implem. dependency! */
-                        if (mrtentry_ptr->jp_timer > jp_value)
-                            SET_TIMER(mrtentry_ptr->jp_timer, jp_value);
+                        if (MRT_TIMER_LEFT_MS(mrtentry_ptr, jp_timer) > jp_delay)
+                            SET_MRT_TIMER_MS(mrtentry_ptr, jp_timer, jp_delay);
                     }
 
                     /* Check all (S,G) entries for this group.
@@ -1329,10 +1388,9 @@ int receive_pim_join_prune(u_int32 src, u_int32 dst __attribute__((unused)), cha
                          mrtentry_srcs = mrtentry_srcs->grpnext) {
                         my_action = join_or_prune(mrtentry_srcs, upstream_router);
                         if (my_action == PIM_ACTION_JOIN) {
-                            jp_value = (RANDOM() % (int)(10 * PIM_RANDOM_DELAY_JOIN_TIMEOUT)) / 10;
                             /* TODO: XXX: TIMER implem. dependency! */
-                            if (mrtentry_ptr->jp_timer > jp_value)
-                                SET_TIMER(mrtentry_ptr->jp_timer, jp_value);
+                            if (MRT_TIMER_LEFT_MS(mrtentry_ptr, jp_timer) > jp_delay)
+                                SET_MRT_TIMER_MS(mrtentry_ptr, jp_timer, jp_delay);
                         }
                     } /* For all (S,G) */
                     continue;  /* End of (*,G) prune suppression */
@@ -1347,20 +1405,19 @@ int receive_pim_join_prune(u_int32 src, u_int32 dst __attribute__((unused)), cha
                 if (my_action == PIM_ACTION_PRUNE) {
                     /* Suppress the (S,G) Prune */
                     /* TODO: XXX: TIMER implem. dependency! */
-                    if ((mrtentry_ptr->jp_timer < holdtime)
-                        || ((mrtentry_ptr->jp_timer == holdtime)
+                    if ((MRT_TIMER_LEFT(mrtentry_ptr->jp_timer) < holdtime)
+                        || ((MRT_TIMER_LEFT(mrtentry_ptr->jp_timer) == holdtime)
                             && (ntohl(src) > ntohl(v->uv_lcl_addr)))) {
                         jp_value = PIM_JOIN_PRUNE_PERIOD + 0.5 * (RANDOM() % PIM_JOIN_PRUNE_PERIOD);
-                        if (mrtentry_ptr->jp_timer < jp_value)
-                            SET_TIMER(mrtentry_ptr->jp_timer, jp_value);
+                        if (MRT_TIMER_LEFT(mrtentry_ptr->jp_timer) < jp_value)
+                            SET_MRT_TIMER(mrtentry_ptr, jp_timer, jp_value);
                     }
                 }
                 else if (my_action == PIM_ACTION_JOIN) {
                     /* Override the Prune by scheduling a Join */
-                    jp_value = (RANDOM() % (int)(10 * PIM_RANDOM_DELAY_JOIN_TIMEOUT)) / 10;
                     /* TODO: XXX: TIMER implem. dependency! */
-                    if (mrtentry_ptr->jp_timer > jp_value)
-                        SET_TIMER(mrtentry_ptr->jp_timer, jp_value);
+                    if (MRT_TIMER_LEFT_MS(mrtentry_ptr, jp_timer) > jp_delay)
+                        SET_MRT_TIMER_MS(mrtentry_ptr, jp_timer, jp_delay);
                 }
             }  /* while (num_p_srcs--) */
         }  /* while (num_groups--) */
@@ -1532,14 +1589,14 @@ int receive_pim_join_prune(u_int32 src, u_int32 dst __attribute__((unused)), cha
                  */
                 /* TODO: XXX: increase the entry timer? */
                 if (v->uv_flags & VIFF_POINT_TO_POINT) {
-                    FIRE_TIMER(mrtentry_ptr->vif_timers[vifi]);
+                    FIRE_MRT_TIMER(mrtentry_ptr, vif_timers[vifi]);
                 } else {
                     /* TODO: XXX: TIMER implem. dependency! */
-                    if (mrtentry_ptr->vif_timers[vifi] > mrtentry_ptr->vif_deletion_delay[vifi])
-                        SET_TIMER(mrtentry_ptr->vif_timers[vifi],
-				  mrtentry_ptr->vif_deletion_delay[vifi]);
+                    if (MRT_TIMER_LEFT(mrtentry_ptr->vif_timers[vifi]) > mrtentry_ptr->vif_deletion_delay[vifi])
+                        SET_MRT_TIMER(mrtentry_ptr, vif_timers[vifi],
+                                      mrtentry_ptr->vif_deletion_delay[vifi]);
                 }
-                IF_TIMER_NOT_SET(mrtentry_ptr->vif_timers[vifi]) {
+                IF_MRT_TIMER_NOT_SET(mrtentry_ptr->vif_timers[vifi]) {
                     VIFM_CLR(vifi, mrtentry_ptr->joined_oifs);
                     VIFM_SET(vifi, mrtentry_ptr->pruned_oifs);
                     change_interfaces(mrtentry_ptr,
@@ -1556,16 +1613,16 @@ int receive_pim_join_prune(u_int32 src, u_int32 dst __attribute__((unused)), cha
                 /* ~(S,G)RPbit prune sent toward the RP */
                 mrtentry_ptr = find_route(source, group, MRTF_SG, DONT_CREATE);
                 if (mrtentry_ptr) {
-                    SET_TIMER(mrtentry_ptr->timer, holdtime);
+                    SET_MRT_TIMER(mrtentry_ptr, timer, holdtime);
                     if (v->uv_flags & VIFF_POINT_TO_POINT) {
-                        FIRE_TIMER(mrtentry_ptr->vif_timers[vifi]);
+                        FIRE_MRT_TIMER(mrtentry_ptr, vif_timers[vifi]);
                     } else {
                         /* TODO: XXX: TIMER implem. dependency! */
-                        if (mrtentry_ptr->vif_timers[vifi] > mrtentry_ptr->vif_deletion_delay[vifi])
-                            SET_TIMER(mrtentry_ptr->vif_timers[vifi],
-                                      mrtentry_ptr->vif_deletion_delay[vifi]);
+                        if (MRT_TIMER_LEFT(mrtentry_ptr->vif_timers[vifi]) > mrtentry_ptr->vif_deletion_delay[vifi])
+                            SET_MRT_TIMER(mrtentry_ptr, vif_timers[vifi],
+                                          mrtentry_ptr->vif_deletion_delay[vifi]);
                     }
-                    IF_TIMER_NOT_SET(mrtentry_ptr->vif_timers[vifi]) {
+                    IF_MRT_TIMER_NOT_SET(mrtentry_ptr->vif_timers[vifi]) {
                         VIFM_CLR(vifi, mrtentry_ptr->joined_oifs);
                         VIFM_SET(vifi, mrtentry_ptr->pruned_oifs);
                         change_interfaces(mrtentry_ptr,
@@ -1586,11 +1643,11 @@ int receive_pim_join_prune(u_int32 src, u_int32 dst __attribute__((unused)), cha
                         continue;
 
                     mrtentry_ptr->flags &= ~MRTF_NEW;
-                    RESET_TIMER(mrtentry_ptr->vif_timers[vifi]);
+                    RESET_MRT_TIMER(mrtentry_ptr, vif_timers[vifi]);
                     /* TODO: XXX: The spec doens't say what value to use for
                      * the entry time. Use the J/P holdtime.
                      */
-                    SET_TIMER(mrtentry_ptr->timer, holdtime);
+                    SET_MRT_TIMER(mrtentry_ptr, timer, holdtime);
                     /* TODO: XXX: The spec says to delete the oif. However,
                      * its timer only should be lowered, so the prune can be
                      * overwritten on multiaccess LAN. Spec BUG.
@@ -1621,14 +1678,14 @@ int receive_pim_join_prune(u_int32 src, u_int32 dst __attribute__((unused)), cha
                             continue; /* The RP address doesn't match. */
 
                         if (v->uv_flags & VIFF_POINT_TO_POINT) {
-                            FIRE_TIMER(mrtentry_ptr->vif_timers[vifi]);
+                            FIRE_MRT_TIMER(mrtentry_ptr, vif_timers[vifi]);
                         } else {
                             /* TODO: XXX: TIMER implem. dependency! */
-                            if (mrtentry_ptr->vif_timers[vifi] > mrtentry_ptr->vif_deletion_delay[vifi])
-                                SET_TIMER(mrtentry_ptr->vif_timers[vifi],
-                                          mrtentry_ptr->vif_deletion_delay[vifi]);
+                            if (MRT_TIMER_LEFT(mrtentry_ptr->vif_timers[vifi]) > mrtentry_ptr->vif_deletion_delay[vifi])
+                                SET_MRT_TIMER(mrtentry_ptr, vif_timers[vifi],
+                                              mrtentry_ptr->vif_deletion_delay[vifi]);
                         }
-                        IF_TIMER_NOT_SET(mrtentry_ptr->vif_timers[vifi]) {
+                        IF_MRT_TIMER_NOT_SET(mrtentry_ptr->vif_timers[vifi]) {
                             VIFM_CLR(vifi, mrtentry_ptr->joined_oifs);
                             VIFM_SET(vifi, mrtentry_ptr->pruned_oifs);
                             change_interfaces(mrtentry_ptr,
@@ -1650,7 +1707,7 @@ int receive_pim_join_prune(u_int32 src, u_int32 dst __attribute__((unused)), cha
                         continue;
 
                     mrtentry_ptr->flags &= ~MRTF_NEW;
-                    RESET_TIMER(mrtentry_ptr->vif_timers[vifi]);
+                    RESET_MRT_TIMER(mrtentry_ptr, vif_timers[vifi]);
                     /* TODO: XXX: should only lower the oif timer, so it can
                      * be overwritten on multiaccess LAN. Spec bug.
                      */
@@ -1690,12 +1747,12 @@ int receive_pim_join_prune(u_int32 src, u_int32 dst __attribute__((unused)), cha
                 VIFM_CLR(vifi, mrtentry_ptr->pruned_oifs);
                 VIFM_CLR(vifi, mrtentry_ptr->asserted_oifs);
                 /* TODO: XXX: TIMER implem. dependency! */
-                if (mrtentry_ptr->vif_timers[vifi] < holdtime) {
-                    SET_TIMER(mrtentry_ptr->vif_timers[vifi], holdtime);
+                if (MRT_TIMER_LEFT(mrtentry_ptr->vif_timers[vifi]) < holdtime) {
+                    SET_MRT_TIMER(mrtentry_ptr, vif_timers[vifi], holdtime);
                     mrtentry_ptr->vif_deletion_delay[vifi] = holdtime/3;
                 }
-                if (mrtentry_ptr->timer < holdtime)
-                    SET_TIMER(mrtentry_ptr->timer, holdtime);
+                if (MRT_TIMER_LEFT(mrtentry_ptr->timer) < holdtime)
+                    SET_MRT_TIMER(mrtentry_ptr, timer, holdtime);
                 mrtentry_ptr->flags &= ~MRTF_NEW;
                 change_interfaces(mrtentry_ptr,
                                   mrtentry_ptr->incoming,
@@ -1733,12 +1790,12 @@ int receive_pim_join_prune(u_int32 src, u_int32 dst __attribute__((unused)), cha
                 VIFM_CLR(vifi, mrtentry_ptr->pruned_oifs);
                 VIFM_CLR(vifi, mrtentry_ptr->asserted_oifs);
                 /* TODO: XXX: TIMER implem. dependency! */
-                if (mrtentry_ptr->vif_timers[vifi] < holdtime) {
-                    SET_TIMER(mrtentry_ptr->vif_timers[vifi], holdtime);
+                if (MRT_TIMER_LEFT(mrtentry_ptr->vif_timers[vifi]) < holdtime) {
+                    SET_MRT_TIMER(mrtentry_ptr, vif_timers[vifi], holdtime);
                     mrtentry_ptr->vif_deletion_delay[vifi] = holdtime/3;
                 }
-                if (mrtentry_ptr->timer < holdtime)
-                    SET_TIMER(mrtentry_ptr->timer, holdtime);
+                if (MRT_TIMER_LEFT(mrtentry_ptr->timer) < holdtime)
+                    SET_MRT_TIMER(mrtentry_ptr, timer, holdtime);
                 /* TODO: if this is a new entry, send immediately the
                  * Join message toward S. The Join/Prune timer for new
                  * entries is 0, but it does not means the message will
@@ -1799,12 +1856,12 @@ int receive_pim_join_prune(u_int32 src, u_int32 dst __attribute__((unused)), cha
             VIFM_CLR(vifi, mrtentry_ptr->pruned_oifs);
             VIFM_CLR(vifi, mrtentry_ptr->asserted_oifs);
             /* TODO: XXX: TIMER implem. dependency! */
-            if (mrtentry_ptr->vif_timers[vifi] < holdtime) {
-                SET_TIMER(mrtentry_ptr->vif_timers[vifi], holdtime);
+            if (MRT_TIMER_LEFT(mrtentry_ptr->vif_timers[vifi]) < holdtime) {
+                SET_MRT_TIMER(mrtentry_ptr, vif_timers[vifi], holdtime);
                 mrtentry_ptr->vif_deletion_delay[vifi] = holdtime/3;
             }
-            if (mrtentry_ptr->timer < holdtime)
-                SET_TIMER(mrtentry_ptr->timer, holdtime);
+            if (MRT_TIMER_LEFT(mrtentry_ptr->timer) < holdtime)
+                SET_MRT_TIMER(mrtentry_ptr, timer, holdtime);
             mrtentry_ptr->flags &= ~MRTF_NEW;
             change_interfaces(mrtentry_ptr,
                               mrtentry_ptr->incoming,
@@ -1867,14 +1924,14 @@ int receive_pim_join_prune(u_int32 src, u_int32 dst __attribute__((unused)), cha
              */
             /* TODO: XXX: increase the entry timer? */
             if (v->uv_flags & VIFF_POINT_TO_POINT) {
-                FIRE_TIMER(mrtentry_ptr->vif_timers[vifi]);
+                FIRE_MRT_TIMER(mrtentry_ptr, vif_timers[vifi]);
             } else {
                 /* TODO: XXX: TIMER implem. dependency! */
-                if (mrtentry_ptr->vif_timers[vifi] > mrtentry_ptr->vif_deletion_delay[vifi])
-                    SET_TIMER(mrtentry_ptr->vif_timers[vifi],
-                              mrtentry_ptr->vif_deletion_delay[vifi]);
+                if (MRT_TIMER_LEFT(mrtentry_ptr->vif_timers[vifi]) > mrtentry_ptr->vif_deletion_delay[vifi])
+                    SET_MRT_TIMER(mrtentry_ptr, vif_timers[vifi],
+                                  mrtentry_ptr->vif_deletion_delay[vifi]);
             }
-            IF_TIMER_NOT_SET(mrtentry_ptr->vif_timers[vifi]) {
+            IF_MRT_TIMER_NOT_SET(mrtentry_ptr->vif_timers[vifi]) {
                 VIFM_CLR(vifi, mrtentry_ptr->joined_oifs);
                 VIFM_SET(vifi, mrtentry_ptr->pruned_oifs);
                 VIFM_SET(vifi, mrtentry_ptr->asserted_oifs);
@@ -1937,7 +1994,7 @@ int send_periodic_pim_join_prune(vifi_t vifi, pim_nbr_entry_t *pim_nbr, u_int16
         /* TODO: XXX: TIMER implem. dependency! */
         if (mrtentry_ptr
 	    && (mrtentry_ptr->incoming == vifi)
-            && (mrtentry_ptr->jp_timer <= TIMER_INTERVAL)) {
+            && (MRT_TIMER_LEFT(mrtentry_ptr->jp_timer) <= TIMER_INTERVAL)) {
 
             /* If join/prune to a particular neighbor only was specified */
             if (pim_nbr && mrtentry_ptr->upstream != pim_nbr)
@@ -1954,7 +2011,7 @@ int send_periodic_pim_join_prune(vifi_t vifi, pim_nbr_entry_t *pim_nbr, u_int16
             /* TODO: XXX: TIMER implem. dependency! */
             if (VIFM_ISEMPTY(mrtentry_ptr->joined_oifs)
                 && (!(v->uv_flags & VIFF_DR))
-                && (mrtentry_ptr->jp_timer <= TIMER_INTERVAL)) {
+                && (MRT_TIMER_LEFT(mrtentry_ptr->jp_timer) <= TIMER_INTERVAL)) {
                 add_jp_entry(mrtentry_ptr->upstream, holdtime,
                              grpentry_ptr->group, SINGLE_GRP_MSKLEN,
                              grpentry_ptr->rpaddr,
@@ -1976,7 +2033,7 @@ int send_periodic_pim_join_prune(vifi_t vifi, pim_nbr_entry_t *pim_nbr, u_int16
                         && grpentry_ptr->grp_route))
                     /* TODO: XXX: TIMER implem. dependency! */
                     if ((grpentry_ptr->grp_route->incoming == vifi)
-                        && (grpentry_ptr->grp_route->jp_timer <= TIMER_INTERVAL))
+                        && (MRT_TIMER_LEFT(grpentry_ptr->grp_route->jp_timer) <= TIMER_INTERVAL))
                         /* S is directly connected. Send toward RP */
                         add_jp_entry(grpentry_ptr->grp_route->upstream,
                                      holdtime,
@@ -1989,7 +2046,7 @@ int send_periodic_pim_join_prune(vifi_t vifi, pim_nbr_entry_t *pim_nbr, u_int16
                 if (VIFM_ISEMPTY(mrtentry_ptr->joined_oifs)) {
                     /* TODO: XXX: TIMER implem. dependency! */
                     if ((mrtentry_ptr->incoming == vifi)
-                        && (mrtentry_ptr->jp_timer <= TIMER_INTERVAL))
+                        && (MRT_TIMER_LEFT(mrtentry_ptr->jp_timer) <= TIMER_INTERVAL))
                         add_jp_entry(mrtentry_ptr->upstream, holdtime,
                                      grpentry_ptr->group, SINGLE_GRP_MSKLEN,
                                      mrtentry_ptr->source->address,
@@ -1998,7 +2055,7 @@ int send_periodic_pim_join_prune(vifi_t vifi, pim_nbr_entry_t *pim_nbr, u_int16
                 else {
                     /* TODO: XXX: TIMER implem. dependency! */
                     if ((mrtentry_ptr->incoming == vifi)
-                        && (mrtentry_ptr->jp_timer <= TIMER_INTERVAL))
+                        && (MRT_TIMER_LEFT(mrtentry_ptr->jp_timer) <= TIMER_INTERVAL))
                         add_jp_entry(mrtentry_ptr->upstream, holdtime,
                                      grpentry_ptr->group, SINGLE_GRP_MSKLEN,
                                      mrtentry_ptr->source->address,
@@ -2009,7 +2066,7 @@ int send_periodic_pim_join_prune(vifi_t vifi, pim_nbr_entry_t *pim_nbr, u_int16
                     && grpentry_ptr->grp_route
                     && (mrtentry_ptr->incoming != grpentry_ptr->grp_route->incoming)
                     && (grpentry_ptr->grp_route->incoming == vifi)
-                    && (grpentry_ptr->grp_route->jp_timer <= TIMER_INTERVAL))
+                    && (MRT_TIMER_LEFT(grpentry_ptr->grp_route->jp_timer) <= TIMER_INTERVAL))
                     add_jp_entry(grpentry_ptr->grp_route->upstream, holdtime,
                                  grpentry_ptr->group, SINGLE_GRP_MSKLEN,
                                  mrtentry_ptr->source->address,
@@ -2030,7 +2087,7 @@ int send_periodic_pim_join_prune(vifi_t vifi, pim_nbr_entry_t *pim_nbr, u_int16
         /* TODO: XXX: TIMER implem. dependency! */
         if (rpentry_ptr->mrtlink
             && (rpentry_ptr->incoming == vifi)
-            && (rpentry_ptr->mrtlink->jp_timer <= TIMER_INTERVAL)) {
+            && (MRT_TIMER_LEFT(rpentry_ptr->mrtlink->jp_timer) <= TIMER_INTERVAL)) {
             add_jp_entry(rpentry_ptr->upstream, holdtime, htonl(CLASSD_PREFIX), STAR_STAR_RP_MSKLEN,
                          rpentry_ptr->address, SINGLE_SRC_MSKLEN, MRTF_RP | MRTF_WC, PIM_ACTION_JOIN);
         }
@@ -2365,14 +2422,191 @@ static void send_jp_message(pim_nbr_entry_t *pim_nbr)
 {
     u_int16 datalen;
     vifi_t vifi;
+    struct uvif *v;
 
     datalen = pim_nbr->build_jp_message->jp_message_size;
     vifi = pim_nbr->vifi;
+    v = &uvifs[vifi];
+
+    v->uv_jp_stats.burst++;
+    /* Keep the order, nothing may overtake the queued messages */
+    if (!v->uv_jp_txq && jp_take_tokens(v, datalen))
+	jp_xmit(vifi, pim_nbr->build_jp_message->jp_message, datalen);
+    else
+	jp_enqueue(vifi, pim_nbr->build_jp_message->jp_message, datalen);
+
+    return_jp_working_buff(pim_nbr);
+}
+
+
+/*
+ * The J/P send rate of a vif is limited by two token buckets, one for
+ * messages and one for bytes, each holding up to one second worth of
+ * tokens.  The tokens are kept in 1/1000 units, so the buckets can be
+ * refilled with millisecond precision.  A rate of 0 means no limit.
+ */
+static void jp_refill(struct uvif *v)
+{
+    u_int32 now = callout_clock();
+    u_int32 elapsed = now - v->uv_jp_refill;
+
+    v->uv_jp_refill = now;
+    if (elapsed > 1000)
+	elapsed = 1000;
+
+    v->uv_jp_msg_tokens += v->uv_jp_rate * elapsed;
+    if (v->uv_jp_msg_tokens > v->uv_jp_rate * 1000)
+	v->uv_jp_msg_tokens = v->uv_jp_rate * 1000;
+    v->uv_jp_byte_tokens += v->uv_jp_byte_rate * elapsed;
+    if (v->uv_jp_byte_tokens > v->uv_jp_byte_rate * 1000)
+	v->uv_jp_byte_tokens = v->uv_jp_byte_rate * 1000;
+}
+
+/* A message larger than the byte rate only has to wait for a full bucket */
+#define JP_BYTE_COST(v, datalen)					\
+    (MIN((u_int32)(datalen), (v)->uv_jp_byte_rate) * 1000)
+
+static int jp_take_tokens(struct uvif *v, u_int16 datalen)
+{
+    if (!v->uv_jp_rate && !v->uv_jp_byte_rate)
+	return TRUE;
+
+    jp_refill(v);
+    if (v->uv_jp_rate && v->uv_jp_msg_tokens < 1000)
+	return FALSE;
+    if (v->uv_jp_byte_rate && v->uv_jp_byte_tokens < JP_BYTE_COST(v, datalen))
+	return FALSE;
+
+    if (v->uv_jp_rate)
+	v->uv_jp_msg_tokens -= 1000;
+    if (v->uv_jp_byte_rate)
+	v->uv_jp_byte_tokens -= JP_BYTE_COST(v, datalen);
+
+    return TRUE;
+}
+
+/*
+ * Milliseconds until jp_take_tokens() will succeed for that message.
+ */
+static u_int32 jp_token_wait(struct uvif *v, u_int16 datalen)
+{
+    u_int32 wait = 0, need;
+
+    if (v->uv_jp_rate && v->uv_jp_msg_tokens < 1000)
+	wait = (1000 - v->uv_jp_msg_tokens + v->uv_jp_rate - 1) / v->uv_jp_rate;
+
+    need = JP_BYTE_COST(v, datalen);
+    if (v->uv_jp_byte_rate && v->uv_jp_byte_tokens < need) {
+	need = (need - v->uv_jp_byte_tokens + v->uv_jp_byte_rate - 1) / v->uv_jp_byte_rate;
+	if (need > wait)
+	    wait = need;
+    }
+
+    return wait ? wait : 1;
+}
+
+static void jp_xmit(vifi_t vifi, u_int8 *data, u_int16 datalen)
+{
     memcpy(pim_send_buf + sizeof(struct ip) + sizeof(pim_header_t),
-	   pim_nbr->build_jp_message->jp_message, datalen);
+	   data, datalen);
     send_pim(pim_send_buf, uvifs[vifi].uv_lcl_addr, allpimrouters_group,
              PIM_JOIN_PRUNE, datalen);
-    return_jp_working_buff(pim_nbr);
+    uvifs[vifi].uv_jp_stats.sent++;
+}
+
+static void jp_enqueue(vifi_t vifi, u_int8 *data, u_int16 datalen)
+{
+    struct uvif *v = &uvifs[vifi];
+    struct jp_txq_entry *entry;
+
+    if (v->uv_jp_stats.queued >= JP_TXQ_MAX) {
+	v->uv_jp_stats.dropped++;
+	IF_DEBUG(DEBUG_PIM_JOIN_PRUNE)
+	    logit(LOG_DEBUG, 0, "J/P queue of vif %d is full, message dropped", vifi);
+	return;
+    }
+
+    entry = (struct jp_txq_entry *)malloc(sizeof(*entry) + datalen);
+    if (!entry) {
+	v->uv_jp_stats.dropped++;
+	logit(LOG_WARNING, 0, "Ran out of memory in jp_enqueue()");
+	return;
+    }
+    entry->next = NULL;
+    entry->datalen = datalen;
+    memcpy(entry->data, data, datalen);
+
+    if (v->uv_jp_txq_tail)
+	v->uv_jp_txq_tail->next = entry;
+    else
+	v->uv_jp_txq = entry;
+    v->uv_jp_txq_tail = entry;
+
+    v->uv_jp_stats.delayed++;
+    if (++v->uv_jp_stats.queued > v->uv_jp_stats.queued_max)
+	v->uv_jp_stats.queued_max = v->uv_jp_stats.queued;
+
+    if (!jp_txq_timerid)
+	jp_txq_timerid = timer_setTimer_ms(jp_token_wait(v, datalen), jp_txq_timeout, NULL);
+}
+
+/*
+ * Send the queued J/P messages the rate limits allow now, and wake up
+ * again when the next one may go.
+ */
+static void jp_txq_timeout(void *arg __attribute__((unused)))
+{
+    vifi_t vifi;
+    struct uvif *v;
+    struct jp_txq_entry *entry;
+    u_int32 wait, next = 0;
+
+    jp_txq_timerid = 0;
+    for (vifi = 0, v = uvifs; vifi < numvifs; vifi++, v++) {
+	while ((entry = v->uv_jp_txq)) {
+	    if (!jp_take_tokens(v, entry->datalen)) {
+		wait = jp_token_wait(v, entry->datalen);
+		if (!next || wait < next)
+		    next = wait;
+		break;
+	    }
+
+	    v->uv_jp_txq = entry->next;
+	    if (!v->uv_jp_txq)
+		v->uv_jp_txq_tail = NULL;
+	    v->uv_jp_stats.queued--;
+	    jp_xmit(vifi, entry->data, entry->datalen);
+	    free(entry);
+	}
+    }
+
+    if (next)
+	jp_txq_timerid = timer_setTimer_ms(next, jp_txq_timeout, NULL);
+}
+
+/*
+ * Forget the drain timer, restart() has freed all callouts already.  The
+ * queues are flushed when the vifs are stopped.
+ */
+void init_jp_txq(void)
+{
+    jp_txq_timerid = 0;
+}
+
+/*
+ * Drop the queued J/P messages of a vif going down.
+ */
+void flush_jp_txq(vifi_t vifi)
+{
+    struct uvif *v = &uvifs[vifi];
+    struct jp_txq_entry *entry;
+
+    while ((entry = v->uv_jp_txq)) {
+	v->uv_jp_txq = entry->next;
+	free(entry);
+    }
+    v->uv_jp_txq_tail = NULL;
+    v->uv_jp_stats.queued = 0;
 }
 
 
@@ -2533,7 +2767,7 @@ int receive_pim_assert(u_int32 src, u_int32 dst __attribute__((unused)), char *p
             /* TODO: XXX: The spec doesn't say what entry timer value
              * to use when the routing entry is created because of asserts.
              */
-            SET_TIMER(mrtentry_ptr2->timer, PIM_DATA_TIMEOUT);
+            SET_MRT_TIMER(mrtentry_ptr2, timer, PIM_DATA_TIMEOUT);
             if (mrtentry_ptr2->flags & MRTF_RP) {
                 /* Either (*,G) or (S,G)RPbit entry.
                  * Get what we need from the RP info.
@@ -2574,8 +2808,8 @@ int receive_pim_assert(u_int32 src, u_int32 dst __attribute__((unused)), char *p
         /* Have to remove that outgoing vifi from mrtentry_ptr */
         VIFM_SET(vifi, mrtentry_ptr->asserted_oifs);
         /* TODO: XXX: TIMER implem. dependency! */
-        if (mrtentry_ptr->timer < PIM_ASSERT_TIMEOUT)
-            SET_TIMER(mrtentry_ptr->timer, PIM_ASSERT_TIMEOUT);
+        if (MRT_TIMER_LEFT(mrtentry_ptr->timer) < PIM_ASSERT_TIMEOUT)
+            SET_MRT_TIMER(mrtentry_ptr, timer, PIM_ASSERT_TIMEOUT);
         /* TODO: XXX: check that the timer of all affected routing entries
          * has been restarted.
          */
@@ -2629,7 +2863,7 @@ int receive_pim_assert(u_int32 src, u_int32 dst __attribute__((unused)), char *p
                 original_upstream_router = mrtentry_ptr->source->upstream;
         if (mrtentry_ptr->upstream != original_upstream_router) {
             mrtentry_ptr->flags |= MRTF_ASSERTED;
-            SET_TIMER(mrtentry_ptr->assert_timer, PIM_ASSERT_TIMEOUT);
+            SET_MRT_TIMER_MS(mrtentry_ptr, assert_timer, PIM_ASSERT_TIMEOUT * 1000);
         } else {
             mrtentry_ptr->flags &= ~MRTF_ASSERTED;
 	}
@@ -2829,19 +3063,12 @@ int receive_pim_bootstrap(u_int32 src, u_int32 dst, char *pim_message, int datal
             return FALSE;	/* Shoudn't arrive on that interface */
 
         /* Find the upstream router */
-        for (n = uvifs[incoming].uv_pim_neighbors; n != NULL; n = n->next) {
-            if (ntohl(neighbor_addr) < ntohl(n->address))
-                continue;
-
-            if (neighbor_addr == n->address) {
-                rpf_neighbor = n;
-                break;
-            }
-
+        n = find_vif_pim_nbr(incoming, neighbor_addr);
+        if (!n)
             return FALSE;	/* No neighbor toward BSR found */
-        }
+        rpf_neighbor = n;
 
-        if (!n || n->address != src)
+        if (n->address != src)
             return FALSE;	/* Sender of this message is not the RPF neighbor */
 
     } else {
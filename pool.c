@@ -0,0 +1,118 @@
+/*
+ * Fixed size object pools (slab allocator) for the routing table.
+ * See pool.h for details.
+ *
+ * The license for this file is the same as for the rest of pimd, see the
+ * file LICENSE in the top directory.
+ */
+
+#include "defs.h"
+
+/* Worst case alignment of the objects we keep in the pools */
+#define POOL_ALIGN		(sizeof(long) > sizeof(void *) ? sizeof(long) : sizeof(void *))
+#define POOL_ROUNDUP(x)		(((x) + POOL_ALIGN - 1) & ~(POOL_ALIGN - 1))
+
+/* The slab header, the objects follow right after it */
+struct pool_slab {
+    struct pool_slab *next;
+};
+#define POOL_SLAB_HDR		POOL_ROUNDUP(sizeof(struct pool_slab))
+
+static pool_t *pool_list;	/* all pools, for the dump */
+
+static int pool_grow(pool_t *pool);
+
+void pool_init(pool_t *pool, const char *name, size_t size)
+{
+    memset(pool, 0, sizeof(*pool));
+    pool->name = name;
+    pool->size = POOL_ROUNDUP(size < sizeof(void *) ? sizeof(void *) : size);
+    pool->per_slab = (POOL_SLAB_SIZE - POOL_SLAB_HDR) / pool->size;
+    if (pool->per_slab == 0)
+	pool->per_slab = 1;
+
+    pool->next = pool_list;
+    pool_list = pool;
+}
+
+/*
+ * Allocate a new slab and put all its objects on the free list.
+ */
+static int pool_grow(pool_t *pool)
+{
+    struct pool_slab *slab;
+    char *obj;
+    u_int32 i;
+
+    slab = (struct pool_slab *)malloc(POOL_SLAB_HDR + pool->per_slab * pool->size);
+    if (!slab)
+	return FALSE;
+
+    slab->next  = (struct pool_slab *)pool->slabs;
+    pool->slabs = slab;
+    pool->nslabs++;
+
+    obj = (char *)slab + POOL_SLAB_HDR;
+    for (i = 0; i < pool->per_slab; i++, obj += pool->size) {
+	*(void **)obj   = pool->free_list;
+	pool->free_list = obj;
+    }
+
+    return TRUE;
+}
+
+/*
+ * Returns a zeroed object, just like calloc(), or NULL if out of memory.
+ */
+void *pool_alloc(pool_t *pool)
+{
+    void *obj;
+
+    if (!pool->free_list && !pool_grow(pool)) {
+	logit(LOG_WARNING, 0, "Ran out of memory in pool_alloc(%s)", pool->name);
+	return NULL;
+    }
+
+    obj = pool->free_list;
+    pool->free_list = *(void **)obj;
+    memset(obj, 0, pool->size);
+
+    pool->allocs++;
+    if (++pool->in_use > pool->peak)
+	pool->peak = pool->in_use;
+
+    return obj;
+}
+
+void pool_free(pool_t *pool, void *obj)
+{
+    if (!obj)
+	return;
+
+    *(void **)obj   = pool->free_list;
+    pool->free_list = obj;
+
+    pool->frees++;
+    pool->in_use--;
+}
+
+void dump_pools(FILE *fp)
+{
+    pool_t *pool;
+
+    fprintf(fp, "Pool          Size  In use    Peak  Slabs      Allocs       Frees\n");
+    for (pool = pool_list; pool; pool = pool->next) {
+	fprintf(fp, "%-12s %5u %7u %7u %6u %11lu %11lu\n", pool->name,
+		(u_int)pool->size, pool->in_use, pool->peak, pool->nslabs,
+		pool->allocs, pool->frees);
+    }
+}
+
+/**
+ * Local Variables:
+ *  version-control: t
+ *  indent-tabs-mode: t
+ *  c-file-style: "ellemtel"
+ *  c-basic-offset: 4
+ * End:
+ */
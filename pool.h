@@ -0,0 +1,41 @@
+/*
+ * Fixed size object pools (slab allocator) for the routing table.
+ *
+ * Objects are carved out of large slabs and recycled through a free
+ * list, so the join/prune churn on the routing table does not go
+ * through malloc() for every entry.  Slabs are never given back to the
+ * system, the peak usage is reused instead.
+ *
+ * The license for this file is the same as for the rest of pimd, see the
+ * file LICENSE in the top directory.
+ */
+
+#ifndef __PIMD_POOL_H__
+#define __PIMD_POOL_H__
+
+typedef struct pool {
+    struct pool	*next;		/* link in the list of all pools	    */
+    const char	*name;		/* used for logging and in the dump	    */
+    size_t	 size;		/* object size, rounded up for alignment    */
+    u_int32	 per_slab;	/* number of objects per slab		    */
+    void	*free_list;	/* recycled objects			    */
+    void	*slabs;		/* list of all slabs of this pool	    */
+    u_int32	 nslabs;	/* number of slabs			    */
+    u_int32	 in_use;	/* objects currently allocated		    */
+    u_int32	 peak;		/* highest in_use ever			    */
+    u_long	 allocs;	/* total number of pool_alloc() calls	    */
+    u_long	 frees;		/* total number of pool_free() calls	    */
+} pool_t;
+
+#define POOL_SLAB_SIZE		16384	/* bytes per slab, including header */
+
+#endif /* __PIMD_POOL_H__ */
+
+/**
+ * Local Variables:
+ *  version-control: t
+ *  indent-tabs-mode: t
+ *  c-file-style: "ellemtel"
+ *  c-basic-offset: 4
+ * End:
+ */
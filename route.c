@@ -61,9 +61,12 @@
 static void   process_cache_miss  (struct igmpmsg *igmpctl);
 static void   process_wrong_iif   (struct igmpmsg *igmpctl);
 static void   process_whole_pkt   (char *buf);
+static void   neg_mfc_expire      (void *arg);
+static void   neg_mfc_miss        (u_int32 source, u_int32 group, vifi_t iif);
 
 u_int32		default_source_metric     = UCAST_DEFAULT_SOURCE_METRIC;
 u_int32		default_source_preference = UCAST_DEFAULT_SOURCE_PREFERENCE;
+u_int		upcall_source_rate        = 0;
 
 #ifdef SCOPED_ACL
 /* from mrouted. Contributed by Marian Stagarescu <marian@bile.cidera.com>*/
@@ -122,13 +125,9 @@ pim_nbr_entry_t *find_pim_nbr(u_int32 source)
         return NULL;
 
     next_hop_router_addr = rpfc.rpfneighbor.s_addr;
-    for (pim_nbr = uvifs[rpfc.iif].uv_pim_neighbors;
-         pim_nbr != NULL;
-         pim_nbr = pim_nbr->next)
-        if (pim_nbr->address == next_hop_router_addr)
-            return(pim_nbr);
+    pim_nbr = find_vif_pim_nbr(rpfc.iif, next_hop_router_addr);
 
-    return NULL;
+    return pim_nbr;
 }
 
 
@@ -210,27 +209,20 @@ int set_incoming(srcentry_t *srcentry_ptr, int srctype)
      * The upstream router must be a (PIM router) neighbor, otherwise we
      * are in big trouble ;-)
      */
-    v = &uvifs[srcentry_ptr->incoming];
-    for (n = v->uv_pim_neighbors; n != NULL; n = n->next) {
-        if (ntohl(neighbor_addr) < ntohl(n->address))
-            continue;
-
-        if (neighbor_addr == n->address) {
-            /*
-             *The upstream router is found in the list of neighbors.
-             * We are safe!
-             */
-            srcentry_ptr->upstream = n;
-            IF_DEBUG(DEBUG_RPF)
-                logit(LOG_DEBUG, 0,
-                      "For src %s, iif is %d, next hop router is %s",
-                      inet_fmt(source, s1, sizeof(s1)), srcentry_ptr->incoming,
-                      inet_fmt(neighbor_addr, s2, sizeof(s2)));
-
-            return TRUE;
-        }
+    n = find_vif_pim_nbr(srcentry_ptr->incoming, neighbor_addr);
+    if (n != NULL) {
+        /*
+         *The upstream router is found in the list of neighbors.
+         * We are safe!
+         */
+        srcentry_ptr->upstream = n;
+        IF_DEBUG(DEBUG_RPF)
+            logit(LOG_DEBUG, 0,
+                  "For src %s, iif is %d, next hop router is %s",
+                  inet_fmt(source, s1, sizeof(s1)), srcentry_ptr->incoming,
+                  inet_fmt(neighbor_addr, s2, sizeof(s2)));
 
-	break;
+        return TRUE;
     }
 
     /* TODO: control the number of messages! */
@@ -311,7 +303,7 @@ void add_leaf(vifi_t vifi, u_int32 source __attribute__((unused)), u_int32 group
          * from NULL to non-NULL.
          */
         mrtentry_ptr->flags &= ~MRTF_NEW;
-        FIRE_TIMER(mrtentry_ptr->jp_timer); /* Timeout the Join/Prune timer */
+        FIRE_MRT_TIMER(mrtentry_ptr, jp_timer); /* Timeout the Join/Prune timer */
         /* TODO: explicitly call the function below?
            send_pim_join_prune(mrtentry_ptr->upstream->vifi,
            mrtentry_ptr->upstream,
@@ -370,7 +362,7 @@ void delete_leaf(vifi_t vifi, u_int32 source __attribute__((unused)), u_int32 gr
     calc_oifs(mrtentry_ptr, &new_oifs);
     if ((!VIFM_ISEMPTY(old_oifs)) && VIFM_ISEMPTY(new_oifs)) {
         /* The result oifs have changed from non-NULL to NULL */
-        FIRE_TIMER(mrtentry_ptr->jp_timer);  /* Timeout the Join/Prune timer */
+        FIRE_MRT_TIMER(mrtentry_ptr, jp_timer);  /* Timeout the Join/Prune timer */
         /* TODO: explicitly call the function?
            send_pim_join_prune(mrtentry_ptr->upstream->vifi,
            mrtentry_ptr->upstream, PIM_JOIN_PRUNE_HOLDTIME);
@@ -505,6 +497,10 @@ int change_interfaces(mrtentry_t *mrtentry_ptr,
     VIFM_COPY(new_asserted_oifs, mrtentry_ptr->asserted_oifs);
     calc_oifs(mrtentry_ptr, &new_real_oifs);
 
+    /* An expired entry is deleted once it has no leaves, age it again */
+    if (!VIFM_SAME(old_leaves, new_leaves) && MRT_TIMEOUT(mrtentry_ptr->timer))
+        schedule_mrtentry(mrtentry_ptr, 0);
+
     if (VIFM_ISEMPTY(old_real_oifs)) {
         if (VIFM_ISEMPTY(new_real_oifs))
             return_value = 0;
@@ -523,7 +519,7 @@ int change_interfaces(mrtentry_t *mrtentry_ptr,
         return 0;                  /* Nothing to change */
 
     if ((return_value != 0) || (new_iif != old_iif) || (flags & MFC_UPDATE_FORCE)) {
-        FIRE_TIMER(mrtentry_ptr->jp_timer);
+        FIRE_MRT_TIMER(mrtentry_ptr, jp_timer);
     }
     VIFM_COPY(new_real_oifs, mrtentry_ptr->oifs);
 
@@ -551,10 +547,7 @@ int change_interfaces(mrtentry_t *mrtentry_ptr,
                 /* XXX: no need to send RSRR message. Will do it when
                  * delete the mrtentry.
                  */
-                for (kernel_cache_ptr = mrtentry_ptr->kernel_cache;
-                     kernel_cache_ptr != NULL;
-                     kernel_cache_ptr = kernel_cache_ptr->next)
-                    delete_mrtentry_all_kernel_cache(mrtentry_ptr);
+                delete_mrtentry_all_kernel_cache(mrtentry_ptr);
 	    } else {
                 for (kernel_cache_ptr = mrtentry_ptr->kernel_cache;
                      kernel_cache_ptr != NULL;
@@ -614,7 +607,7 @@ int change_interfaces(mrtentry_t *mrtentry_ptr,
             }
         }
         if (fire_timer_flag == TRUE)
-            FIRE_TIMER(mrtentry_ptr->jp_timer);
+            FIRE_MRT_TIMER(mrtentry_ptr, jp_timer);
         if (delete_mrtentry_flag == TRUE) {
             /* TODO: XXX: trigger a Prune message? Don't delete now, it will
              * be automatically timed out. If want to delete now, don't
@@ -675,7 +668,7 @@ int change_interfaces(mrtentry_t *mrtentry_ptr,
         }
 
         if (fire_timer_flag == TRUE)
-            FIRE_TIMER(mrtentry_ptr->jp_timer);
+            FIRE_MRT_TIMER(mrtentry_ptr, jp_timer);
 
         if (delete_mrtentry_flag == TRUE) {
             /* TODO: XXX: the oifs are NULL. Send a Prune message? */
@@ -792,12 +785,552 @@ int delete_vif_from_mrt(vifi_t vifi __attribute__((unused)))
 }
 
 
+/*
+ * Negative MFC cache.  A sender to a group nobody has asked for makes
+ * the kernel upcall for each packet, or on Linux each time its
+ * unresolved entry times out, and every one of those upcalls ends up in
+ * find_route() for nothing.  Once an (S,G) has missed NEG_MFC_MISSES
+ * times within NEG_MFC_WINDOW seconds, it gets an MFC entry without
+ * outgoing interfaces and the kernel drops its packets quietly.
+ *
+ * The entry is checked after NEG_MFC_MIN_LIFE seconds.  If the kernel
+ * counters show it still drops traffic its lifetime is doubled, up to
+ * NEG_MFC_MAX_LIFE, otherwise it is removed.  New routing state for the
+ * group removes its entries at once, see create_mrtentry(), so the next
+ * packet misses again and is routed as usual.
+ */
+typedef struct neg_grp {
+    hash_entry_t     hash;	/* in neg_grp_hash, keyed by the group	    */
+    struct neg_grp  *next;	/* all groups, for neg_mfc_clear()	    */
+    struct neg_grp  *prev;
+    struct neg_mfc  *sources;	/* the tracked sources of the group	    */
+} neg_grp_t;
+
+typedef struct neg_mfc {
+    hash_entry_t     hash;	/* in neg_mfc_hash, keyed by (S,G)	    */
+    struct neg_mfc  *next;	/* the other sources of the group	    */
+    struct neg_mfc  *prev;
+    neg_grp_t	    *grp;
+    u_int32	     source;
+    u_int32	     group;
+    vifi_t	     iif;
+    u_int16	     misses;	/* cache misses in the current window	    */
+    u_int16	     lifetime;	/* seconds, 0 until installed in the kernel */
+    u_long	     pktcnt;	/* packets dropped, as last read	    */
+    int		     timer;	/* end of the window, or of the lifetime    */
+} neg_mfc_t;
+
+/* Callout data, freed by timer_clearTimer() or the callout itself */
+typedef struct neg_mfc_cbk {
+    neg_mfc_t	    *n;
+} neg_mfc_cbk_t;
+
+static pool_t       neg_grp_pool;
+static pool_t       neg_mfc_pool;
+static hash_table_t neg_grp_hash;
+static hash_table_t neg_mfc_hash;
+static neg_grp_t   *neg_grp_list;
+
+static struct {
+    u_int32	 installed;	/* negative entries in the kernel now	    */
+    u_long	 tracked;	/* (S,G) seen missing			    */
+    u_long	 installs;	/* negative entries added		    */
+    u_long	 extended;	/* lifetime doubled, still dropping	    */
+    u_long	 expired;	/* removed when idle			    */
+    u_long	 cleared;	/* removed for new routing state	    */
+    u_long	 full;		/* not tracked, NEG_MFC_MAX reached	    */
+    u_long	 suppressed;	/* packets dropped instead of upcalled	    */
+} neg_mfc_stats;
+
+static neg_mfc_t *neg_mfc_alloc(u_int32 source, u_int32 group)
+{
+    neg_grp_t *g;
+    neg_mfc_t *n;
+
+    g = (neg_grp_t *)hash_find(&neg_grp_hash, group, INADDR_ANY_N);
+    if (g == NULL) {
+	g = (neg_grp_t *)pool_alloc(&neg_grp_pool);
+	if (g == NULL)
+	    return NULL;
+	hash_insert(&neg_grp_hash, &g->hash, group, INADDR_ANY_N, g);
+	g->next = neg_grp_list;
+	if (neg_grp_list != NULL)
+	    neg_grp_list->prev = g;
+	neg_grp_list = g;
+    }
+
+    n = (neg_mfc_t *)pool_alloc(&neg_mfc_pool);
+    if (n == NULL) {
+	if (g->sources == NULL) {
+	    hash_remove(&neg_grp_hash, &g->hash);
+	    neg_grp_list = g->next;
+	    if (g->next != NULL)
+		g->next->prev = NULL;
+	    pool_free(&neg_grp_pool, g);
+	}
+	return NULL;
+    }
+    n->source = source;
+    n->group  = group;
+    n->grp    = g;
+    n->next   = g->sources;
+    if (g->sources != NULL)
+	g->sources->prev = n;
+    g->sources = n;
+    hash_insert(&neg_mfc_hash, &n->hash, source, group, n);
+
+    return n;
+}
+
+/*
+ * Forget about an (S,G), the group goes too with its last source.
+ */
+static void neg_mfc_free(neg_mfc_t *n)
+{
+    neg_grp_t *g = n->grp;
+
+    hash_remove(&neg_mfc_hash, &n->hash);
+    if (n->prev != NULL)
+	n->prev->next = n->next;
+    else
+	g->sources = n->next;
+    if (n->next != NULL)
+	n->next->prev = n->prev;
+    pool_free(&neg_mfc_pool, n);
+
+    if (g->sources != NULL)
+	return;
+
+    hash_remove(&neg_grp_hash, &g->hash);
+    if (g->prev != NULL)
+	g->prev->next = g->next;
+    else
+	neg_grp_list = g->next;
+    if (g->next != NULL)
+	g->next->prev = g->prev;
+    pool_free(&neg_grp_pool, g);
+}
+
+void init_neg_mfc(void)
+{
+    if (!neg_mfc_pool.size) {
+	pool_init(&neg_grp_pool, "neg_grp", sizeof(neg_grp_t));
+	pool_init(&neg_mfc_pool, "neg_mfc", sizeof(neg_mfc_t));
+	hash_init(&neg_grp_hash, "Negative group", HASH_DEFAULT_SIZE);
+	hash_init(&neg_mfc_hash, "Negative (S,G)", HASH_DEFAULT_SIZE);
+	return;
+    }
+
+    /* Restarting, the kernel entries and the callouts are gone already */
+    while (neg_grp_list != NULL)
+	neg_mfc_free(neg_grp_list->sources);
+    neg_mfc_stats.installed = 0;
+}
+
+static int neg_mfc_timer(neg_mfc_t *n, int delay)
+{
+    neg_mfc_cbk_t *cbk;
+
+    cbk = (neg_mfc_cbk_t *)calloc(1, sizeof(neg_mfc_cbk_t));
+    if (!cbk) {
+	logit(LOG_WARNING, 0, "Ran out of memory in neg_mfc_timer()");
+	return 0;
+    }
+    cbk->n = n;
+
+    return timer_setTimer(delay, neg_mfc_expire, cbk);
+}
+
+/*
+ * Returns the number of packets the kernel entry has dropped since the
+ * last call, and adds them to the suppressed upcalls.
+ */
+static u_long neg_mfc_count(neg_mfc_t *n)
+{
+    struct sg_count sgc;
+    u_long delta;
+
+    /* The entry may still be queued for the kernel */
+    k_flush_mfc();
+    if (k_get_sg_cnt(udp_socket, n->source, n->group, &sgc))
+	return 0;
+
+    delta = sgc.pktcnt - n->pktcnt;
+    n->pktcnt = sgc.pktcnt;
+    neg_mfc_stats.suppressed += delta;
+
+    return delta;
+}
+
+/*
+ * Remove the kernel entry, if any, and forget about the (S,G).
+ */
+static void neg_mfc_remove(neg_mfc_t *n)
+{
+    timer_clearTimer(n->timer);
+
+    if (n->lifetime) {
+	neg_mfc_count(n);
+	k_del_mfc(igmp_socket, n->source, n->group);
+	neg_mfc_stats.installed--;
+
+	IF_DEBUG(DEBUG_MFC)
+	    logit(LOG_DEBUG, 0, "Removed negative MFC entry src %s, grp %s, %lu packets dropped",
+		  inet_fmt(n->source, s1, sizeof(s1)), inet_fmt(n->group, s2, sizeof(s2)),
+		  n->pktcnt);
+    }
+
+    neg_mfc_free(n);
+}
+
+/*
+ * Would the (S,G) be routed if it missed now, see process_cache_miss().
+ * Catches what neg_mfc_clear() is not told about, e.g., a DR change.
+ */
+static int neg_mfc_routable(neg_mfc_t *n)
+{
+    if ((uvifs[n->iif].uv_flags & VIFF_DR) && (find_vif_direct_local(n->source) == n->iif))
+	return rp_grp_match(n->group) != NULL;
+
+    return find_route(n->source, n->group, MRTF_SG | MRTF_WC | MRTF_PMBR, DONT_CREATE) != NULL;
+}
+
+static void neg_mfc_expire(void *arg)
+{
+    neg_mfc_cbk_t *cbk = (neg_mfc_cbk_t *)arg;
+    neg_mfc_t *n = cbk->n;
+
+    free(cbk);
+    n->timer = 0;
+
+    if (n->lifetime) {
+	if (neg_mfc_count(n) && !neg_mfc_routable(n)) {
+	    /* Still dropping traffic, keep it for longer */
+	    if (n->lifetime < NEG_MFC_MAX_LIFE)
+		n->lifetime *= 2;
+	    n->timer = neg_mfc_timer(n, n->lifetime);
+	    if (n->timer > 0) {
+		neg_mfc_stats.extended++;
+		return;
+	    }
+	}
+	neg_mfc_stats.expired++;
+    }
+
+    neg_mfc_remove(n);
+}
+
+/*
+ * A cache miss for an (S,G) without any routing state.
+ */
+static void neg_mfc_miss(u_int32 source, u_int32 group, vifi_t iif)
+{
+    neg_mfc_t *n;
+    vifbitmap_t oifs;
+
+    n = (neg_mfc_t *)hash_find(&neg_mfc_hash, source, group);
+    if (n == NULL) {
+	if (neg_mfc_pool.in_use >= NEG_MFC_MAX) {
+	    neg_mfc_stats.full++;
+	    return;
+	}
+	n = neg_mfc_alloc(source, group);
+	if (n == NULL)
+	    return;
+	n->timer = neg_mfc_timer(n, NEG_MFC_WINDOW);
+	if (n->timer <= 0) {
+	    neg_mfc_free(n);
+	    return;
+	}
+	neg_mfc_stats.tracked++;
+    }
+
+    /* Upcalls queued before the entry was installed */
+    if (n->lifetime)
+	return;
+
+    n->iif = iif;
+    if (++n->misses < NEG_MFC_MISSES)
+	return;
+
+    timer_clearTimer(n->timer);
+    n->timer = 0;
+
+    VIFM_CLRALL(oifs);
+    if (!k_chg_mfc(igmp_socket, source, group, iif, oifs, INADDR_ANY_N)) {
+	neg_mfc_free(n);
+	return;
+    }
+    n->lifetime = NEG_MFC_MIN_LIFE;
+    neg_mfc_stats.installed++;
+    neg_mfc_stats.installs++;
+
+    IF_DEBUG(DEBUG_MFC)
+	logit(LOG_DEBUG, 0, "Installed negative MFC entry src %s, grp %s, iif %d after %u misses",
+	      inet_fmt(source, s1, sizeof(s1)), inet_fmt(group, s2, sizeof(s2)), iif, n->misses);
+
+    n->timer = neg_mfc_timer(n, n->lifetime);
+    if (n->timer <= 0)
+	neg_mfc_remove(n);
+}
+
+/*
+ * New routing state covers the (S,G), or with source INADDR_ANY_N all
+ * sources of the group, or with both INADDR_ANY_N everything.  Remove
+ * the negative entries, the traffic must miss again to be routed.
+ */
+void neg_mfc_clear(u_int32 source, u_int32 group)
+{
+    neg_grp_t *g;
+    neg_mfc_t *n;
+
+    if (neg_mfc_hash.count == 0)
+	return;
+
+    for (;;) {
+	if (group == INADDR_ANY_N)
+	    g = neg_grp_list;
+	else
+	    g = (neg_grp_t *)hash_find(&neg_grp_hash, group, INADDR_ANY_N);
+	if (g == NULL)
+	    return;
+
+	if (source == INADDR_ANY_N) {
+	    n = g->sources;
+	} else {
+	    n = (neg_mfc_t *)hash_find(&neg_mfc_hash, source, group);
+	    if (n == NULL)
+		return;
+	}
+
+	if (n->lifetime)
+	    neg_mfc_stats.cleared++;
+	neg_mfc_remove(n);
+    }
+}
+
+/*
+ * A new RP mapping for group/mask, remove the negative entries of the
+ * groups it covers.
+ */
+void neg_mfc_clear_prefix(u_int32 group, u_int32 mask)
+{
+    neg_grp_t *g, *g_next;
+    neg_mfc_t *n, *n_next;
+
+    for (g = neg_grp_list; g != NULL; g = g_next) {
+	g_next = g->next;
+	if ((g->sources->group & mask) != (group & mask))
+	    continue;
+
+	/* The last neg_mfc_remove() frees g too */
+	for (n = g->sources; n != NULL; n = n_next) {
+	    n_next = n->next;
+	    if (n->lifetime)
+		neg_mfc_stats.cleared++;
+	    neg_mfc_remove(n);
+	}
+    }
+}
+
+void dump_neg_mfc(FILE *fp)
+{
+    fprintf(fp, "Negative MFC  Tracked  Installed    Installs  Extended   Expired   Cleared   Full  Suppressed\n");
+    fprintf(fp, "%-12s %8u %10u %11lu %9lu %9lu %9lu %6lu %11lu\n\n", "Kernel",
+	    neg_mfc_pool.in_use, neg_mfc_stats.installed, neg_mfc_stats.installs,
+	    neg_mfc_stats.extended, neg_mfc_stats.expired, neg_mfc_stats.cleared,
+	    neg_mfc_stats.full, neg_mfc_stats.suppressed);
+}
+
+
+/*
+ * Upcall throttling.  A host spraying packets at many groups, or from
+ * many spoofed sources, makes the kernel upcall for each new flow, and
+ * every NOCACHE or WRONGVIF upcall costs route lookups, maybe an Assert
+ * or a Register.  Two token buckets cap that work before any of it is
+ * done: one per incoming vif, the phyint upcall_rate, and one per
+ * source, the upcall_source_rate.  As for the J/P rate in pim_proto.c
+ * the tokens are kept in 1/1000 units and each bucket holds up to one
+ * second worth of them.  A rate of 0 means no limit.
+ *
+ * Upcalls over the limit are dropped.  The kernel reports the flow
+ * again, on Linux when its unresolved entry times out, so the flow is
+ * deferred rather than lost.  The source buckets are recycled in LRU
+ * order beyond UPCALL_SRC_MAX sources.
+ */
+typedef struct upcall_src {
+    hash_entry_t       hash;	/* in upcall_src_hash, keyed by source	    */
+    struct upcall_src *next;	/* LRU list, most recently used first	    */
+    struct upcall_src *prev;
+    u_int32	       source;
+    u_int32	       tokens;	/* in 1/1000 of an upcall		    */
+    u_int32	       refill;	/* callout clock at the last refill	    */
+} upcall_src_t;
+
+static pool_t        upcall_src_pool;
+static hash_table_t  upcall_src_hash;
+static upcall_src_t *upcall_src_head;
+static upcall_src_t *upcall_src_tail;
+
+static struct {
+    u_long	 passed;	/* upcalls processed			    */
+    u_long	 vif_dropped;	/* over the rate of the incoming vif	    */
+    u_long	 src_dropped;	/* over the rate of the source		    */
+    u_long	 recycled;	/* source buckets reused for another source */
+} upcall_stats;
+
+static void upcall_refill(u_int32 *tokens, u_int32 *refill, u_int rate, u_int32 now)
+{
+    u_int32 elapsed = now - *refill;
+
+    *refill = now;
+    if (elapsed > 1000)
+	elapsed = 1000;
+
+    *tokens += rate * elapsed;
+    if (*tokens > rate * 1000)
+	*tokens = rate * 1000;
+}
+
+static void upcall_src_unlink(upcall_src_t *u)
+{
+    if (u->prev != NULL)
+	u->prev->next = u->next;
+    else
+	upcall_src_head = u->next;
+    if (u->next != NULL)
+	u->next->prev = u->prev;
+    else
+	upcall_src_tail = u->prev;
+}
+
+/*
+ * Returns the bucket of the source, a new one starts full.
+ */
+static upcall_src_t *upcall_src_get(u_int32 source, u_int32 now)
+{
+    upcall_src_t *u;
+
+    if (!upcall_src_pool.size) {
+	pool_init(&upcall_src_pool, "upcall_src", sizeof(upcall_src_t));
+	hash_init(&upcall_src_hash, "Upcall source", HASH_DEFAULT_SIZE);
+    }
+
+    u = (upcall_src_t *)hash_find(&upcall_src_hash, source, INADDR_ANY_N);
+    if (u != NULL) {
+	if (u == upcall_src_head)
+	    return u;
+	upcall_src_unlink(u);
+    } else {
+	if (upcall_src_pool.in_use >= UPCALL_SRC_MAX) {
+	    /* Recycle the least recently used one */
+	    u = upcall_src_tail;
+	    upcall_src_unlink(u);
+	    hash_remove(&upcall_src_hash, &u->hash);
+	    upcall_stats.recycled++;
+	} else {
+	    u = (upcall_src_t *)pool_alloc(&upcall_src_pool);
+	    if (u == NULL)
+		return NULL;
+	}
+	u->source = source;
+	u->tokens = upcall_source_rate * 1000;
+	u->refill = now;
+	hash_insert(&upcall_src_hash, &u->hash, source, INADDR_ANY_N, u);
+    }
+
+    /* Most recently used first */
+    u->prev = NULL;
+    u->next = upcall_src_head;
+    if (upcall_src_head != NULL)
+	upcall_src_head->prev = u;
+    else
+	upcall_src_tail = u;
+    upcall_src_head = u;
+
+    return u;
+}
+
+/*
+ * Returns TRUE if the upcall may be processed, and takes its tokens.
+ */
+static int upcall_admit(struct igmpmsg *igmpctl)
+{
+    vifi_t vifi = igmpctl->im_vif;
+    struct uvif *v;
+    upcall_src_t *u = NULL;
+    u_int32 now;
+
+    if (vifi >= numvifs)
+	return TRUE;
+    v = &uvifs[vifi];
+
+    if (v->uv_upcall_rate || upcall_source_rate) {
+	now = callout_clock();
+
+	if (v->uv_upcall_rate) {
+	    upcall_refill(&v->uv_upcall_tokens, &v->uv_upcall_refill, v->uv_upcall_rate, now);
+	    if (v->uv_upcall_tokens < 1000) {
+		v->uv_upcall_dropped++;
+		upcall_stats.vif_dropped++;
+		return FALSE;
+	    }
+	}
+
+	if (upcall_source_rate) {
+	    u = upcall_src_get(igmpctl->im_src.s_addr, now);
+	    if (u != NULL) {
+		upcall_refill(&u->tokens, &u->refill, upcall_source_rate, now);
+		if (u->tokens < 1000) {
+		    v->uv_upcall_dropped++;
+		    upcall_stats.src_dropped++;
+		    return FALSE;
+		}
+		u->tokens -= 1000;
+	    }
+	}
+
+	if (v->uv_upcall_rate)
+	    v->uv_upcall_tokens -= 1000;
+    }
+
+    v->uv_upcall_passed++;
+    upcall_stats.passed++;
+
+    return TRUE;
+}
+
+void dump_upcall_limit(FILE *fp)
+{
+    vifi_t vifi;
+    struct uvif *v;
+
+    fprintf(fp, "Upcall limit  Src rate  Sources      Passed  Vif drops  Src drops  Recycled\n");
+    fprintf(fp, "%-12s %9u %8u %11lu %10lu %10lu %9lu\n", "Kernel",
+	    upcall_source_rate, upcall_src_pool.in_use, upcall_stats.passed,
+	    upcall_stats.vif_dropped, upcall_stats.src_dropped, upcall_stats.recycled);
+    fprintf(fp, " %-3s  %6s %11s %10s\n", "Vif", "Rate", "Passed", "Dropped");
+    for (vifi = 0, v = uvifs; vifi < numvifs; ++vifi, ++v) {
+	if (!v->uv_upcall_passed && !v->uv_upcall_dropped && !v->uv_upcall_rate)
+	    continue;
+	fprintf(fp, " %3u  %6u %11lu %10lu\n", vifi, v->uv_upcall_rate,
+		v->uv_upcall_passed, v->uv_upcall_dropped);
+    }
+    fprintf(fp, "\n");
+}
+
+
 void process_kernel_call(void)
 {
     struct igmpmsg *igmpctl; /* igmpmsg control struct */
 
     igmpctl = (struct igmpmsg *) igmp_recv_buf;
 
+    /* Throttled before any MRT work, see upcall_admit() */
+    if ((igmpctl->im_msgtype == IGMPMSG_NOCACHE || igmpctl->im_msgtype == IGMPMSG_WRONGVIF)
+        && !upcall_admit(igmpctl))
+        return;
+
     switch (igmpctl->im_msgtype) {
         case IGMPMSG_NOCACHE:
             process_cache_miss(igmpctl);
@@ -843,6 +1376,9 @@ static void process_cache_miss(struct igmpmsg *igmpctl)
               inet_fmt(source, s1, sizeof(s1)), inet_fmt(group, s2, sizeof(s2)), iif);
     }
 
+    /* Whatever was installed for it, the kernel has no entry now */
+    k_forget_mfc(source, group);
+
     /* TODO: XXX: check whether the kernel generates cache miss for the LAN scoped addresses */
     if (ntohl(group) <= INADDR_MAX_LOCAL_GROUP)
         return; /* Don't create routing entries for the LAN scoped addresses */
@@ -853,8 +1389,11 @@ static void process_cache_miss(struct igmpmsg *igmpctl)
      */
     if ((uvifs[iif].uv_flags & VIFF_DR) && (find_vif_direct_local(source) == iif)) {
         mrtentry_ptr = find_route(source, group, MRTF_SG, CREATE);
-        if (mrtentry_ptr == NULL)
+        if (mrtentry_ptr == NULL) {
+            /* No RP for the group yet */
+            neg_mfc_miss(source, group, iif);
             return;
+        }
 
         mrtentry_ptr->flags &= ~MRTF_NEW;
         /* set reg_vif_num as outgoing interface ONLY if I am not the RP */
@@ -868,22 +1407,20 @@ static void process_cache_miss(struct igmpmsg *igmpctl)
                           mrtentry_ptr->asserted_oifs, 0);
     } else {
         mrtentry_ptr = find_route(source, group, MRTF_SG | MRTF_WC | MRTF_PMBR, DONT_CREATE);
-        if (mrtentry_ptr == NULL)
+        if (mrtentry_ptr == NULL) {
+            /* Too many of these and the kernel drops them instead */
+            neg_mfc_miss(source, group, iif);
             return;
+        }
     }
 
-    /* TODO: if there are too many cache miss for the same (S,G), install
-     * negative cache entry in the kernel (oif==NULL) to prevent too
-     * many upcalls.
-     */
-
     if (mrtentry_ptr->incoming == iif) {
         if (!VIFM_ISEMPTY(mrtentry_ptr->oifs)) {
             if (mrtentry_ptr->flags & MRTF_SG) {
                 /* TODO: check that the RPbit is not set? */
                 /* TODO: XXX: TIMER implem. dependency! */
-                if (mrtentry_ptr->timer < PIM_DATA_TIMEOUT)
-                    SET_TIMER(mrtentry_ptr->timer, PIM_DATA_TIMEOUT);
+                if (MRT_TIMER_LEFT(mrtentry_ptr->timer) < PIM_DATA_TIMEOUT)
+                    SET_MRT_TIMER(mrtentry_ptr, timer, PIM_DATA_TIMEOUT);
                 if (!(mrtentry_ptr->flags & MRTF_SPT)) {
                     if ((mrtentry_rp = mrtentry_ptr->group->grp_route) == NULL)
                         mrtentry_rp = mrtentry_ptr->group->active_rp_grp->rp->rpentry->mrtlink;
@@ -1005,7 +1542,7 @@ static void process_wrong_iif(struct igmpmsg *igmpctl)
                 add_kernel_cache(mrtentry_ptr, source, group, MFC_MOVE_FORCE);
                 k_chg_mfc(igmp_socket, source, group, iif,
                           mrtentry_ptr->oifs, mrtentry_ptr->group->rpaddr);
-                FIRE_TIMER(mrtentry_ptr->jp_timer);
+                FIRE_MRT_TIMER(mrtentry_ptr, jp_timer);
 #ifdef RSRR
                 rsrr_cache_send(mrtentry_ptr, RSRR_NOTIFICATION_OK);
 #endif /* RSRR */
@@ -1059,8 +1596,8 @@ mrtentry_t *switch_shortest_path(u_int32 source, u_int32 group)
                               mrtentry_ptr->asserted_oifs, 0);
         }
 
-        SET_TIMER(mrtentry_ptr->timer, PIM_DATA_TIMEOUT);
-        FIRE_TIMER(mrtentry_ptr->jp_timer);
+        SET_MRT_TIMER(mrtentry_ptr, timer, PIM_DATA_TIMEOUT);
+        FIRE_MRT_TIMER(mrtentry_ptr, jp_timer);
     }
 
     return mrtentry_ptr;
@@ -40,8 +40,31 @@
 #define RP_HASH_VALUE(G, M, C) (((SEED1) * (((SEED1) * ((G) & (M)) + (SEED2)) ^ (C)) + (SEED2)) % 0x80000000)
 
 cand_rp_t               *cand_rp_list;
+hash_table_t            rphash;                 /* Index of the RP entries
+						 * in cand_rp_list */
 grp_mask_t              *grp_mask_list;
+static grp_mask_node_t  *grp_mask_trie;         /* Index of grp_mask_list */
+u_int32                 grp_mask_trie_nodes;
+u_int32                 rp_set_generation = 1;  /* Bumped on RP-set changes */
+u_long                  rp_match_cache_hits;
+u_long                  rp_match_cache_misses;
+
+/*
+ * Direct mapped cache of the group-to-RP elections.  A slot is only valid
+ * if it was filled with the current rp_set_generation, so flushing the
+ * whole cache is just incrementing the generation.
+ */
+#define RP_MATCH_CACHE_SIZE	1024	/* Must be a power of 2 */
+#define RP_MATCH_CACHE_INDEX(group_h) \
+    (((group_h) ^ ((group_h) >> 10) ^ ((group_h) >> 20)) & (RP_MATCH_CACHE_SIZE - 1))
+static struct {
+    u_int32	    group;
+    u_int32	    generation;
+    rp_grp_entry_t *entry;		/* NULL if no RP matches the group */
+} rp_match_cache[RP_MATCH_CACHE_SIZE];
 cand_rp_t               *segmented_cand_rp_list;
+static hash_table_t     segmented_rphash;       /* Same for the segmented
+						 * list */
 grp_mask_t              *segmented_grp_mask_list;
 u_int16                 curr_bsr_fragment_tag;
 u_int8                  curr_bsr_priority;
@@ -80,6 +103,12 @@ static void       delete_grp_mask_entry (cand_rp_t **used_cand_rp_list,
 static void       delete_rp_entry       (cand_rp_t **used_cand_rp_list,
                                          grp_mask_t **used_grp_mask_list,
                                          cand_rp_t *cand_rp_ptr);
+static hash_table_t *rp_hash_of         (cand_rp_t **used_cand_rp_list);
+static void       grp_mask_trie_insert  (grp_mask_t *mask_ptr);
+static void       grp_mask_trie_remove  (grp_mask_t *mask_ptr);
+static void       grp_mask_trie_free    (grp_mask_node_t *node);
+static void       rp_set_changed        (grp_mask_t **used_grp_mask_list);
+static rp_grp_entry_t *rp_grp_lookup    (u_int32 group);
 
 
 void init_rp_and_bsr(void)
@@ -87,6 +116,10 @@ void init_rp_and_bsr(void)
     /* TODO: if the grplist is not NULL, remap all groups ASAP! */
     delete_rp_list(&cand_rp_list, &grp_mask_list);
     delete_rp_list(&segmented_cand_rp_list, &segmented_grp_mask_list);
+    hash_free(&rphash);
+    hash_init(&rphash, "RP", HASH_DEFAULT_SIZE);
+    hash_free(&segmented_rphash);
+    hash_init(&segmented_rphash, "Segmented RP", HASH_DEFAULT_SIZE);
 
     if (cand_bsr_flag == FALSE) {
 	/*
@@ -171,40 +204,41 @@ u_int16 bootstrap_initial_delay(void)
 
     return (u_int16)delay;
 }
+
+
+/*
+ * Each RP list has its own index, only the active RP-set is used by
+ * rp_find().
+ */
+static hash_table_t *rp_hash_of(cand_rp_t **used_cand_rp_list)
+{
+    if (used_cand_rp_list == &cand_rp_list)
+	return &rphash;
+
+    return &segmented_rphash;
+}
     
 
 static cand_rp_t *add_cand_rp(cand_rp_t **used_cand_rp_list, u_int32 address)
 {
-    cand_rp_t *prev = NULL;
-    cand_rp_t *next;
     cand_rp_t *ptr;
     rpentry_t *entry;
-    u_int32 addr_h = ntohl(address);
+    hash_table_t *tbl = rp_hash_of(used_cand_rp_list);
     
-    /* The ordering is the bigger first */
-    for (next = *used_cand_rp_list; next; prev = next, next = next->next) {
-	if (ntohl(next->rpentry->address) > addr_h)
-	    continue;
-
-	if (next->rpentry->address == address)
-	    return next;
-	else
-	    break;
-    }
+    entry = (rpentry_t *)hash_find(tbl, address, INADDR_ANY_N);
+    if (entry)
+	return entry->cand_rp;
     
-    /* Create and insert the new entry between prev and next */
+    /* The list is not ordered, insert the new entry at the head */
     ptr = (cand_rp_t *)calloc(1, sizeof(cand_rp_t));
     if (!ptr)
 	logit(LOG_ERR, 0, "Ran out of memory in add_cand_rp()");
     ptr->rp_grp_next = NULL;
-    ptr->next = next;
-    ptr->prev = prev;
-    if (next)
-	next->prev = ptr;
-    if (prev == NULL)
-	*used_cand_rp_list = ptr;
-    else
-	prev->next = ptr;
+    ptr->next = *used_cand_rp_list;
+    ptr->prev = NULL;
+    if (ptr->next)
+	ptr->next->prev = ptr;
+    *used_cand_rp_list = ptr;
 
     entry = (rpentry_t *)calloc(1, sizeof(rpentry_t));
     if (!entry)
@@ -221,6 +255,7 @@ static cand_rp_t *add_cand_rp(cand_rp_t **used_cand_rp_list, u_int32 address)
     entry->preference = ~0;
     RESET_TIMER(entry->timer);
     entry->cand_rp = ptr;
+    hash_insert(tbl, &entry->hash, address, INADDR_ANY_N, entry);
 
     /* TODO: XXX: check whether there is a route to that RP: if return value
      * is FALSE, then no route.
@@ -279,10 +314,99 @@ static grp_mask_t *add_grp_mask(grp_mask_t **used_grp_mask_list, u_int32 group_a
     ptr->group_rp_number = 0;
     ptr->fragment_tag = 0;
 
+    if (used_grp_mask_list == &grp_mask_list)
+	grp_mask_trie_insert(ptr);
+
     return ptr;
 }
 
 
+/*
+ * Only the prefixes of grp_mask_list are in the trie, the segmented list
+ * is never used for matching.
+ */
+static void grp_mask_trie_insert(grp_mask_t *mask_ptr)
+{
+    grp_mask_node_t **node;
+    u_int32 prefix_h = ntohl(mask_ptr->group_addr & mask_ptr->group_mask);
+    u_int8 masklen, bit;
+
+    MASK_TO_MASKLEN(mask_ptr->group_mask, masklen);
+    node = &grp_mask_trie;
+    for (bit = 0; ; bit++) {
+	if (*node == NULL) {
+	    *node = (grp_mask_node_t *)calloc(1, sizeof(grp_mask_node_t));
+	    if (!*node)
+		logit(LOG_ERR, 0, "Ran out of memory in grp_mask_trie_insert()");
+	    grp_mask_trie_nodes++;
+	}
+	if (bit == masklen)
+	    break;
+	node = &(*node)->child[(prefix_h >> (31 - bit)) & 1];
+    }
+
+    (*node)->mask = mask_ptr;
+}
+
+
+static void grp_mask_trie_remove(grp_mask_t *mask_ptr)
+{
+    grp_mask_node_t **path[33];
+    grp_mask_node_t **node;
+    u_int32 prefix_h = ntohl(mask_ptr->group_addr & mask_ptr->group_mask);
+    u_int8 masklen, bit;
+
+    MASK_TO_MASKLEN(mask_ptr->group_mask, masklen);
+    node = &grp_mask_trie;
+    for (bit = 0; *node != NULL; bit++) {
+	path[bit] = node;
+	if (bit == masklen)
+	    break;
+	node = &(*node)->child[(prefix_h >> (31 - bit)) & 1];
+    }
+    if (*node == NULL || (*node)->mask != mask_ptr)
+	return;		/* Not found */
+
+    (*node)->mask = NULL;
+
+    /* Prune the nodes which are no longer used */
+    for ( ; ; bit--) {
+	node = path[bit];
+	if ((*node)->mask || (*node)->child[0] || (*node)->child[1])
+	    break;
+	free(*node);
+	*node = NULL;
+	grp_mask_trie_nodes--;
+	if (bit == 0)
+	    break;
+    }
+}
+
+
+static void grp_mask_trie_free(grp_mask_node_t *node)
+{
+    if (node == NULL)
+	return;
+
+    grp_mask_trie_free(node->child[0]);
+    grp_mask_trie_free(node->child[1]);
+    free(node);
+    grp_mask_trie_nodes--;
+}
+
+
+/*
+ * Must be called whenever a grp_rp chain of grp_mask_list changes, before
+ * any group is remapped, so no stale (or freed) rp_grp_entry is returned
+ * from the rp_match_cache.
+ */
+static void rp_set_changed(grp_mask_t **used_grp_mask_list)
+{
+    if (used_grp_mask_list == &grp_mask_list)
+	rp_set_generation++;
+}
+
+
 /* TODO: XXX: BUG: a remapping for some groups currently using some other
  * grp_mask may be required by the addition of the new entry!!!
  * Remapping all groups might be a costly process...
@@ -414,7 +538,15 @@ rp_grp_entry_t *add_rp_grp_entry(cand_rp_t  **used_cand_rp_list,
     entry_new->rp = cand_rp_ptr;
     entry_new->grplink = NULL;
 
+    /*
+     * Groups without an RP so far may be routed now.  Not before a
+     * fragmented BSM is complete and moved to cand_rp_list.
+     */
+    if (used_cand_rp_list == &cand_rp_list)
+	neg_mfc_clear_prefix(group_addr, group_mask);
+
     mask_ptr->group_rp_number++;
+    rp_set_changed(used_grp_mask_list);
     
     if (mask_ptr->grp_rp_next->priority == rp_priority) {
 	/* The first entries are with the best priority. */
@@ -459,6 +591,7 @@ void delete_rp_grp_entry(cand_rp_t **used_cand_rp_list, grp_mask_t **used_grp_ma
 
     if (entry->grp_rp_next)
 	entry->grp_rp_next->grp_rp_prev = entry->grp_rp_prev;
+    rp_set_changed(used_grp_mask_list);
 
     /* Delete Cand-RP or Group-prefix if useless */
     if (entry->group->grp_rp_next == NULL)
@@ -486,9 +619,11 @@ void delete_rp_list(cand_rp_t  **used_cand_rp_list, grp_mask_t **used_grp_mask_l
     rp_grp_entry_t *entry_ptr, *entry_next;
     grp_mask_t     *mask_ptr, *mask_next;
     grpentry_t     *gentry_ptr, *gentry_ptr_next;
+    hash_table_t   *tbl = rp_hash_of(used_cand_rp_list);
     
     for (cand_ptr = *used_cand_rp_list; cand_ptr; ) {
 	cand_next = cand_ptr->next;
+	hash_remove(tbl, &cand_ptr->rpentry->hash);
 
 	/* Free the mrtentry (if any) for this RP */
 	if (cand_ptr->rpentry->mrtlink) {
@@ -524,6 +659,12 @@ void delete_rp_list(cand_rp_t  **used_cand_rp_list, grp_mask_t **used_grp_mask_l
 	free(mask_ptr);
     }
     *used_grp_mask_list = NULL;
+
+    if (used_grp_mask_list == &grp_mask_list) {
+	grp_mask_trie_free(grp_mask_trie);
+	grp_mask_trie = NULL;
+    }
+    rp_set_changed(used_grp_mask_list);
 }
 
 
@@ -569,6 +710,10 @@ static void delete_grp_mask_entry(cand_rp_t **used_cand_rp_list, grp_mask_t **us
 
     if (grp_mask_delete->next)
 	grp_mask_delete->next->prev = grp_mask_delete->prev;
+
+    if (used_grp_mask_list == &grp_mask_list)
+	grp_mask_trie_remove(grp_mask_delete);
+    rp_set_changed(used_grp_mask_list);
     
     /* Remove all grp_rp entries for this grp_mask */
     for (entry_ptr = grp_mask_delete->grp_rp_next; entry_ptr; entry_ptr = entry_next) {
@@ -603,23 +748,13 @@ static void delete_grp_mask_entry(cand_rp_t **used_cand_rp_list, grp_mask_t **us
  */
 void delete_rp(cand_rp_t **used_cand_rp_list, grp_mask_t **used_grp_mask_list, u_int32 rp_addr)
 {
-    cand_rp_t *ptr;
-    u_int32 rp_addr_h = ntohl(rp_addr);
-
-    for(ptr = *used_cand_rp_list; ptr != NULL; ptr = ptr->next) {
-	if (ntohl(ptr->rpentry->address) > rp_addr_h)
-	    continue;
+    rpentry_t *entry;
 
-	if (ptr->rpentry->address == rp_addr)
-	    break;
-	else
-	    return;   /* Not found */
-    }
-    
-    if (ptr == NULL)
+    entry = (rpentry_t *)hash_find(rp_hash_of(used_cand_rp_list), rp_addr, INADDR_ANY_N);
+    if (entry == NULL)
 	return;       /* Not found */
 
-    delete_rp_entry(used_cand_rp_list, used_grp_mask_list, ptr);
+    delete_rp_entry(used_cand_rp_list, used_grp_mask_list, entry->cand_rp);
 }
 
 
@@ -641,6 +776,8 @@ static void delete_rp_entry(cand_rp_t **used_cand_rp_list, grp_mask_t **used_grp
 
     if (cand_rp_delete->next)
 	cand_rp_delete->next->prev = cand_rp_delete->prev;
+
+    hash_remove(rp_hash_of(used_cand_rp_list), &cand_rp_delete->rpentry->hash);
     
     if (cand_rp_delete->rpentry->mrtlink) {
 	if (cand_rp_delete->rpentry->mrtlink->flags & MRTF_KERNEL_CACHE)
@@ -663,6 +800,7 @@ static void delete_rp_entry(cand_rp_t **used_cand_rp_list, grp_mask_t **used_grp
 
 	if (entry_ptr->grp_rp_next)
 	    entry_ptr->grp_rp_next->grp_rp_prev = entry_ptr->grp_rp_prev;
+	rp_set_changed(used_grp_mask_list);
 
 	if (entry_ptr->grp_rp_next == NULL)
 	    delete_grp_mask_entry(used_cand_rp_list, used_grp_mask_list, entry_ptr->group);
@@ -767,6 +905,31 @@ rpentry_t *rp_match(u_int32 group)
 
 rp_grp_entry_t *rp_grp_match(u_int32 group)
 {
+    u_int32 group_h = ntohl(group);
+    u_int32 idx = RP_MATCH_CACHE_INDEX(group_h);
+
+    if (rp_match_cache[idx].generation == rp_set_generation
+	&& rp_match_cache[idx].group == group) {
+	rp_match_cache_hits++;
+	return rp_match_cache[idx].entry;
+    }
+
+    rp_match_cache_misses++;
+    rp_match_cache[idx].group = group;
+    rp_match_cache[idx].generation = rp_set_generation;
+    rp_match_cache[idx].entry = rp_grp_lookup(group);
+
+    return rp_match_cache[idx].entry;
+}
+
+
+/*
+ * Walk down the prefix trie along the group address.  Every prefix on the
+ * way covers the group, and its best priority RPs are candidates.
+ */
+static rp_grp_entry_t *rp_grp_lookup(u_int32 group)
+{
+    grp_mask_node_t *node;
     grp_mask_t *mask_ptr;
     rp_grp_entry_t *entry_ptr;
     rp_grp_entry_t *best_entry = NULL;
@@ -776,62 +939,48 @@ rp_grp_entry_t *rp_grp_match(u_int32 group)
     u_int32 curr_hash_value    = 0;
     u_int32 curr_address_h     = 0;
     u_int32 group_h            = ntohl(group);
+    u_int8 bit;
 
-    if (grp_mask_list == NULL)
-	return NULL;
+    for (node = grp_mask_trie, bit = 0; node; node = node->child[(group_h >> (31 - bit++)) & 1]) {
+	mask_ptr = node->mask;
+	if (mask_ptr != NULL) {
+	    for (entry_ptr = mask_ptr->grp_rp_next; entry_ptr; entry_ptr = entry_ptr->grp_rp_next) {
+		if (best_priority < entry_ptr->priority)
+		    break;
 
-    for (mask_ptr = grp_mask_list; mask_ptr; mask_ptr = mask_ptr->next) {
-	/* Search the grp_mask (group_prefix) list */
-	if ((group_h & ntohl(mask_ptr->group_mask))
-	    != ntohl(mask_ptr->group_mask & mask_ptr->group_addr))
-	    continue;
-	
-	for (entry_ptr = mask_ptr->grp_rp_next; entry_ptr; entry_ptr = entry_ptr->grp_rp_next) {
-	    if (best_priority < entry_ptr->priority)
-		break;
-
-	    curr_hash_value = RP_HASH_VALUE(group_h, mask_ptr->hash_mask, curr_address_h);
-	    curr_address_h = ntohl(entry_ptr->rp->rpentry->address);
-	    
-	    if (best_priority == entry_ptr->priority) {
-		/* Compare the hash_value and then the addresses */
-		if (curr_hash_value < best_hash_value)
-		    continue;
+		curr_address_h = ntohl(entry_ptr->rp->rpentry->address);
+		curr_hash_value = RP_HASH_VALUE(group_h, ntohl(mask_ptr->hash_mask), curr_address_h);
 
-		if (curr_hash_value == best_hash_value) {
-		    if (curr_address_h < best_address_h)
+		if (best_priority == entry_ptr->priority) {
+		    /* Compare the hash_value and then the addresses */
+		    if (curr_hash_value < best_hash_value)
 			continue;
+
+		    if (curr_hash_value == best_hash_value) {
+			if (curr_address_h < best_address_h)
+			    continue;
+		    }
 		}
-	    }
 
-	    /* The current entry in the loop is preferred */
-	    best_entry = entry_ptr;
-	    best_priority = best_entry->priority;
-	    best_address_h = curr_address_h;
-	    best_hash_value = curr_hash_value;
+		/* The current entry in the loop is preferred */
+		best_entry = entry_ptr;
+		best_priority = best_entry->priority;
+		best_address_h = curr_address_h;
+		best_hash_value = curr_hash_value;
+	    }
 	}
+
+	if (bit == 32)
+	    break;
     }
-    
+
     return best_entry;
 }
 
 
 rpentry_t *rp_find(u_int32 rp_address)
 {
-    cand_rp_t *cand_rp_ptr;
-    u_int32 address_h = ntohl(rp_address);
-
-    for(cand_rp_ptr = cand_rp_list; cand_rp_ptr != NULL; cand_rp_ptr = cand_rp_ptr->next) {
-	if (ntohl(cand_rp_ptr->rpentry->address) > address_h)
-	    continue;
-
-	if (cand_rp_ptr->rpentry->address == rp_address)
-	    return cand_rp_ptr->rpentry;
-
-	return NULL;
-    }
-
-    return NULL;
+    return (rpentry_t *)hash_find(&rphash, rp_address, INADDR_ANY_N);
 }
 
 
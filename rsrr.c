@@ -274,7 +274,8 @@ static int rsrr_accept_rq(struct rsrr_rq *route_query, u_int8 flags, struct gtab
     if (gt_notify) {
 	/* Include the routing entry. */
 	route_reply->in_vif = gt_notify->incoming;
-	route_reply->out_vif_bm = gt_notify->oifs;
+	/* The message has only room for the first 32 vifs */
+	route_reply->out_vif_bm = (u_int32)gt_notify->oifs.word[0];
 	gt = gt_notify;
 	status_ok = TRUE;
     } else if ((gt = find_route(route_query->source_addr,
@@ -283,7 +284,8 @@ static int rsrr_accept_rq(struct rsrr_rq *route_query, u_int8 flags, struct gtab
 				DONT_CREATE)) != (struct gtable *)NULL) {
 	status_ok = TRUE;
 	route_reply->in_vif = gt->incoming;
-	route_reply->out_vif_bm = gt->oifs;
+	/* The message has only room for the first 32 vifs */
+	route_reply->out_vif_bm = (u_int32)gt->oifs.word[0];
     }
     if (status_ok != TRUE) {
 	/* Set error bit. */
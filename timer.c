@@ -93,6 +93,13 @@ u_int16 kernel_cache_check_interval;
 srcentry_t srcentry_save;
 rpentry_t  rpentry_save;
 
+/* Random per router, so neighbors do not refresh the same groups in step */
+static u_int32 jp_phase_seed;
+
+/* The (S,G) counters of a rate check, when read with one netlink dump */
+static u_int32 sg_cnt_gen;		/* stamp of the last dump	     */
+static int     sg_cnt_dumped;		/* TRUE if this check got one	     */
+
 /*
  * Init some timers
  */
@@ -136,6 +143,7 @@ init_timers()
     RESET_TIMER(rpentry_save.timer);
     rpentry_save.cand_rp    = (cand_rp_t *)NULL;
 
+    jp_phase_seed = RANDOM();
 }
 
 
@@ -184,10 +192,6 @@ age_vifs()
 	    delete_pim_nbr(curr_nbr);
 	}
 	
-	/* PIM_HELLO periodic */
-	IF_TIMEOUT(v->uv_pim_hello_timer)
-	    send_pim_hello(v, PIM_TIMER_HELLO_HOLDTIME);
-
 #ifdef TOBE_DELETED
 	/* PIM_JOIN_PRUNE periodic */
 	/* TODO: XXX: TIMER implem. dependency! */
@@ -214,69 +218,484 @@ age_vifs()
 
 
 /*
- * Scan the whole routing table and timeout a bunch of timers:
- *  - oifs timers
- *  - Join/Prune timer
- *  - routing entry
- *  - Assert timer
- *  - Register-Suppression timer
+ * The route clock, in seconds.  It is advanced by TIMER_INTERVAL on every
+ * age_routes(), and the routing entry timers are deadlines on it.
  *
+ * The routing entries are kept on a wheel with one slot per TIMER_INTERVAL,
+ * by the time their earliest timer is due, hence aging only looks at the
+ * entries which have something to do.  An entry due later than the wheel
+ * covers is put on the last slot, and simply rescheduled when it comes up.
+ * While aging, the entries due now are kept on one run queue per type, so
+ * that the (*,*,RP) entries are aged before the (*,G) entries, and those
+ * before the (S,G) entries.
+ */
+#define ROUTE_WHEEL_SIZE	256
+#define ROUTE_RUNQ_RP		0
+#define ROUTE_RUNQ_WC		1
+#define ROUTE_RUNQ_SG		2
+#define ROUTE_RUNQS		3
+
+u_int32 route_clock;
+
+static mrtentry_t *route_wheel[ROUTE_WHEEL_SIZE];
+static mrtentry_t *route_runq[ROUTE_RUNQS];
+static int route_aging;		/* TRUE while in age_routes() */
+
+static void link_mrtentry	(mrtentry_t **head, mrtentry_t *mrtentry_ptr, u_int32 due);
+static int  route_runq_of	(mrtentry_t *mrtentry_ptr);
+static u_int32 next_deadline	(mrtentry_t *mrtentry_ptr);
+static u_int32 *mrt_timer_due	(mrtentry_t *mrtentry_ptr, u_int32 *timer);
+static void arm_mrt_ms		(u_int32 msec);
+static int  collect_mrt_ms	(pim_nbr_entry_t *upstream, u_int32 limit);
+static void mrt_ms_timeout	(void *arg);
+static void run_route_queues	(void);
+static int  jp_conflict		(int action, int other_action);
+static u_int32 jp_refresh_delay	(mrtentry_t *mrtentry_ptr);
+static int  age_rp_route	(mrtentry_t *mrtentry_rp);
+static int  age_grp_route	(mrtentry_t *mrtentry_grp);
+static int  age_src_route	(mrtentry_t *mrtentry_srcs);
+static void age_mrtentry	(mrtentry_t *mrtentry_ptr);
+static int  get_sg_cnt		(kernel_cache_t *kernel_cache_ptr);
+static void check_routes	(void);
+
+static void
+link_mrtentry(head, mrtentry_ptr, due)
+    mrtentry_t **head;
+    mrtentry_t *mrtentry_ptr;
+    u_int32 due;
+{
+    mrtentry_ptr->due = due;
+    mrtentry_ptr->duenext = *head;
+    if (*head != (mrtentry_t *)NULL)
+	(*head)->dueprev = &mrtentry_ptr->duenext;
+    *head = mrtentry_ptr;
+    mrtentry_ptr->dueprev = head;
+}
+
+void
+unschedule_mrtentry(mrtentry_ptr)
+    mrtentry_t *mrtentry_ptr;
+{
+    if (mrtentry_ptr->dueprev == (mrtentry_t **)NULL)
+	return;
+
+    *mrtentry_ptr->dueprev = mrtentry_ptr->duenext;
+    if (mrtentry_ptr->duenext != (mrtentry_t *)NULL)
+	mrtentry_ptr->duenext->dueprev = mrtentry_ptr->dueprev;
+    mrtentry_ptr->duenext = (mrtentry_t *)NULL;
+    mrtentry_ptr->dueprev = (mrtentry_t **)NULL;
+}
+
+static int
+route_runq_of(mrtentry_ptr)
+    mrtentry_t *mrtentry_ptr;
+{
+    if (mrtentry_ptr->flags & MRTF_PMBR)
+	return ROUTE_RUNQ_RP;
+    if (mrtentry_ptr->flags & MRTF_WC)
+	return ROUTE_RUNQ_WC;
+    return ROUTE_RUNQ_SG;
+}
+
+/*
+ * Make sure the entry is aged no later than `deadline'.  An expired
+ * deadline is handled on the next aging, or right away if we are aging
+ * and have not looked at that entry yet.  Entries are only ever moved
+ * closer, aging an entry too early is harmless.
+ */
+void
+schedule_mrtentry(mrtentry_ptr, deadline)
+    mrtentry_t *mrtentry_ptr;
+    u_int32 deadline;
+{
+    u_int32 due;
+
+    /* Round up to the aging when the deadline is reached */
+    due = deadline + TIMER_INTERVAL - 1;
+    due -= due % TIMER_INTERVAL;
+
+    if (due <= route_clock) {
+	if ((route_aging == TRUE) && (mrtentry_ptr->aged != route_clock))
+	    due = route_clock;
+	else
+	    due = route_clock + TIMER_INTERVAL;
+    }
+    else if (due - route_clock >= ROUTE_WHEEL_SIZE * TIMER_INTERVAL) {
+	due = route_clock + (ROUTE_WHEEL_SIZE - 1) * TIMER_INTERVAL;
+    }
+
+    if ((mrtentry_ptr->dueprev != (mrtentry_t **)NULL)
+	&& (mrtentry_ptr->due <= due))
+	return;
+
+    unschedule_mrtentry(mrtentry_ptr);
+    if (due == route_clock)
+	link_mrtentry(&route_runq[route_runq_of(mrtentry_ptr)],
+		      mrtentry_ptr, due);
+    else
+	link_mrtentry(&route_wheel[(due / TIMER_INTERVAL) % ROUTE_WHEEL_SIZE],
+		      mrtentry_ptr, due);
+}
+
+void
+set_mrt_timer(mrtentry_ptr, timer, value)
+    mrtentry_t *mrtentry_ptr;
+    u_int32 *timer;
+    u_int32 value;
+{
+    u_int32 *due;
+
+    /* A new value replaces any pending set_mrt_timer_ms() */
+    due = mrt_timer_due(mrtentry_ptr, timer);
+    if ((due != (u_int32 *)NULL) && *due) {
+	*due = 0;
+	if (!mrtentry_ptr->jp_ms_due && !mrtentry_ptr->assert_ms_due)
+	    unlink_mrt_ms(mrtentry_ptr);
+    }
+
+    *timer = value ? route_clock + value : 0;
+    schedule_mrtentry(mrtentry_ptr, *timer);
+}
+
+/*
+ * The entry timers which may be set in milliseconds: the randomized Join
+ * override delay, which is shorter than TIMER_INTERVAL, and the Assert
+ * timer.  The entries with such a timer running are kept on one list,
+ * and a single callout wakes up for the earliest of them.  All the
+ * entries due within MRT_MS_WINDOW are then aged together, so that the
+ * Joins overriding one Prune share their J/P messages.
+ */
+#define MRT_MS_WINDOW		50	/* msec */
+
+static mrtentry_t *mrt_ms_list;
+static int mrt_ms_timerid;
+
+static u_int32 *
+mrt_timer_due(mrtentry_ptr, timer)
+    mrtentry_t *mrtentry_ptr;
+    u_int32 *timer;
+{
+    if (timer == &mrtentry_ptr->jp_timer)
+	return &mrtentry_ptr->jp_ms_due;
+    if (timer == &mrtentry_ptr->assert_timer)
+	return &mrtentry_ptr->assert_ms_due;
+
+    return (u_int32 *)NULL;
+}
+
+void
+unlink_mrt_ms(mrtentry_ptr)
+    mrtentry_t *mrtentry_ptr;
+{
+    if (mrtentry_ptr->msprev == (mrtentry_t **)NULL)
+	return;
+
+    *mrtentry_ptr->msprev = mrtentry_ptr->msnext;
+    if (mrtentry_ptr->msnext != (mrtentry_t *)NULL)
+	mrtentry_ptr->msnext->msprev = mrtentry_ptr->msprev;
+    mrtentry_ptr->msnext = (mrtentry_t *)NULL;
+    mrtentry_ptr->msprev = (mrtentry_t **)NULL;
+    mrtentry_ptr->jp_ms_due = 0;
+    mrtentry_ptr->assert_ms_due = 0;
+}
+
+/*
+ * Make sure the callout wakes us up `msec' milliseconds from now at the
+ * latest.  A stale id, e.g., after restart(), is just set again.
+ */
+static void
+arm_mrt_ms(msec)
+    u_int32 msec;
+{
+    int left;
+
+    left = timer_leftTimer_ms(mrt_ms_timerid);
+    if (left < 0)
+	mrt_ms_timerid = timer_setTimer_ms(msec, mrt_ms_timeout, NULL);
+    else if ((u_int32)left > msec)
+	timer_rescheduleTimer_ms(mrt_ms_timerid, msec);
+}
+
+/*
+ * Set an entry timer to expire in `msec' milliseconds, rather than on the
+ * aging after.  The callout expires the timer and ages the entry on time,
+ * the deadline on the route clock is only a fallback which age_routes()
+ * never reaches first.
+ */
+void
+set_mrt_timer_ms(mrtentry_ptr, timer, msec)
+    mrtentry_t *mrtentry_ptr;
+    u_int32 *timer;
+    u_int32 msec;
+{
+    u_int32 *due;
+
+    set_mrt_timer(mrtentry_ptr, timer,
+		  TIMER_INTERVAL + (msec + 999) / 1000);
+
+    due = mrt_timer_due(mrtentry_ptr, timer);
+    if (due == (u_int32 *)NULL)
+	return;
+
+    *due = (callout_clock() + msec) | 1;	/* zero is not running */
+    if (mrtentry_ptr->msprev == (mrtentry_t **)NULL) {
+	mrtentry_ptr->msnext = mrt_ms_list;
+	if (mrt_ms_list != (mrtentry_t *)NULL)
+	    mrt_ms_list->msprev = &mrtentry_ptr->msnext;
+	mrt_ms_list = mrtentry_ptr;
+	mrtentry_ptr->msprev = &mrt_ms_list;
+    }
+    arm_mrt_ms(msec);
+}
+
+/*
+ * The time left on an entry timer, in milliseconds.
+ */
+u_int32
+mrt_timer_left_ms(mrtentry_ptr, timer)
+    mrtentry_t *mrtentry_ptr;
+    u_int32 *timer;
+{
+    u_int32 *due;
+    int left;
+
+    due = mrt_timer_due(mrtentry_ptr, timer);
+    if ((due != (u_int32 *)NULL) && *due) {
+	left = (int)(*due - callout_clock());
+	return left > 0 ? left : 0;
+    }
+
+    return MRT_TIMER_LEFT(*timer) * 1000;
+}
+
+/*
+ * Expire the millisecond timers due by `limit' of the entries going to
+ * `upstream', and move those entries to the run queues.  Returns TRUE
+ * if there was any.
+ */
+static int
+collect_mrt_ms(upstream, limit)
+    pim_nbr_entry_t *upstream;
+    u_int32 limit;
+{
+    mrtentry_t *mrtentry_ptr;
+    mrtentry_t *mrtentry_next;
+    int expired, found = FALSE;
+
+    for (mrtentry_ptr = mrt_ms_list;
+	 mrtentry_ptr != (mrtentry_t *)NULL;
+	 mrtentry_ptr = mrtentry_next) {
+	mrtentry_next = mrtentry_ptr->msnext;
+	if (mrtentry_ptr->upstream != upstream)
+	    continue;
+
+	expired = FALSE;
+	if (mrtentry_ptr->jp_ms_due
+	    && (int)(mrtentry_ptr->jp_ms_due - limit) <= 0) {
+	    mrtentry_ptr->jp_ms_due = 0;
+	    mrtentry_ptr->jp_timer = 0;
+	    expired = TRUE;
+	}
+	if (mrtentry_ptr->assert_ms_due
+	    && (int)(mrtentry_ptr->assert_ms_due - limit) <= 0) {
+	    mrtentry_ptr->assert_ms_due = 0;
+	    mrtentry_ptr->assert_timer = 0;
+	    expired = TRUE;
+	}
+	if (expired == FALSE)
+	    continue;
+
+	if (!mrtentry_ptr->jp_ms_due && !mrtentry_ptr->assert_ms_due)
+	    unlink_mrt_ms(mrtentry_ptr);
+	unschedule_mrtentry(mrtentry_ptr);
+	link_mrtentry(&route_runq[route_runq_of(mrtentry_ptr)],
+		      mrtentry_ptr, route_clock);
+	found = TRUE;
+    }
+
+    return found;
+}
+
+/*
+ * The millisecond timers are due: age their entries now instead of
+ * waiting for age_routes(), one upstream router at a time, and send the
+ * J/P message built for that router.
+ */
+static void
+mrt_ms_timeout(arg)
+    void *arg __attribute__((unused));
+{
+    mrtentry_t *mrtentry_ptr;
+    pim_nbr_entry_t *upstream;
+    u_int32 now, limit, next;
+    int left;
+
+    mrt_ms_timerid = 0;
+    now = callout_clock();
+    limit = now + MRT_MS_WINDOW;
+
+    while (1) {
+	for (mrtentry_ptr = mrt_ms_list;
+	     mrtentry_ptr != (mrtentry_t *)NULL;
+	     mrtentry_ptr = mrtentry_ptr->msnext) {
+	    if ((mrtentry_ptr->jp_ms_due
+		 && (int)(mrtentry_ptr->jp_ms_due - limit) <= 0)
+		|| (mrtentry_ptr->assert_ms_due
+		    && (int)(mrtentry_ptr->assert_ms_due - limit) <= 0))
+		break;
+	}
+	if (mrtentry_ptr == (mrtentry_t *)NULL)
+	    break;
+
+	upstream = mrtentry_ptr->upstream;
+	collect_mrt_ms(upstream, limit);
+	route_aging = TRUE;
+	run_route_queues();
+	route_aging = FALSE;
+	pack_and_send_jp_message(upstream);
+    }
+
+    /* Wake up again for the earliest timer left */
+    next = ~0;
+    for (mrtentry_ptr = mrt_ms_list;
+	 mrtentry_ptr != (mrtentry_t *)NULL;
+	 mrtentry_ptr = mrtentry_ptr->msnext) {
+	if (mrtentry_ptr->jp_ms_due) {
+	    left = (int)(mrtentry_ptr->jp_ms_due - now);
+	    if ((u_int32)left < next)
+		next = left;
+	}
+	if (mrtentry_ptr->assert_ms_due) {
+	    left = (int)(mrtentry_ptr->assert_ms_due - now);
+	    if ((u_int32)left < next)
+		next = left;
+	}
+    }
+    if (next != (u_int32)~0)
+	arm_mrt_ms(next);
+}
+
+/*
+ * The earliest deadline age_mrtentry() has something to do for that entry.
+ * An expired entry timer does not count: the entry is kept only because
+ * it has leaves, and change_interfaces() schedules it when they change.
+ */
+static u_int32
+next_deadline(mrtentry_ptr)
+    mrtentry_t *mrtentry_ptr;
+{
+    u_int32 next = mrtentry_ptr->jp_timer;
+    vifi_t vifi;
+
+    if ((mrtentry_ptr->timer > route_clock) && (mrtentry_ptr->timer < next))
+	next = mrtentry_ptr->timer;
+    if ((mrtentry_ptr->flags & MRTF_ASSERTED)
+	&& (mrtentry_ptr->assert_timer < next))
+	next = mrtentry_ptr->assert_timer;
+    if (mrtentry_ptr->rs_timer) {
+	/* Wake up in time to send the PIM_NULL_REGISTER */
+	if ((MRT_TIMER_LEFT(mrtentry_ptr->rs_timer) > PIM_REGISTER_PROBE_TIME)
+	    && (mrtentry_ptr->rs_timer - PIM_REGISTER_PROBE_TIME < next))
+	    next = mrtentry_ptr->rs_timer - PIM_REGISTER_PROBE_TIME;
+	else if (mrtentry_ptr->rs_timer < next)
+	    next = mrtentry_ptr->rs_timer;
+    }
+    for (vifi = 0; vifi < numvifs; vifi++) {
+	if (!VIFM_ISSET(vifi, mrtentry_ptr->joined_oifs))
+	    continue;
+	if ((mrtentry_ptr->flags & MRTF_SG) && (vifi == reg_vif_num))
+	    continue;
+	if (mrtentry_ptr->vif_timers[vifi] < next)
+	    next = mrtentry_ptr->vif_timers[vifi];
+    }
+
+    return next;
+}
+
+static int
+jp_conflict(action, other_action)
+    int action;
+    int other_action;
+{
+    return (((action == PIM_ACTION_JOIN) && (other_action == PIM_ACTION_PRUNE))
+	    || ((action == PIM_ACTION_PRUNE) && (other_action == PIM_ACTION_JOIN)));
+}
+
+/*
+ * The delay until the next periodic Join/Prune refresh of an entry.
+ * Instead of re-arming the timer for a full period, which keeps all the
+ * entries created together in step forever, every group (and every RP
+ * for the (*,*,RP) entries) has its own phase within the period.  The
+ * entries of a group stay together, so they still share one message.
+ * The first refresh after a change may come early, never late.
+ */
+static u_int32
+jp_refresh_delay(mrtentry_ptr)
+    mrtentry_t *mrtentry_ptr;
+{
+    u_int32 key, phase, delay;
+
+    if (mrtentry_ptr->flags & MRTF_PMBR)
+	key = mrtentry_ptr->source->address;
+    else
+	key = mrtentry_ptr->group->group;
+
+    key = (key ^ jp_phase_seed) * 0x9e3779b1;
+    phase = ((key >> 16) % (PIM_JOIN_PRUNE_PERIOD / TIMER_INTERVAL)) * TIMER_INTERVAL;
+    delay = (phase + PIM_JOIN_PRUNE_PERIOD
+	     - (route_clock % PIM_JOIN_PRUNE_PERIOD)) % PIM_JOIN_PRUNE_PERIOD;
+
+    return delay ? delay : PIM_JOIN_PRUNE_PERIOD;
+}
+
+
+/*
+ * Read the kernel counters of an (S,G), from the netlink dump of this
+ * rate check if there was one, or else with SIOCGETSGCNT.  Returns
+ * nonzero if the kernel has no such entry, like k_get_sg_cnt().
+ */
+static int
+get_sg_cnt(kernel_cache_ptr)
+    kernel_cache_t *kernel_cache_ptr;
+{
+    if (!sg_cnt_dumped)
+	return k_get_sg_cnt(udp_socket, kernel_cache_ptr->source,
+			    kernel_cache_ptr->group, &kernel_cache_ptr->sg_count);
+
+    if (kernel_cache_ptr->sg_dump_gen != sg_cnt_gen) {
+	logit(LOG_WARNING, 0, "No kernel MFC entry for (S,G) on (%s, %s)",
+	      inet_fmt(kernel_cache_ptr->source, s1, sizeof(s1)),
+	      inet_fmt(kernel_cache_ptr->group, s2, sizeof(s2)));
+	kernel_cache_ptr->sg_count.pktcnt   = ~0;
+	kernel_cache_ptr->sg_count.bytecnt  = ~0;
+	kernel_cache_ptr->sg_count.wrong_if = ~0;
+	return 1;
+    }
+
+    kernel_cache_ptr->sg_count = kernel_cache_ptr->sg_dump;
+    return 0;
+}
+
+/*
+ * Scan the whole routing table, but only when the global timers for
+ * checking the unicast routing or the data rate have expired:
  *  - If the global timer for checking the unicast routing has expired, perform
  *  also iif/upstream router change verification
  *  - If the global timer for checking the data rate has expired, check the
  *  number of bytes forwarded after the lastest timeout. If bigger than
  *  a given threshold, then switch to the shortest path.
  *  If `number_of_bytes == 0`, then delete the kernel cache entry.
- * 
- * Only the entries which have the Join/Prune timer expired are sent.
- * In the special case when we have ~(S,G)RPbit Prune entry, we must
- * include any (*,G) or (*,*,RP) XXX: ???? what and why?
- *
- * Below is a table which summarizes the segmantic rules.
- *
- * On the left side is "if A must be included in the J/P message".
- * On the top is "shall/must include B?"
- * "Y" means "MUST include"
- * "SY" means "SHOULD include"
- * "N" means  "NO NEED to include"
- * (G is a group that matches to RP)
- *
- *              -----------||-----------||-----------
- *            ||  (*,*,RP) ||   (*,G)   ||   (S,G)   ||
- *            ||-----------||-----------||-----------||
- *            ||  J  |  P  ||  J  |  P  ||  J  |  P  ||
- * ==================================================||
- *          J || n/a | n/a ||  N  |  Y  ||  N  |  Y  ||
- * (*,*,RP) -----------------------------------------||
- *          P || n/a | n/a ||  SY |  N  ||  SY |  N  ||
- * ==================================================||
- *          J ||  N  |  N  || n/a | n/a ||  N  |  Y  ||
- *   (*,G)  -----------------------------------------||
- *          P ||  N  |  N  || n/a | n/a ||  SY |  N  ||
- * ==================================================||
- *          J ||  N  |  N  ||  N  |  N  || n/a | n/a ||
- *   (S,G)  -----------------------------------------||
- *          P ||  N  |  N  ||  N  |  N  || n/a | n/a ||
- * ==================================================
- *
  */
-void
-age_routes()
+static void
+check_routes()
 {
     cand_rp_t  *cand_rp_ptr;
     grpentry_t *grpentry_ptr;
     grpentry_t *grpentry_ptr_next;
     mrtentry_t *mrtentry_grp;
     mrtentry_t *mrtentry_rp;
-    mrtentry_t *mrtentry_wide;
     mrtentry_t *mrtentry_srcs;
     mrtentry_t *mrtentry_srcs_next;
-    struct uvif *v;
-    vifi_t  vifi;
-    pim_nbr_entry_t *pim_nbr_ptr;
-    int change_flag;
-    int rp_action, grp_action, src_action = PIM_ACTION_NOTHING, src_action_rp = PIM_ACTION_NOTHING;
-    int dont_calc_action;
     int did_switch_flag;
     rp_grp_entry_t *rp_grp_entry_ptr;
     kernel_cache_t *kernel_cache_ptr;
@@ -285,36 +704,17 @@ age_routes()
     rpentry_t *rpentry_ptr;
     int update_rp_iif;
     int update_src_iif;
-    vifbitmap_t new_pruned_oifs;
 
-    /*
-     * Timing out of the global `unicast_routing_timer`
-     * and `data_rate_timer`
-     */
-    IF_TIMEOUT(unicast_routing_timer) {
-	ucast_flag = TRUE;
-	SET_TIMER(unicast_routing_timer, unicast_routing_check_interval);
-    }
-    ELSE {
-	ucast_flag = FALSE;
-    }
-    IF_TIMEOUT(pim_data_rate_timer) {
-	pim_data_rate_flag = TRUE;
-	SET_TIMER(pim_data_rate_timer, pim_data_rate_check_interval);
-    }
-    ELSE {
-	pim_data_rate_flag = FALSE;
-    }
-    IF_TIMEOUT(pim_reg_rate_timer) {
-	pim_reg_rate_flag = TRUE;
-	SET_TIMER(pim_reg_rate_timer, pim_reg_rate_check_interval);
-    }
-    ELSE {
-	pim_reg_rate_flag = FALSE;
+    sg_cnt_dumped = FALSE;
+    if (rate_flag == TRUE) {
+	/* The counters must see the entries still waiting in the shadow */
+	k_flush_mfc();
+#ifdef HAVE_NETLINK_MFC
+	/* Collect all the (S,G) counters at once, see get_sg_cnt() */
+	sg_cnt_dumped = nl_dump_sg_cnt(++sg_cnt_gen);
+#endif /* HAVE_NETLINK_MFC */
     }
 
-    rate_flag = pim_data_rate_flag | pim_reg_rate_flag;
-    
     /* Scan the (*,*,RP) entries */
     for (cand_rp_ptr = cand_rp_list; cand_rp_ptr != (cand_rp_t *)NULL;
 	 cand_rp_ptr = cand_rp_ptr->next) {
@@ -353,20 +753,9 @@ age_routes()
 	    }
 	}
 	
-	rp_action = PIM_ACTION_NOTHING;
 	mrtentry_rp = cand_rp_ptr->rpentry->mrtlink;
 	if (mrtentry_rp != (mrtentry_t *)NULL) {
-	    /* outgoing interfaces timers */
-	    change_flag = FALSE;
-	    for (vifi = 0; vifi < numvifs; vifi++) {
-		if (VIFM_ISSET(vifi, mrtentry_rp->joined_oifs)) {
-		    IF_TIMEOUT(mrtentry_rp->vif_timers[vifi]) {
-			VIFM_CLR(vifi, mrtentry_rp->joined_oifs);
-			change_flag = TRUE;
-		    }
-		}
-	    }
-	    if ((change_flag == TRUE) || (update_rp_iif == TRUE)) {
+	    if (update_rp_iif == TRUE) {
 		change_interfaces(mrtentry_rp,
 				  rpentry_ptr->incoming,
 				  mrtentry_rp->joined_oifs,
@@ -411,9 +800,7 @@ age_routes()
 		     kernel_cache_ptr = kernel_cache_next) {
 		    kernel_cache_next = kernel_cache_ptr->next;
 		    curr_bytecnt = kernel_cache_ptr->sg_count.bytecnt;
-		    if (k_get_sg_cnt(udp_socket, kernel_cache_ptr->source,
-				     kernel_cache_ptr->group,
-				     &kernel_cache_ptr->sg_count)
+		    if (get_sg_cnt(kernel_cache_ptr)
 			|| (curr_bytecnt ==
 			    kernel_cache_ptr->sg_count.bytecnt)) {
 			/* Either for some reason there is no such
@@ -465,48 +852,8 @@ age_routes()
 		    }
 		}
 	    }
-	    /* Join/Prune timer */
-	    IF_TIMEOUT(mrtentry_rp->jp_timer) {
-		rp_action = join_or_prune(mrtentry_rp,
-					  mrtentry_rp->upstream);
-		if (rp_action != PIM_ACTION_NOTHING)
-		    add_jp_entry(mrtentry_rp->upstream,
-				 PIM_JOIN_PRUNE_HOLDTIME,
-				 htonl(CLASSD_PREFIX),
-				 STAR_STAR_RP_MSKLEN,
-				 mrtentry_rp->source->address,
-				 SINGLE_SRC_MSKLEN,
-				 MRTF_RP | MRTF_WC,
-				 rp_action);
-		SET_TIMER(mrtentry_rp->jp_timer, PIM_JOIN_PRUNE_PERIOD);
-	    }
-	    
-	    /* Assert timer */
-	    if (mrtentry_rp->flags & MRTF_ASSERTED) {
-		IF_TIMEOUT(mrtentry_rp->assert_timer) {
-		    /* TODO: XXX: reset the upstream router now */
-		    mrtentry_rp->flags &= ~MRTF_ASSERTED;
-		}
-	    }
-	    /* Register-Suppression timer */
-	    /* TODO: to reduce the kernel calls, if the timer is running,
-	     * install a negative cache entry in the kernel?
-	     */
-	    /* TODO: can we have Register-Suppression timer for (*,*,RP)?
-	     * Currently no...
-	     */
-	    IF_TIMEOUT(mrtentry_rp->rs_timer) {}
-
-	    /* routing entry */
-	    if ((TIMEOUT(mrtentry_rp->timer))
-		&& (VIFM_ISEMPTY(mrtentry_rp->leaves))) {
-		delete_mrtentry(mrtentry_rp);
-	    }
-	} /* mrtentry_rp != NULL */
+	}
 
-	/* Just in case if that (*,*,RP) was deleted */
-	mrtentry_rp = cand_rp_ptr->rpentry->mrtlink;
-	
 	/* Check the (*,G) and (S,G) entries */
 	for (rp_grp_entry_ptr = cand_rp_ptr->rp_grp_next;
 	     rp_grp_entry_ptr != (rp_grp_entry_t *)NULL;
@@ -518,20 +865,9 @@ age_routes()
 		mrtentry_grp = grpentry_ptr->grp_route;
 		mrtentry_srcs = grpentry_ptr->mrtlink;
 		
-		grp_action = PIM_ACTION_NOTHING;
 		if (mrtentry_grp != (mrtentry_t *)NULL) {
 		    /* The (*,G) entry */
-		    /* outgoing interfaces timers */
-		    change_flag = FALSE;
-		    for (vifi = 0; vifi < numvifs; vifi++) {
-			if (VIFM_ISSET(vifi, mrtentry_grp->joined_oifs))
-			    IF_TIMEOUT(mrtentry_grp->vif_timers[vifi]) {
-                               VIFM_CLR(vifi, mrtentry_grp->joined_oifs);
-                               change_flag = TRUE;
-                            }
-		    }
-		    
-		    if ((change_flag == TRUE) || (update_rp_iif == TRUE)) {
+		    if (update_rp_iif == TRUE) {
 			change_interfaces(mrtentry_grp,
 					  rpentry_ptr->incoming,
 					  mrtentry_grp->joined_oifs,
@@ -549,10 +885,7 @@ age_routes()
 			    kernel_cache_next = kernel_cache_ptr->next;
 			    curr_bytecnt =
 				kernel_cache_ptr->sg_count.bytecnt;
-			    if (k_get_sg_cnt(udp_socket,
-					     kernel_cache_ptr->source,
-					     kernel_cache_ptr->group,
-					     &kernel_cache_ptr->sg_count)
+			    if (get_sg_cnt(kernel_cache_ptr)
 				|| (curr_bytecnt ==
 				    kernel_cache_ptr->sg_count.bytecnt)) {
 				/* Either for whatever reason there is
@@ -607,57 +940,6 @@ age_routes()
 			    }
 			}
 		    }
-		    
-		    dont_calc_action = FALSE;
-		    if (rp_action != PIM_ACTION_NOTHING) {
-			grp_action = join_or_prune(mrtentry_grp,
-						   mrtentry_grp->upstream);
-			dont_calc_action = TRUE;
-			if (((rp_action == PIM_ACTION_JOIN)
-			     && (grp_action == PIM_ACTION_PRUNE))
-			    || ((rp_action == PIM_ACTION_PRUNE)
-				&& (grp_action == PIM_ACTION_JOIN)))
-			    FIRE_TIMER(mrtentry_grp->jp_timer);
-		    }
-		    /* Join/Prune timer */
-		    IF_TIMEOUT(mrtentry_grp->jp_timer) {
-			if (dont_calc_action != TRUE)
-			    grp_action = join_or_prune(mrtentry_grp,
-						       mrtentry_grp->upstream);
-			if (grp_action != PIM_ACTION_NOTHING)
-			    add_jp_entry(mrtentry_grp->upstream,
-					 PIM_JOIN_PRUNE_HOLDTIME,
-					 mrtentry_grp->group->group,
-					 SINGLE_GRP_MSKLEN,
-					 cand_rp_ptr->rpentry->address,
-					 SINGLE_SRC_MSKLEN,
-					 MRTF_RP | MRTF_WC,
-					 grp_action);
-			SET_TIMER(mrtentry_grp->jp_timer, PIM_JOIN_PRUNE_PERIOD);
-		    }
-		    
-		    /* Assert timer */
-		    if (mrtentry_grp->flags & MRTF_ASSERTED) {
-			IF_TIMEOUT(mrtentry_grp->assert_timer) {
-			    /* TODO: XXX: reset the upstream router now */
-			    mrtentry_grp->flags &= ~MRTF_ASSERTED;
-			}
-		    }
-		    /* Register-Suppression timer */
-		    /* TODO: to reduce the kernel calls, if the timer
-		     * is running, install a negative cache entry in
-		     * the kernel?
-		     */
-		    /* TODO: currently cannot have Register-Suppression
-		     * timer for (*,G) entry, but keep this around.
-		     */
-		    IF_TIMEOUT(mrtentry_grp->rs_timer) {}
-
-		    /* routing entry */
-		    if ((TIMEOUT(mrtentry_grp->timer))
-			&& (VIFM_ISEMPTY(mrtentry_grp->leaves))) {
-			delete_mrtentry(mrtentry_grp);
-		    }
 		} /* if (mrtentry_grp != NULL) */
 		
 
@@ -665,24 +947,8 @@ age_routes()
 		/* XXX: mrtentry_srcs was set before */
 		for ( ; mrtentry_srcs != (mrtentry_t *)NULL;
 		      mrtentry_srcs = mrtentry_srcs_next) {
-		    /* routing entry */
 		    mrtentry_srcs_next = mrtentry_srcs->grpnext;
 		    
-		    /* outgoing interfaces timers */
-		    change_flag = FALSE;
-		    for (vifi = 0; vifi < numvifs; vifi++) {
-			if (VIFM_ISSET(vifi, mrtentry_srcs->joined_oifs)) {
-			    /* TODO: checking for reg_num_vif is slow! */
-			    if (vifi != reg_vif_num) {
-				IF_TIMEOUT(mrtentry_srcs->vif_timers[vifi]) {
-				    VIFM_CLR(vifi,
-					     mrtentry_srcs->joined_oifs);
-				    change_flag = TRUE;
-				}
-			    }
-			}
-		    }
-		    
 		    update_src_iif = FALSE;
 		    if (ucast_flag == TRUE) {
 			if (!(mrtentry_srcs->flags & MRTF_RP)) {
@@ -732,7 +998,7 @@ age_routes()
 			}
 		    }
 		    
-		    if ((change_flag == TRUE) || (update_src_iif == TRUE))
+		    if (update_src_iif == TRUE)
 			/* Flush the changes */
 			change_interfaces(mrtentry_srcs,
 					  mrtentry_srcs->incoming,
@@ -747,10 +1013,7 @@ age_routes()
 			     kernel_cache_ptr = kernel_cache_next) {
 			    kernel_cache_next = kernel_cache_ptr->next;
 			    curr_bytecnt = kernel_cache_ptr->sg_count.bytecnt;
-			    if (k_get_sg_cnt(udp_socket,
-					     kernel_cache_ptr->source,
-					     kernel_cache_ptr->group,
-					     &kernel_cache_ptr->sg_count)
+			    if (get_sg_cnt(kernel_cache_ptr)
 				|| (curr_bytecnt ==
 				    kernel_cache_ptr->sg_count.bytecnt)) {
 				/* Either for some reason there is no such
@@ -782,8 +1045,8 @@ age_routes()
 			    if (curr_bytecnt + pim_data_rate_bytes
 				< kernel_cache_ptr->sg_count.bytecnt) {
 				if (!(mrtentry_srcs->flags & MRTF_RP)) {
-				    SET_TIMER(mrtentry_srcs->timer,
-					      PIM_DATA_TIMEOUT);
+				    SET_MRT_TIMER(mrtentry_srcs, timer,
+						  PIM_DATA_TIMEOUT);
 				    continue;
 				}
 				if (VIFM_LASTHOP_ROUTER(mrtentry_srcs->leaves,
@@ -797,8 +1060,8 @@ age_routes()
 				&& (curr_bytecnt + pim_reg_rate_bytes
 				    < kernel_cache_ptr->sg_count.bytecnt)) {
 				if (!(mrtentry_srcs->flags & MRTF_RP)) {
-				    SET_TIMER(mrtentry_srcs->timer,
-					      PIM_DATA_TIMEOUT);
+				    SET_MRT_TIMER(mrtentry_srcs, timer,
+						  PIM_DATA_TIMEOUT);
 				    continue;
 				}
 				if (mrtentry_srcs->incoming == reg_vif_num)
@@ -813,142 +1076,496 @@ age_routes()
 			     */
 			}
 		    }
-
-		    mrtentry_wide = mrtentry_srcs->group->grp_route;
-		    if (mrtentry_wide == (mrtentry_t *)NULL)
-			mrtentry_wide = mrtentry_rp;
-
-		    dont_calc_action = FALSE;
-		    if ((rp_action != PIM_ACTION_NOTHING)
-			|| (grp_action != PIM_ACTION_NOTHING)) {
-			src_action_rp = join_or_prune(mrtentry_srcs,
-						      rpentry_ptr->upstream);
-			src_action = src_action_rp;
-			dont_calc_action = TRUE;
-			if (src_action_rp == PIM_ACTION_JOIN) {
-			    if ((grp_action == PIM_ACTION_PRUNE)
-				|| (rp_action == PIM_ACTION_PRUNE))
-				FIRE_TIMER(mrtentry_srcs->jp_timer);
-			} else if (src_action_rp == PIM_ACTION_PRUNE) {
-			    if ((grp_action == PIM_ACTION_JOIN)
-				|| (rp_action == PIM_ACTION_JOIN))
-				FIRE_TIMER(mrtentry_srcs->jp_timer);
-			}
-		    }
-			
-		    /* Join/Prune timer */
-		    IF_TIMEOUT(mrtentry_srcs->jp_timer) {
-			if ((dont_calc_action != TRUE) || (rpentry_ptr->upstream != mrtentry_srcs->upstream))
-			    src_action = join_or_prune(mrtentry_srcs, mrtentry_srcs->upstream);
-
-			if (src_action != PIM_ACTION_NOTHING)
-			    add_jp_entry(mrtentry_srcs->upstream,
-					 PIM_JOIN_PRUNE_HOLDTIME,
-					 mrtentry_srcs->group->group,
-					 SINGLE_GRP_MSKLEN,
-					 mrtentry_srcs->source->address,
-					 SINGLE_SRC_MSKLEN,
-					 mrtentry_srcs->flags & MRTF_RP,
-					 src_action);
-			if (mrtentry_wide != (mrtentry_t *)NULL) {
-			    /* Have both (S,G) and (*,G) (or (*,*,RP)).
-			     * Check if need to send (S,G) PRUNE toward RP
-			     */
-			    if (mrtentry_srcs->upstream != mrtentry_wide->upstream) {
-				if (dont_calc_action != TRUE)
-				    src_action_rp = join_or_prune(mrtentry_srcs,
-								  mrtentry_wide->upstream);
-				/* XXX: TODO: do error check if
-				 * src_action == PIM_ACTION_JOIN, which should
-				 * be an error.
-				 */
-				if (src_action_rp == PIM_ACTION_PRUNE) {
-				    add_jp_entry(mrtentry_wide->upstream,
-						 PIM_JOIN_PRUNE_HOLDTIME,
-						 mrtentry_srcs->group->group,
-						 SINGLE_GRP_MSKLEN,
-						 mrtentry_srcs->source->address,
-						 SINGLE_SRC_MSKLEN,
-						 MRTF_RP,
-						 src_action_rp);
-				}
-			    }
-			}
-			SET_TIMER(mrtentry_srcs->jp_timer, PIM_JOIN_PRUNE_PERIOD);
-		    }
-		    /* Assert timer */
-		    if (mrtentry_srcs->flags & MRTF_ASSERTED) {
-			IF_TIMEOUT(mrtentry_srcs->assert_timer) {
-			    /* TODO: XXX: reset the upstream router now */
-			    mrtentry_srcs->flags &= ~MRTF_ASSERTED;
-			}
-		    }
-		    /* Register-Suppression timer */
-		    /* TODO: to reduce the kernel calls, if the timer
-		     * is running, install a negative cache entry in
-		     * the kernel?
-		     */
-		    IF_TIMER_SET(mrtentry_srcs->rs_timer) {
-			IF_TIMEOUT(mrtentry_srcs->rs_timer) {
-			    /* Start encapsulating the packets */
-			    VIFM_COPY(mrtentry_srcs->pruned_oifs,
-				      new_pruned_oifs);
-			    VIFM_CLR(reg_vif_num, new_pruned_oifs);
-			    change_interfaces(mrtentry_srcs,
-					      mrtentry_srcs->incoming,
-					      mrtentry_srcs->joined_oifs,
-					      new_pruned_oifs,
-					      mrtentry_srcs->leaves,
-					      mrtentry_srcs->asserted_oifs, 0);
-			}
-			ELSE {
-			    /* The register suppression timer is running. Check
-			     * whether it is time to send PIM_NULL_REGISTER.
-			     */
-			    /* TODO: XXX: TIMER implem. dependency! */
-			    if (mrtentry_srcs->rs_timer
-				<= PIM_REGISTER_PROBE_TIME) {
-				/* Time to send a PIM_NULL_REGISTER */
-				/* XXX: a (bad) hack! This will be sending
-				 * periodically NULL_REGISTERS between
-				 * PIM_REGISTER_PROBE_TIME and 0. Well,
-				 * because PROBE_TIME is 5 secs, it will
-				 * happen only once, so it helps to avoid
-				 * adding a flag to the routing entry whether
-				 * a NULL_REGISTER was sent.
-				 */
-				send_pim_null_register(mrtentry_srcs);
-			    }
-			}
-		    }
-		    
-		    /* routing entry */
-		    if (TIMEOUT(mrtentry_srcs->timer)) {
-			if (VIFM_ISEMPTY(mrtentry_srcs->leaves)) {
-			    delete_mrtentry(mrtentry_srcs);
-			    continue;
-			}
-			/* XXX: if DR, Register suppressed,
-			 * and leaf oif inherited from (*,G), the
-			 * directly connected source is not active anymore,
-			 * this (S,G) entry won't timeout. Check if the leaf
-			 * oifs are inherited from (*,G); if true. delete the
-			 * (S,G) entry.
-			 */
-			if (mrtentry_srcs->group->grp_route
-			    != (mrtentry_t *)NULL) {
-			    if (!((mrtentry_srcs->group->grp_route->leaves
-				   & mrtentry_srcs->leaves)
-				  ^ mrtentry_srcs->leaves)) {
-				delete_mrtentry(mrtentry_srcs);
-				continue;
-			    }
-			}
-		    }
 		} /* End of (S,G) loop */
 	    } /* End of (*,G) loop */
 	}
     } /* For all cand RPs */
+}
+
+
+/*
+ * Age a (*,*,RP) entry.  Returns TRUE if the entry was deleted.
+ */
+static int
+age_rp_route(mrtentry_rp)
+    mrtentry_t *mrtentry_rp;
+{
+    rpentry_t *rpentry_ptr = mrtentry_rp->source;
+    rp_grp_entry_t *rp_grp_entry_ptr;
+    grpentry_t *grpentry_ptr;
+    mrtentry_t *mrtentry_grp;
+    mrtentry_t *mrtentry_srcs;
+    vifi_t vifi;
+    int change_flag;
+    int rp_action, grp_action, src_action;
+
+    /* outgoing interfaces timers */
+    change_flag = FALSE;
+    for (vifi = 0; vifi < numvifs; vifi++) {
+	if (VIFM_ISSET(vifi, mrtentry_rp->joined_oifs)) {
+	    if (MRT_TIMEOUT(mrtentry_rp->vif_timers[vifi])) {
+		VIFM_CLR(vifi, mrtentry_rp->joined_oifs);
+		change_flag = TRUE;
+	    }
+	}
+    }
+    if (change_flag == TRUE) {
+	change_interfaces(mrtentry_rp,
+			  rpentry_ptr->incoming,
+			  mrtentry_rp->joined_oifs,
+			  mrtentry_rp->pruned_oifs,
+			  mrtentry_rp->leaves,
+			  mrtentry_rp->asserted_oifs, 0);
+	mrtentry_rp->upstream = rpentry_ptr->upstream;
+    }
+
+    /* Join/Prune timer */
+    if (MRT_TIMEOUT(mrtentry_rp->jp_timer)) {
+	rp_action = join_or_prune(mrtentry_rp, mrtentry_rp->upstream);
+	if (rp_action != PIM_ACTION_NOTHING)
+	    add_jp_entry(mrtentry_rp->upstream,
+			 PIM_JOIN_PRUNE_HOLDTIME,
+			 htonl(CLASSD_PREFIX),
+			 STAR_STAR_RP_MSKLEN,
+			 mrtentry_rp->source->address,
+			 SINGLE_SRC_MSKLEN,
+			 MRTF_RP | MRTF_WC,
+			 rp_action);
+	SET_MRT_TIMER(mrtentry_rp, jp_timer, jp_refresh_delay(mrtentry_rp));
+
+	/* Any (*,G) or (S,G) of this RP with the opposite action must
+	 * be sent too, see the table above age_routes().
+	 */
+	for (rp_grp_entry_ptr = rpentry_ptr->cand_rp->rp_grp_next;
+	     (rp_action != PIM_ACTION_NOTHING)
+		 && (rp_grp_entry_ptr != (rp_grp_entry_t *)NULL);
+	     rp_grp_entry_ptr = rp_grp_entry_ptr->rp_grp_next) {
+	    for (grpentry_ptr = rp_grp_entry_ptr->grplink;
+		 grpentry_ptr != (grpentry_t *)NULL;
+		 grpentry_ptr = grpentry_ptr->rpnext) {
+		grp_action = PIM_ACTION_NOTHING;
+		mrtentry_grp = grpentry_ptr->grp_route;
+		if (mrtentry_grp != (mrtentry_t *)NULL) {
+		    grp_action = join_or_prune(mrtentry_grp,
+					       mrtentry_grp->upstream);
+		    if (jp_conflict(rp_action, grp_action))
+			FIRE_MRT_TIMER(mrtentry_grp, jp_timer);
+		}
+		for (mrtentry_srcs = grpentry_ptr->mrtlink;
+		     mrtentry_srcs != (mrtentry_t *)NULL;
+		     mrtentry_srcs = mrtentry_srcs->grpnext) {
+		    src_action = join_or_prune(mrtentry_srcs,
+					       rpentry_ptr->upstream);
+		    if (jp_conflict(src_action, rp_action)
+			|| jp_conflict(src_action, grp_action))
+			FIRE_MRT_TIMER(mrtentry_srcs, jp_timer);
+		}
+	    }
+	}
+    }
+    
+    /* Assert timer */
+    if (mrtentry_rp->flags & MRTF_ASSERTED) {
+	if (MRT_TIMEOUT(mrtentry_rp->assert_timer)) {
+	    /* TODO: XXX: reset the upstream router now */
+	    mrtentry_rp->flags &= ~MRTF_ASSERTED;
+	}
+    }
+    /* TODO: can we have Register-Suppression timer for (*,*,RP)?
+     * Currently no...
+     */
+
+    /* routing entry */
+    if ((MRT_TIMEOUT(mrtentry_rp->timer))
+	&& (VIFM_ISEMPTY(mrtentry_rp->leaves))) {
+	delete_mrtentry(mrtentry_rp);
+	return TRUE;
+    }
+
+    return FALSE;
+}
+
+
+/*
+ * Age a (*,G) entry.  Returns TRUE if the entry was deleted.
+ */
+static int
+age_grp_route(mrtentry_grp)
+    mrtentry_t *mrtentry_grp;
+{
+    grpentry_t *grpentry_ptr = mrtentry_grp->group;
+    rpentry_t *rpentry_ptr;
+    mrtentry_t *mrtentry_srcs;
+    vifi_t vifi;
+    int change_flag;
+    int grp_action, src_action;
+
+    if (grpentry_ptr->active_rp_grp == (rp_grp_entry_t *)NULL) {
+	/* Not mapped to any RP, look again later */
+	SET_MRT_TIMER(mrtentry_grp, jp_timer, PIM_JOIN_PRUNE_PERIOD);
+	return FALSE;
+    }
+    rpentry_ptr = grpentry_ptr->active_rp_grp->rp->rpentry;
+
+    /* outgoing interfaces timers */
+    change_flag = FALSE;
+    for (vifi = 0; vifi < numvifs; vifi++) {
+	if (VIFM_ISSET(vifi, mrtentry_grp->joined_oifs))
+	    if (MRT_TIMEOUT(mrtentry_grp->vif_timers[vifi])) {
+		VIFM_CLR(vifi, mrtentry_grp->joined_oifs);
+		change_flag = TRUE;
+	    }
+    }
+    
+    if (change_flag == TRUE) {
+	change_interfaces(mrtentry_grp,
+			  rpentry_ptr->incoming,
+			  mrtentry_grp->joined_oifs,
+			  mrtentry_grp->pruned_oifs,
+			  mrtentry_grp->leaves,
+			  mrtentry_grp->asserted_oifs, 0);
+	mrtentry_grp->upstream = rpentry_ptr->upstream;
+    }
+    
+    /* Join/Prune timer */
+    if (MRT_TIMEOUT(mrtentry_grp->jp_timer)) {
+	grp_action = join_or_prune(mrtentry_grp, mrtentry_grp->upstream);
+	if (grp_action != PIM_ACTION_NOTHING)
+	    add_jp_entry(mrtentry_grp->upstream,
+			 PIM_JOIN_PRUNE_HOLDTIME,
+			 mrtentry_grp->group->group,
+			 SINGLE_GRP_MSKLEN,
+			 rpentry_ptr->address,
+			 SINGLE_SRC_MSKLEN,
+			 MRTF_RP | MRTF_WC,
+			 grp_action);
+	SET_MRT_TIMER(mrtentry_grp, jp_timer, jp_refresh_delay(mrtentry_grp));
+
+	/* Any (S,G) of this group with the opposite action must be
+	 * sent too.
+	 */
+	for (mrtentry_srcs = grpentry_ptr->mrtlink;
+	     (grp_action != PIM_ACTION_NOTHING)
+		 && (mrtentry_srcs != (mrtentry_t *)NULL);
+	     mrtentry_srcs = mrtentry_srcs->grpnext) {
+	    src_action = join_or_prune(mrtentry_srcs, rpentry_ptr->upstream);
+	    if (jp_conflict(src_action, grp_action))
+		FIRE_MRT_TIMER(mrtentry_srcs, jp_timer);
+	}
+    }
+    
+    /* Assert timer */
+    if (mrtentry_grp->flags & MRTF_ASSERTED) {
+	if (MRT_TIMEOUT(mrtentry_grp->assert_timer)) {
+	    /* TODO: XXX: reset the upstream router now */
+	    mrtentry_grp->flags &= ~MRTF_ASSERTED;
+	}
+    }
+    /* TODO: currently cannot have Register-Suppression
+     * timer for (*,G) entry, but keep this around.
+     */
+
+    /* routing entry */
+    if ((MRT_TIMEOUT(mrtentry_grp->timer))
+	&& (VIFM_ISEMPTY(mrtentry_grp->leaves))) {
+	delete_mrtentry(mrtentry_grp);
+	return TRUE;
+    }
+
+    return FALSE;
+}
+
+
+/*
+ * Age an (S,G) or (S,G)RPbit entry.  Returns TRUE if the entry was deleted.
+ */
+static int
+age_src_route(mrtentry_srcs)
+    mrtentry_t *mrtentry_srcs;
+{
+    mrtentry_t *mrtentry_wide;
+    vifi_t vifi;
+    int change_flag;
+    int src_action, src_action_rp;
+    vifbitmap_t new_pruned_oifs;
+    vifbitmap_t new_leaves;
+
+    /* outgoing interfaces timers */
+    change_flag = FALSE;
+    for (vifi = 0; vifi < numvifs; vifi++) {
+	if (VIFM_ISSET(vifi, mrtentry_srcs->joined_oifs)) {
+	    /* TODO: checking for reg_num_vif is slow! */
+	    if (vifi != reg_vif_num) {
+		if (MRT_TIMEOUT(mrtentry_srcs->vif_timers[vifi])) {
+		    VIFM_CLR(vifi, mrtentry_srcs->joined_oifs);
+		    change_flag = TRUE;
+		}
+	    }
+	}
+    }
+    
+    if (change_flag == TRUE)
+	/* Flush the changes */
+	change_interfaces(mrtentry_srcs,
+			  mrtentry_srcs->incoming,
+			  mrtentry_srcs->joined_oifs,
+			  mrtentry_srcs->pruned_oifs,
+			  mrtentry_srcs->leaves,
+			  mrtentry_srcs->asserted_oifs, 0);
+
+    mrtentry_wide = mrtentry_srcs->group->grp_route;
+    if ((mrtentry_wide == (mrtentry_t *)NULL)
+	&& (mrtentry_srcs->group->active_rp_grp != (rp_grp_entry_t *)NULL))
+	mrtentry_wide = mrtentry_srcs->group->active_rp_grp->rp->rpentry->mrtlink;
+
+    /* Join/Prune timer */
+    if (MRT_TIMEOUT(mrtentry_srcs->jp_timer)) {
+	src_action = join_or_prune(mrtentry_srcs, mrtentry_srcs->upstream);
+	if (src_action != PIM_ACTION_NOTHING)
+	    add_jp_entry(mrtentry_srcs->upstream,
+			 PIM_JOIN_PRUNE_HOLDTIME,
+			 mrtentry_srcs->group->group,
+			 SINGLE_GRP_MSKLEN,
+			 mrtentry_srcs->source->address,
+			 SINGLE_SRC_MSKLEN,
+			 mrtentry_srcs->flags & MRTF_RP,
+			 src_action);
+	if (mrtentry_wide != (mrtentry_t *)NULL) {
+	    /* Have both (S,G) and (*,G) (or (*,*,RP)).
+	     * Check if need to send (S,G) PRUNE toward RP
+	     */
+	    if (mrtentry_srcs->upstream != mrtentry_wide->upstream) {
+		src_action_rp = join_or_prune(mrtentry_srcs,
+					      mrtentry_wide->upstream);
+		/* XXX: TODO: do error check if
+		 * src_action == PIM_ACTION_JOIN, which should
+		 * be an error.
+		 */
+		if (src_action_rp == PIM_ACTION_PRUNE) {
+		    add_jp_entry(mrtentry_wide->upstream,
+				 PIM_JOIN_PRUNE_HOLDTIME,
+				 mrtentry_srcs->group->group,
+				 SINGLE_GRP_MSKLEN,
+				 mrtentry_srcs->source->address,
+				 SINGLE_SRC_MSKLEN,
+				 MRTF_RP,
+				 src_action_rp);
+		}
+	    }
+	}
+	SET_MRT_TIMER(mrtentry_srcs, jp_timer, jp_refresh_delay(mrtentry_srcs));
+    }
+    /* Assert timer */
+    if (mrtentry_srcs->flags & MRTF_ASSERTED) {
+	if (MRT_TIMEOUT(mrtentry_srcs->assert_timer)) {
+	    /* TODO: XXX: reset the upstream router now */
+	    mrtentry_srcs->flags &= ~MRTF_ASSERTED;
+	}
+    }
+    /* Register-Suppression timer */
+    /* TODO: to reduce the kernel calls, if the timer
+     * is running, install a negative cache entry in
+     * the kernel?
+     */
+    if (mrtentry_srcs->rs_timer) {
+	if (MRT_TIMEOUT(mrtentry_srcs->rs_timer)) {
+	    RESET_TIMER(mrtentry_srcs->rs_timer);
+	    /* Start encapsulating the packets */
+	    VIFM_COPY(mrtentry_srcs->pruned_oifs, new_pruned_oifs);
+	    VIFM_CLR(reg_vif_num, new_pruned_oifs);
+	    change_interfaces(mrtentry_srcs,
+			      mrtentry_srcs->incoming,
+			      mrtentry_srcs->joined_oifs,
+			      new_pruned_oifs,
+			      mrtentry_srcs->leaves,
+			      mrtentry_srcs->asserted_oifs, 0);
+	}
+	ELSE {
+	    /* The register suppression timer is running. Check
+	     * whether it is time to send PIM_NULL_REGISTER.
+	     */
+	    if (MRT_TIMER_LEFT(mrtentry_srcs->rs_timer)
+		<= PIM_REGISTER_PROBE_TIME) {
+		/* Time to send a PIM_NULL_REGISTER */
+		/* XXX: a (bad) hack! This will be sending
+		 * periodically NULL_REGISTERS between
+		 * PIM_REGISTER_PROBE_TIME and 0. Well,
+		 * because PROBE_TIME is 5 secs, it will
+		 * happen only once, so it helps to avoid
+		 * adding a flag to the routing entry whether
+		 * a NULL_REGISTER was sent.
+		 */
+		send_pim_null_register(mrtentry_srcs);
+	    }
+	}
+    }
+    
+    /* routing entry */
+    if (MRT_TIMEOUT(mrtentry_srcs->timer)) {
+	if (VIFM_ISEMPTY(mrtentry_srcs->leaves)) {
+	    delete_mrtentry(mrtentry_srcs);
+	    return TRUE;
+	}
+	/* XXX: if DR, Register suppressed,
+	 * and leaf oif inherited from (*,G), the
+	 * directly connected source is not active anymore,
+	 * this (S,G) entry won't timeout. Check if the leaf
+	 * oifs are inherited from (*,G); if true. delete the
+	 * (S,G) entry.
+	 */
+	if (mrtentry_srcs->group->grp_route != (mrtentry_t *)NULL) {
+	    VIFM_COPY(mrtentry_srcs->leaves, new_leaves);
+	    VIFM_CLR_MASK(new_leaves, mrtentry_srcs->group->grp_route->leaves);
+	    if (VIFM_ISEMPTY(new_leaves)) {
+		delete_mrtentry(mrtentry_srcs);
+		return TRUE;
+	    }
+	}
+    }
+
+    return FALSE;
+}
+
+
+/*
+ * Age the entries on the run queues.  Aging an entry may schedule others,
+ * e.g., by firing their Join/Prune timer, hence always restart from the
+ * first queue.
+ */
+static void
+run_route_queues()
+{
+    mrtentry_t *mrtentry_ptr;
+    int runq;
+
+    for (runq = 0; runq < ROUTE_RUNQS; ) {
+	mrtentry_ptr = route_runq[runq];
+	if (mrtentry_ptr == (mrtentry_t *)NULL) {
+	    runq++;
+	    continue;
+	}
+	unschedule_mrtentry(mrtentry_ptr);
+	age_mrtentry(mrtentry_ptr);
+	runq = 0;
+    }
+}
+
+
+static void
+age_mrtentry(mrtentry_ptr)
+    mrtentry_t *mrtentry_ptr;
+{
+    int deleted;
+
+    mrtentry_ptr->aged = route_clock;
+    if (mrtentry_ptr->flags & MRTF_PMBR)
+	deleted = age_rp_route(mrtentry_ptr);
+    else if (mrtentry_ptr->flags & MRTF_WC)
+	deleted = age_grp_route(mrtentry_ptr);
+    else
+	deleted = age_src_route(mrtentry_ptr);
+
+    if (deleted == FALSE)
+	schedule_mrtentry(mrtentry_ptr, next_deadline(mrtentry_ptr));
+}
+
+
+/*
+ * Timeout the routing entries which have a timer due:
+ *  - oifs timers
+ *  - Join/Prune timer
+ *  - routing entry
+ *  - Assert timer
+ *  - Register-Suppression timer
+ *
+ * The unicast routing and data rate checks still need the whole routing
+ * table, they are done by check_routes() when their global timers expire.
+ * 
+ * Only the entries which have the Join/Prune timer expired are sent.
+ * In the special case when we have ~(S,G)RPbit Prune entry, we must
+ * include any (*,G) or (*,*,RP) XXX: ???? what and why?
+ *
+ * Below is a table which summarizes the segmantic rules.
+ *
+ * On the left side is "if A must be included in the J/P message".
+ * On the top is "shall/must include B?"
+ * "Y" means "MUST include"
+ * "SY" means "SHOULD include"
+ * "N" means  "NO NEED to include"
+ * (G is a group that matches to RP)
+ *
+ *              -----------||-----------||-----------
+ *            ||  (*,*,RP) ||   (*,G)   ||   (S,G)   ||
+ *            ||-----------||-----------||-----------||
+ *            ||  J  |  P  ||  J  |  P  ||  J  |  P  ||
+ * ==================================================||
+ *          J || n/a | n/a ||  N  |  Y  ||  N  |  Y  ||
+ * (*,*,RP) -----------------------------------------||
+ *          P || n/a | n/a ||  SY |  N  ||  SY |  N  ||
+ * ==================================================||
+ *          J ||  N  |  N  || n/a | n/a ||  N  |  Y  ||
+ *   (*,G)  -----------------------------------------||
+ *          P ||  N  |  N  || n/a | n/a ||  SY |  N  ||
+ * ==================================================||
+ *          J ||  N  |  N  ||  N  |  N  || n/a | n/a ||
+ *   (S,G)  -----------------------------------------||
+ *          P ||  N  |  N  ||  N  |  N  || n/a | n/a ||
+ * ==================================================
+ *
+ */
+void
+age_routes()
+{
+    mrtentry_t *mrtentry_ptr;
+    mrtentry_t **slot;
+    struct uvif *v;
+    vifi_t  vifi;
+    pim_nbr_entry_t *pim_nbr_ptr;
+
+    /*
+     * Timing out of the global `unicast_routing_timer`
+     * and `data_rate_timer`
+     */
+    IF_TIMEOUT(unicast_routing_timer) {
+	ucast_flag = TRUE;
+	SET_TIMER(unicast_routing_timer, unicast_routing_check_interval);
+    }
+    ELSE {
+	ucast_flag = FALSE;
+    }
+    IF_TIMEOUT(pim_data_rate_timer) {
+	pim_data_rate_flag = TRUE;
+	SET_TIMER(pim_data_rate_timer, pim_data_rate_check_interval);
+    }
+    ELSE {
+	pim_data_rate_flag = FALSE;
+    }
+    IF_TIMEOUT(pim_reg_rate_timer) {
+	pim_reg_rate_flag = TRUE;
+	SET_TIMER(pim_reg_rate_timer, pim_reg_rate_check_interval);
+    }
+    ELSE {
+	pim_reg_rate_flag = FALSE;
+    }
+
+    rate_flag = pim_data_rate_flag | pim_reg_rate_flag;
+
+    route_clock += TIMER_INTERVAL;
+    route_aging = TRUE;
+
+    /* Move the entries due now to the run queues */
+    slot = &route_wheel[(route_clock / TIMER_INTERVAL) % ROUTE_WHEEL_SIZE];
+    while ((mrtentry_ptr = *slot) != (mrtentry_t *)NULL) {
+	unschedule_mrtentry(mrtentry_ptr);
+	link_mrtentry(&route_runq[route_runq_of(mrtentry_ptr)],
+		      mrtentry_ptr, route_clock);
+    }
+
+    if ((ucast_flag == TRUE) || (rate_flag == TRUE))
+	check_routes();
+
+    run_route_queues();
+    route_aging = FALSE;
 
     /* TODO: check again! */
     for (vifi = 0, v = &uvifs[0]; vifi < numvifs; vifi++, v++) {
@@ -958,6 +1575,12 @@ age_routes()
 	     pim_nbr_ptr = pim_nbr_ptr->next) {
 	    pack_and_send_jp_message(pim_nbr_ptr);
 	}
+
+	/* Close this round of J/P messages for the statistics */
+	v->uv_jp_stats.burst_last = v->uv_jp_stats.burst;
+	if (v->uv_jp_stats.burst > v->uv_jp_stats.burst_max)
+	    v->uv_jp_stats.burst_max = v->uv_jp_stats.burst;
+	v->uv_jp_stats.burst = 0;
     }
     
     IF_DEBUG(DEBUG_PIM_MRT)
@@ -0,0 +1 @@
+char todaysversion[]="2.1.8";
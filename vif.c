@@ -164,12 +164,28 @@ void zero_vif(struct uvif *v, int t)
     RESET_TIMER(v->uv_leaf_timer);
     v->uv_addrs		= (struct phaddr *)NULL;
     v->uv_filter	= (struct vif_filter *)NULL;
-    RESET_TIMER(v->uv_pim_hello_timer);
+    v->uv_pim_hello_timerid = 0;
     RESET_TIMER(v->uv_gq_timer);
     RESET_TIMER(v->uv_jp_timer);
     v->uv_pim_neighbors	= (struct pim_nbr_entry *)NULL;
+    hash_free(&v->uv_pim_nbr_hash);
+    hash_init(&v->uv_pim_nbr_hash, "PIM neighbor", PIM_NBR_HASH_SIZE);
+    v->uv_pim_nbr_count	= 0;
     v->uv_local_pref	= default_source_preference;
     v->uv_local_metric	= default_source_metric;
+    v->uv_jp_rate	= 0;
+    v->uv_jp_byte_rate	= 0;
+    v->uv_jp_msg_tokens	= 0;
+    v->uv_jp_byte_tokens = 0;
+    v->uv_jp_refill	= 0;
+    v->uv_jp_txq	= (struct jp_txq_entry *)NULL;
+    v->uv_jp_txq_tail	= (struct jp_txq_entry *)NULL;
+    memset(&v->uv_jp_stats, 0, sizeof(v->uv_jp_stats));
+    v->uv_upcall_rate	= 0;
+    v->uv_upcall_tokens	= 0;
+    v->uv_upcall_refill	= 0;
+    v->uv_upcall_passed	= 0;
+    v->uv_upcall_dropped = 0;
 #ifdef __linux__
     v->uv_ifindex	= -1;
 #endif /* __linux__ */
@@ -294,7 +310,6 @@ static void start_vif(vifi_t vifi)
 	v->uv_flags = v->uv_flags & ~VIFF_DOWN;
     else {
 	v->uv_flags = (v->uv_flags | VIFF_DR | VIFF_NONBRS) & ~VIFF_DOWN;
-	SET_TIMER(v->uv_pim_hello_timer, 1 + RANDOM() % PIM_TIMER_HELLO_PERIOD);
 	SET_TIMER(v->uv_jp_timer, 1 + RANDOM() % PIM_JOIN_PRUNE_PERIOD);
 	/* TODO: CHECK THE TIMERS!!!!! Set or reset? */
 	RESET_TIMER(v->uv_gq_timer);
@@ -391,7 +406,8 @@ static void stop_vif(vifi_t vifi)
 
     v->uv_flags = (v->uv_flags & ~VIFF_DR & ~VIFF_QUERIER & ~VIFF_NONBRS) | VIFF_DOWN;
     if (!(v->uv_flags & VIFF_REGISTER)) {
-	RESET_TIMER(v->uv_pim_hello_timer);
+	timer_clearTimer(v->uv_pim_hello_timerid);
+	v->uv_pim_hello_timerid = 0;
 	RESET_TIMER(v->uv_jp_timer);
 	RESET_TIMER(v->uv_gq_timer);
 
@@ -400,6 +416,10 @@ static void stop_vif(vifi_t vifi)
 	    free((char *)n);
 	}
 	v->uv_pim_neighbors = NULL;
+	hash_free(&v->uv_pim_nbr_hash);
+	hash_init(&v->uv_pim_nbr_hash, "PIM neighbor", PIM_NBR_HASH_SIZE);
+	v->uv_pim_nbr_count = 0;
+	flush_jp_txq(vifi);
     }
 
     /* TODO: currently not used */
@@ -46,33 +46,127 @@
 
 /*
  * The VIFM_ functions should migrate out of <netinet/ip_mroute.h>, since
- * the kernel no longer uses vifbitmaps.
+ * the kernel no longer uses vifbitmaps.  The system ones are only one word
+ * wide, so replace them with our own.
  */
-#ifndef VIFM_SET
-
-typedef	u_int32 vifbitmap_t;
-
-#define	VIFM_SET(n, m)			((m) |=  (1 << (n)))
-#define	VIFM_CLR(n, m)			((m) &= ~(1 << (n)))
-#define	VIFM_ISSET(n, m)		((m) &   (1 << (n)))
-#define VIFM_CLRALL(m)			((m) = 0x00000000)
-#define VIFM_COPY(mfrom, mto)		((mto) = (mfrom))
-#define VIFM_SAME(m1, m2)		((m1) == (m2))
+#ifdef VIFM_SET
+#undef VIFM_SET
+#undef VIFM_CLR
+#undef VIFM_ISSET
+#undef VIFM_CLRALL
+#undef VIFM_COPY
+#undef VIFM_SAME
+#undef VIFM_SETALL
+#define vifbitmap_t			pim_vifbitmap_t
 #endif
+
 /*
- * And <netinet/ip_mroute.h> was missing some required functions anyway
+ * The width of the vif bitmaps is set at build time with VIFBITMAP_BITS,
+ * e.g. -DVIFBITMAP_BITS=256, and defaults to MAXVIFS.  The bitmap is an
+ * array of machine words, and the set operations below are simple loops
+ * over all words, which the compiler unrolls or vectorizes.
  */
-#if !defined(VIFM_SETALL)
-#define	VIFM_SETALL(m)			((m) = ~0)
+#ifndef VIFBITMAP_BITS
+#define VIFBITMAP_BITS			MAXVIFS
+#endif
+#if VIFBITMAP_BITS < MAXVIFS
+#error "VIFBITMAP_BITS must be at least MAXVIFS"
 #endif
-#define	VIFM_ISSET_ONLY(n, m)		((m) == (1 << (n)))
-#define	VIFM_ISEMPTY(m)			((m) == 0)
-#define	VIFM_CLR_MASK(m, mask)		((m) &= ~(mask))
-#define	VIFM_SET_MASK(m, mask)		((m) |= (mask))
-#define VIFM_MERGE(m1, m2, result)      ((result) = (m1) | (m2))
+
+typedef unsigned long vifbitmap_word_t;
+#define VIFM_WORD_BITS			(sizeof(vifbitmap_word_t) << 3)
+#define VIFM_WORDS			((VIFBITMAP_BITS + (sizeof(vifbitmap_word_t) << 3) - 1) \
+					 / (sizeof(vifbitmap_word_t) << 3))
+#define VIFM_WORD(n)			((n) / VIFM_WORD_BITS)
+#define VIFM_BIT(n)			((vifbitmap_word_t)1 << ((n) % VIFM_WORD_BITS))
+
+typedef struct {
+    vifbitmap_word_t word[VIFM_WORDS];
+} vifbitmap_t;
+
+#define	VIFM_SET(n, m)			((m).word[VIFM_WORD(n)] |=  VIFM_BIT(n))
+#define	VIFM_CLR(n, m)			((m).word[VIFM_WORD(n)] &= ~VIFM_BIT(n))
+#define	VIFM_ISSET(n, m)		(((m).word[VIFM_WORD(n)] & VIFM_BIT(n)) != 0)
+#define VIFM_CLRALL(m)			memset(&(m), 0, sizeof(vifbitmap_t))
+#define VIFM_COPY(mfrom, mto)		((mto) = (mfrom))
+#define VIFM_SAME(m1, m2)		vifm_same(&(m1), &(m2))
+#define	VIFM_SETALL(m)			memset(&(m), 0xff, sizeof(vifbitmap_t))
+#define	VIFM_ISSET_ONLY(n, m)		vifm_isset_only((n), &(m))
+#define	VIFM_ISEMPTY(m)			vifm_isempty(&(m))
+#define	VIFM_CLR_MASK(m, mask)		vifm_clr_mask(&(m), &(mask))
+#define	VIFM_SET_MASK(m, mask)		vifm_set_mask(&(m), &(mask))
+#define VIFM_MERGE(m1, m2, result)      vifm_merge(&(m1), &(m2), &(result))
 
 /* Check whether I am the last hop on some LAN */
-#define VIFM_LASTHOP_ROUTER(leaves, oifs)    ((leaves) & (oifs))
+#define VIFM_LASTHOP_ROUTER(leaves, oifs)    vifm_intersect(&(leaves), &(oifs))
+
+static inline int vifm_same(const vifbitmap_t *m1, const vifbitmap_t *m2)
+{
+    vifbitmap_word_t diff = 0;
+    size_t i;
+
+    for (i = 0; i < VIFM_WORDS; i++)
+	diff |= m1->word[i] ^ m2->word[i];
+
+    return diff == 0;
+}
+
+static inline int vifm_isempty(const vifbitmap_t *m)
+{
+    vifbitmap_word_t bits = 0;
+    size_t i;
+
+    for (i = 0; i < VIFM_WORDS; i++)
+	bits |= m->word[i];
+
+    return bits == 0;
+}
+
+static inline int vifm_isset_only(vifi_t n, const vifbitmap_t *m)
+{
+    vifbitmap_word_t diff = 0;
+    size_t i;
+
+    for (i = 0; i < VIFM_WORDS; i++)
+	diff |= m->word[i] ^ (i == VIFM_WORD(n) ? VIFM_BIT(n) : 0);
+
+    return diff == 0;
+}
+
+static inline void vifm_clr_mask(vifbitmap_t *m, const vifbitmap_t *mask)
+{
+    size_t i;
+
+    for (i = 0; i < VIFM_WORDS; i++)
+	m->word[i] &= ~mask->word[i];
+}
+
+static inline void vifm_set_mask(vifbitmap_t *m, const vifbitmap_t *mask)
+{
+    size_t i;
+
+    for (i = 0; i < VIFM_WORDS; i++)
+	m->word[i] |= mask->word[i];
+}
+
+static inline void vifm_merge(const vifbitmap_t *m1, const vifbitmap_t *m2, vifbitmap_t *result)
+{
+    size_t i;
+
+    for (i = 0; i < VIFM_WORDS; i++)
+	result->word[i] = m1->word[i] | m2->word[i];
+}
+
+static inline int vifm_intersect(const vifbitmap_t *m1, const vifbitmap_t *m2)
+{
+    vifbitmap_word_t bits = 0;
+    size_t i;
+
+    for (i = 0; i < VIFM_WORDS; i++)
+	bits |= m1->word[i] & m2->word[i];
+
+    return bits != 0;
+}
 
 /*
  * Neighbor bitmaps are, for efficiency, implemented as a struct
@@ -115,6 +209,22 @@ typedef struct {
     (((sub).lo & (vifmask).lo) == ((prunes).lo & (vifmask).lo & (sub).lo) && \
      ((sub).hi & (vifmask).hi) == ((prunes).hi & (vifmask).hi & (sub).hi))
 
+/*
+ * Join/Prune transmit statistics of a vif.  A burst is the number of
+ * J/P messages generated for the vif between two rounds of route aging,
+ * i.e., within TIMER_INTERVAL seconds.
+ */
+struct jp_stats {
+    u_long	    sent;		/* J/P messages sent		    */
+    u_long	    delayed;		/* ... of those held by the limit   */
+    u_long	    dropped;		/* dropped, the queue was full	    */
+    u_int	    queued;		/* currently waiting for tokens	    */
+    u_int	    queued_max;		/* highest queued ever		    */
+    u_int	    burst;		/* messages in the current round    */
+    u_int	    burst_last;		/* messages in the previous round   */
+    u_int	    burst_max;		/* largest burst ever		    */
+};
+
 /*
  * User level Virtual Interface structure
  *
@@ -150,17 +260,39 @@ struct uvif {
     int		     uv_leaf_timer; /* time until this vif is considrd leaf */
     struct phaddr   *uv_addrs;	    /* Additional subnets on this vif       */
     struct vif_filter *uv_filter;   /* Route filters on this vif	    */
-    u_int16	    uv_pim_hello_timer;/* timer for sending PIM hello msgs  */
+    int		    uv_pim_hello_timerid;/* callout for the next PIM hello  */
     u_int16	    uv_gq_timer;    /* Group Query timer        	    */
     u_int16         uv_jp_timer;    /* The Join/Prune timer                 */
     int             uv_local_pref;  /* default local preference for assert  */
     int             uv_local_metric;/* default local metric for assert      */
     struct pim_nbr_entry *uv_pim_neighbors; /* list of PIM neighbor routers */
+    hash_table_t    uv_pim_nbr_hash;/* index of uv_pim_neighbors, by address */
+    u_int	    uv_pim_nbr_count;/* number of PIM neighbor routers      */
+    u_int	    uv_jp_rate;     /* max. J/P messages/s, 0 for no limit  */
+    u_int	    uv_jp_byte_rate;/* max. J/P bytes/s, 0 for no limit     */
+    u_int32	    uv_jp_msg_tokens; /* J/P token buckets, in 1/1000 of a  */
+    u_int32	    uv_jp_byte_tokens;/* message and of a byte		    */
+    u_int32	    uv_jp_refill;   /* callout clock at the last refill     */
+    struct jp_txq_entry *uv_jp_txq; /* J/P messages waiting for tokens  */
+    struct jp_txq_entry *uv_jp_txq_tail;
+    struct jp_stats uv_jp_stats;    /* J/P transmit statistics		    */
+    u_int	    uv_upcall_rate; /* max. kernel upcalls/s, 0 for no limit */
+    u_int32	    uv_upcall_tokens;/* upcall token bucket, 1/1000 units   */
+    u_int32	    uv_upcall_refill;/* callout clock at the last refill    */
+    u_long	    uv_upcall_passed;/* upcalls processed		    */
+    u_long	    uv_upcall_dropped;/* upcalls over either limit	    */
 #ifdef __linux__
     int             uv_ifindex;     /* because RTNETLINK returns only index */
 #endif /* __linux__ */
 };
 
+#define PIM_NBR_HASH_SIZE	16	/* initial size of uv_pim_nbr_hash  */
+
+#define JP_MAX_RATE		10000	/* upper bound of uv_jp_rate	    */
+#define JP_MAX_BYTE_RATE	1000000	/* upper bound of uv_jp_byte_rate   */
+#define JP_TXQ_MAX		1024	/* max. J/P messages waiting per vif */
+#define UPCALL_MAX_RATE		100000	/* upper bound of the upcall rates  */
+
 /* TODO: define VIFF_KERNEL_FLAGS */
 #define VIFF_KERNEL_FLAGS	(VIFF_TUNNEL | VIFF_SRCRT)
 #define VIFF_DOWN		0x000100       /* kernel state of interface */
@@ -214,7 +346,7 @@ struct vf_element {
 struct listaddr {
     struct listaddr *al_next;		/* link to next addr, MUST BE FIRST */
     u_int32	     al_addr;		/* local group or neighbor address  */
-    u_long	     al_timer;		/* for timing out group or neighbor */
+    u_long	     al_timer;		/* group timeout, in msec	    */
     time_t	     al_ctime;		/* entry creation time		    */
     union {
     	u_int32	     alu_genid;		/* generation id for neighbor       */